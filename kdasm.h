@@ -26,6 +26,16 @@
 // Kdasm: k-d tree compressor with efficient cache-optimized runtime.
 
 typedef unsigned short KdasmU16;
+typedef unsigned int KdasmU32;
+typedef unsigned long long KdasmU64;
+
+#include <string.h>
+
+// Define KDASM_NO_SIMD to use the scalar decoders only.
+#if !defined(KDASM_NO_SIMD) && ( defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 ) )
+#define KDASM_SSE2 1
+#include <emmintrin.h>
+#endif
 
 // ----------------------------------------------------------------------------
 // KdasmEncoding is an encoding of a k-d tree node cutting plane, jump statement or leaves.
@@ -54,7 +64,11 @@ public:
         LEAF_WORD_LENGTH_MAX           = 0x001f,
         TREE_INDEX_MAX                 = 0x001f,
         IMMEDIATE_OFFSET_MAX           = 0x03ff,   // Max absolute value.  Negative values allowed.
-        LEAF_COUNT_OVERFLOW            = 0xffff,   // An embedded header in the leaf data is required beyond this.
+        FAR_WORDS_COUNT_MAX            = 0x0007,   // Max extra words used by a far offset that is not immediate.
+        // OPCODE_LEAVES_FAR header.  The KdasmU16 count follows in 2 words.  The value was
+        // reserved before this format, so VERSION_1 is kept.  Older readers assert on it.
+        LEAF_COUNT_OVERFLOW            = 0xffff,
+        LEAF_COUNT_OVERFLOW_LENGTH     = 0x0003,
         PAD_VALUE                      = 0xcccc    // Impossible x axis cut with both stop bits set.
     };
 
@@ -104,6 +118,14 @@ public:
         *d01greater = do01 + ((float)DISTANCE_IMMEDIATE_PLANE_WIDTH/(float)DISTANCE_IMMEDIATE_MAX + 2.0f*FLT_EPSILON);
     }
 
+    // For KdasmEncodingHeader::IsRelativeDistance().  d is quantized relative to the cell
+    // that the plane cuts.  See KdasmCell.
+    static KdasmU16 PackDistanceRelative( float d, float cellMin, float cellMax )
+    {
+        float extent = cellMax - cellMin;
+        return PackDistanceImmediate( ( extent > 0.0f ) ? ( d - cellMin ) / extent : 0.0f );
+    }
+
     // For distanceLength > 1.  The number of words used to encode distance is constant.
     template<int distanceLength> intptr_t UnpackDistance( void ) const
     {
@@ -195,17 +217,39 @@ public:
         PAGE_BITS_128B = 7
     };
 
+    enum LeafBits {
+        LEAF_BITS_16 = 0,
+        LEAF_BITS_32 = 1,
+        LEAF_BITS_64 = 2
+    };
+
     bool VersionCheck( void ) const             { return m_words[0] == VERSION_1; }
     // Number of KdasmU16 including prefix, or 1 for immediate storage.
     KdasmU16 GetDistanceLength( void ) const    { return m_words[1] & (KdasmU16)DISTANCE_LENGTH_MASK; }
     bool IsLeavesAtRoot( void ) const           { return ( m_words[1] & (KdasmU16)FLAG_LEAVES_AT_ROOT ) != 0; }
     PageBits GetPageBits( void ) const          { return (PageBits)((m_words[1] & (KdasmU16)PAGE_BITS_MASK) >> PAGE_BITS_SHIFT); }
+    // Leaf blocks are stored as KdasmPackedLeaves.  Lengths and headers count KdasmU16 stored.
+    bool IsPackedLeaves( void ) const           { return ( m_words[1] & (KdasmU16)FLAG_PACKED_LEAVES ) != 0; }
+    // Leaf blocks hold a KdasmLeafRange into an array kept outside of the encoding.
+    bool IsLeafRanges( void ) const             { return ( m_words[1] & (KdasmU16)FLAG_LEAF_RANGES ) != 0; }
+    // Immediate distances are relative to the cell being cut.  See KdasmCell.
+    bool IsRelativeDistance( void ) const       { return ( m_words[1] & (KdasmU16)FLAG_RELATIVE_DISTANCE ) != 0; }
+    // Leaf blocks not at the root, other than those with LEAF_COUNT_OVERFLOW, are
+    // preceded by a word holding the KdasmU16 reserved for their leaves.
+    bool IsLeafSlack( void ) const              { return ( m_words[1] & (KdasmU16)FLAG_LEAF_SLACK ) != 0; }
+    // Size of each leaf value.  See KdasmLeafSpan.
+    LeafBits GetLeafBits( void ) const          { return (LeafBits)((m_words[1] & (KdasmU16)LEAF_BITS_MASK) >> LEAF_BITS_SHIFT); }
 
     // internal
     void Reset( void )                          { m_words[0] = VERSION_1; m_words[1] = 0; }
     void SetDistanceLength( KdasmU16 dl )       { m_words[1] |= (KdasmU16)DISTANCE_LENGTH_MASK & dl; }
     void SetIsLeavesAtRoot( bool b )            { m_words[1] |= b ? (KdasmU16)FLAG_LEAVES_AT_ROOT : 0; }
     void SetPageBits( PageBits pb )             { m_words[1] |= (KdasmU16)PAGE_BITS_MASK & ((KdasmU16)pb << PAGE_BITS_SHIFT); }
+    void SetIsPackedLeaves( bool b )            { m_words[1] |= b ? (KdasmU16)FLAG_PACKED_LEAVES : 0; }
+    void SetLeafBits( LeafBits lb )             { m_words[1] |= (KdasmU16)LEAF_BITS_MASK & ((KdasmU16)lb << LEAF_BITS_SHIFT); }
+    void SetIsLeafRanges( bool b )              { m_words[1] |= b ? (KdasmU16)FLAG_LEAF_RANGES : 0; }
+    void SetIsRelativeDistance( bool b )        { m_words[1] |= b ? (KdasmU16)FLAG_RELATIVE_DISTANCE : 0; }
+    void SetIsLeafSlack( bool b )               { m_words[1] |= b ? (KdasmU16)FLAG_LEAF_SLACK : 0; }
     KdasmU16 GetRaw( int index ) const          { return m_words[index]; }
 
 private:
@@ -213,6 +257,8 @@ private:
     {
         char size_of_unsigned_short_incorrect[sizeof(KdasmU16) == 2];
         char size_of_int_incorrect[sizeof(int) >= 4];
+        char size_of_u32_incorrect[sizeof(KdasmU32) == 4];
+        char size_of_u64_incorrect[sizeof(KdasmU64) == 8];
         char size_of_encoding_incorrect[sizeof(KdasmEncoding) == 2];
         char sign_extended_shift_incorrect[((-1)>>1) == (-1)];
     };
@@ -223,10 +269,254 @@ private:
         FLAG_LEAVES_AT_ROOT  = 0x0008,    // Starts with a OPCODE_LEAVES_FAR reference.
         PAGE_BITS_MASK       = 0x00f0,
         PAGE_BITS_SHIFT      = 4,
+        FLAG_PACKED_LEAVES   = 0x0100,
+        LEAF_BITS_MASK       = 0x0600,
+        LEAF_BITS_SHIFT      = 9,
+        FLAG_LEAF_RANGES     = 0x0800,
+        FLAG_RELATIVE_DISTANCE = 0x1000,
+        FLAG_LEAF_SLACK      = 0x2000,
     };
 
     KdasmU16 m_words[HEADER_LENGTH];
 };
 
+// ----------------------------------------------------------------------------
+// KdasmCell tracks the bounds of the current cell during a traversal of an encoding
+// with KdasmEncodingHeader::IsRelativeDistance().  All 12 bits of each immediate
+// distance then span the cell being cut instead of [0..1].  The subcells overlap by
+// the quantized plane width so that the bounds stay conservative.  A builder has to
+// split its cells the same way as it quantizes the planes below them.
+
+struct KdasmCell
+{
+    float m_min[3];
+    float m_max[3];
+
+    void Split( KdasmU16 normal, KdasmU16 distanceImmediate, KdasmCell* less, KdasmCell* greater ) const
+    {
+        KdasmEncoding x;
+        x.SetRaw( distanceImmediate );
+        float d01less, d01greater;
+        x.UnpackDistanceImmediate( &d01less, &d01greater );
+
+        float extent = m_max[normal] - m_min[normal];
+        *less = *this;
+        *greater = *this;
+        less->m_max[normal] = m_min[normal] + extent * d01greater;
+        greater->m_min[normal] = m_min[normal] + extent * d01less;
+    }
+
+    // For encodings without KdasmEncodingHeader::IsRelativeDistance().
+    void SplitAbsolute( KdasmU16 normal, KdasmU16 distanceImmediate, KdasmCell* less, KdasmCell* greater ) const
+    {
+        KdasmEncoding x;
+        x.SetRaw( distanceImmediate );
+        float d01less, d01greater;
+        x.UnpackDistanceImmediate( &d01less, &d01greater );
+
+        *less = *this;
+        *greater = *this;
+        less->m_max[normal] = d01greater;
+        greater->m_min[normal] = d01less;
+    }
+
+    // Split by a cutting plane encoding.
+    void Split( const KdasmEncoding& encoding, KdasmCell* less, KdasmCell* greater ) const
+    {
+        Split( encoding.GetNomal(), encoding.GetDistanceImmediate(), less, greater );
+    }
+};
+
+// ----------------------------------------------------------------------------
+// KdasmLeafSpan reads a leaf block in place.  T is KdasmU16, KdasmU32 or KdasmU64 as
+// given by KdasmEncodingHeader::GetLeafBits().  Wider values are stored as KdasmU16
+// in native byte order and need not be aligned.
+
+template<typename T> class KdasmLeafSpan
+{
+public:
+    enum {
+        LEAF_WORDS = sizeof(T) / sizeof(KdasmU16)
+    };
+
+    KdasmLeafSpan( void ) : m_leaves( 0 ), m_size( 0 ) { }
+    KdasmLeafSpan( const KdasmEncoding* leaves, intptr_t size ) : m_leaves( leaves ), m_size( size ) { }
+
+    // From an OPCODE_LEAVES encoding.
+    static KdasmLeafSpan FromLeaves( const KdasmEncoding* encoding )
+    {
+        return KdasmLeafSpan( encoding + encoding->GetOffset(), (intptr_t)encoding->GetLength() / LEAF_WORDS );
+    }
+
+    // From the header addressed by an OPCODE_LEAVES_FAR encoding.
+    static KdasmLeafSpan FromLeavesFar( const KdasmEncoding* header )
+    {
+        intptr_t wordCount = (intptr_t)header->GetRaw();
+        if( wordCount == KdasmEncoding::LEAF_COUNT_OVERFLOW )
+        {
+            wordCount = ( (intptr_t)header[1].GetRaw() << 16 ) | (intptr_t)header[2].GetRaw();
+            return KdasmLeafSpan( header + KdasmEncoding::LEAF_COUNT_OVERFLOW_LENGTH, wordCount / LEAF_WORDS );
+        }
+        return KdasmLeafSpan( header + 1, wordCount / LEAF_WORDS );
+    }
+
+    intptr_t Size( void ) const                 { return m_size; }
+    T operator[]( intptr_t i ) const            { T x; ::memcpy( &x, m_leaves + i * LEAF_WORDS, sizeof x ); return x; }
+    const KdasmEncoding* GetWords( void ) const { return m_leaves; }
+
+private:
+    const KdasmEncoding* m_leaves;
+    intptr_t             m_size;
+};
+
+// ----------------------------------------------------------------------------
+// KdasmLeafRange is the leaf block format used with KdasmEncodingHeader::IsLeafRanges().
+// The leaves are kept in an array of their own in the order their blocks appear in
+// the encoding.  A block of 2 words holds the index of the first leaf and the leaf
+// count.  A block of 4 words holds each in 2 words, most significant first.
+
+struct KdasmLeafRange
+{
+    intptr_t m_start;
+    intptr_t m_count;
+
+    static KdasmLeafRange FromWords( const KdasmEncoding* words, intptr_t wordCount )
+    {
+        KdasmLeafRange r;
+        if( wordCount == 2 )
+        {
+            r.m_start = (intptr_t)words[0].GetRaw();
+            r.m_count = (intptr_t)words[1].GetRaw();
+        }
+        else
+        {
+            r.m_start = ( (intptr_t)words[0].GetRaw() << 16 ) | (intptr_t)words[1].GetRaw();
+            r.m_count = ( (intptr_t)words[2].GetRaw() << 16 ) | (intptr_t)words[3].GetRaw();
+        }
+        return r;
+    }
+
+    // From an OPCODE_LEAVES encoding.
+    static KdasmLeafRange FromLeaves( const KdasmEncoding* encoding )
+    {
+        return FromWords( encoding + encoding->GetOffset(), (intptr_t)encoding->GetLength() );
+    }
+
+    // From the header addressed by an OPCODE_LEAVES_FAR encoding.
+    static KdasmLeafRange FromLeavesFar( const KdasmEncoding* header )
+    {
+        return FromWords( header + 1, (intptr_t)header->GetRaw() );
+    }
+};
+
+// ----------------------------------------------------------------------------
+// KdasmPackedLeaves is the leaf block format used with KdasmEncodingHeader::IsPackedLeaves().
+// Suits sorted leaf ids with small gaps.  The first word holds the bit width of the
+// deltas and the leaf count, with the count in the next word if it is COUNT_ESCAPE or
+// more.  The first leaf follows and then the deltas from each leaf to the next,
+// modulo 0x10000, packed least significant bit first.
+
+class KdasmPackedLeaves
+{
+public:
+    enum {
+        BIT_WIDTH_MASK = 0x001f,
+        COUNT_SHIFT    = 5,
+        COUNT_ESCAPE   = 0x07ff
+    };
+
+    static intptr_t GetLeafCount( const KdasmEncoding* block )
+    {
+        intptr_t count = (intptr_t)( block->GetRaw() >> COUNT_SHIFT );
+        return ( count == COUNT_ESCAPE ) ? (intptr_t)block[1].GetRaw() : count;
+    }
+
+    // KdasmU16 stored for the block.
+    static intptr_t GetLength( const KdasmEncoding* block )
+    {
+        intptr_t count = GetLeafCount( block );
+        intptr_t headerLength = ( count >= COUNT_ESCAPE ) ? 2 : 1;
+        if( count == 0 )
+        {
+            return headerLength;
+        }
+        intptr_t bitWidth = (intptr_t)( block->GetRaw() & BIT_WIDTH_MASK );
+        return headerLength + 1 + ( ( count - 1 ) * bitWidth + 15 ) / 16;
+    }
+
+    // Expands the block into leaves, which must have room for GetLeafCount().  Returns
+    // the leaf count.  The deltas are summed 8 at a time with SSE2 when available.
+    static intptr_t Unpack( const KdasmEncoding* block, KdasmU16* leaves )
+    {
+#if defined(KDASM_SSE2)
+        intptr_t count = UnpackDeltas( block, leaves );
+        __m128i carry = _mm_set1_epi16( (short)leaves[0] );
+        intptr_t i = 1;
+        for( ; i + 8 <= count; i += 8 )
+        {
+            __m128i x = _mm_loadu_si128( (const __m128i*)( leaves + i ) );
+            x = _mm_add_epi16( x, _mm_slli_si128( x, 2 ) );
+            x = _mm_add_epi16( x, _mm_slli_si128( x, 4 ) );
+            x = _mm_add_epi16( x, _mm_slli_si128( x, 8 ) );
+            x = _mm_add_epi16( x, carry );
+            _mm_storeu_si128( (__m128i*)( leaves + i ), x );
+            carry = _mm_shufflehi_epi16( x, 0xff );
+            carry = _mm_unpackhi_epi64( carry, carry );
+        }
+        for( ; i < count; ++i )
+        {
+            leaves[i] = (KdasmU16)( leaves[i] + leaves[i - 1] );
+        }
+        return count;
+#else
+        return UnpackReference( block, leaves );
+#endif
+    }
+
+    // Scalar version of Unpack() for checking it.
+    static intptr_t UnpackReference( const KdasmEncoding* block, KdasmU16* leaves )
+    {
+        intptr_t count = UnpackDeltas( block, leaves );
+        for( intptr_t i=1; i < count; ++i )
+        {
+            leaves[i] = (KdasmU16)( leaves[i] + leaves[i - 1] );
+        }
+        return count;
+    }
+
+private:
+    // Leaves the first leaf followed by the deltas.
+    static intptr_t UnpackDeltas( const KdasmEncoding* block, KdasmU16* leaves )
+    {
+        intptr_t count = GetLeafCount( block );
+        int bitWidth = (int)( block->GetRaw() & BIT_WIDTH_MASK );
+        block += ( count >= COUNT_ESCAPE ) ? 2 : 1;
+        if( count == 0 )
+        {
+            return 0;
+        }
+
+        leaves[0] = block->GetRaw();
+        ++block;
+
+        unsigned int mask = ( 1u << bitWidth ) - 1u;
+        unsigned int bits = 0;
+        int bitCount = 0;
+        for( intptr_t i=1; i < count; ++i )
+        {
+            if( bitCount < bitWidth )
+            {
+                bits |= (unsigned int)block->GetRaw() << bitCount;
+                ++block;
+                bitCount += 16;
+            }
+            leaves[i] = (KdasmU16)( bits & mask );
+            bits >>= bitWidth;
+            bitCount -= bitWidth;
+        }
+        return count;
+    }
+};
+
 #endif // KDASM_H
 
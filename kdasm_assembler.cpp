@@ -3,6 +3,7 @@
 // Project Homepage: http://code.google.com/p/kdasm/
 
 #include <algorithm>
+#include <time.h>
 #include "kdasm_assembler.h"
 
 // ----------------------------------------------------------------------------
@@ -35,6 +36,14 @@ void KdasmAssemblerNode::Clear( void )
     }
 }
 
+KdasmAssemblerNode* KdasmAssemblerNode::DetachSubnode( intptr_t i )
+{
+    KdasmAssert( "Index out of range", i >= 0 && i < 2 );
+    KdasmAssemblerNode* subnode = m_subnodes[i];
+    m_subnodes[i] = NULL;
+    return subnode;
+}
+
 void KdasmAssemblerNode::AddSubnodes( KdasmU16 distance, KdasmU16 normal, KdasmAssemblerNode* less, KdasmAssemblerNode* greater )
 {
     AddSubnodes( &distance, 1, normal, less, greater );
@@ -76,15 +85,32 @@ void KdasmAssemblerNode::AddSubnodes( KdasmU16* distance, int distanceLength, Kd
 
 void KdasmAssemblerNode::AddLeaves( intptr_t leafCount, KdasmU16* leaves )
 {
-    // Direct support for larger blocks of leaf data would add runtime checks.
-    // Count will be returned as KdasmEncoding::LEAF_COUNT_OVERFLOW if it is larger
-    // than that and the user would have to have embedded a header in the leaf
-    // data to determine the real length.
-    KdasmAssert( "Leaf data block will overflow.  Will require a header.", leafCount < KdasmEncoding::LEAF_COUNT_OVERFLOW );
+    AddLeafWords( leafCount, leaves, KdasmEncodingHeader::LEAF_BITS_16 );
+}
+
+void KdasmAssemblerNode::AddLeaves( intptr_t leafCount, const KdasmU32* leaves )
+{
+    KdasmU16* words = new KdasmU16[leafCount * 2];
+    ::memcpy( words, leaves, leafCount * sizeof( KdasmU32 ) );
+    AddLeafWords( leafCount, words, KdasmEncodingHeader::LEAF_BITS_32 );
+}
+
+void KdasmAssemblerNode::AddLeaves( intptr_t leafCount, const KdasmU64* leaves )
+{
+    KdasmU16* words = new KdasmU16[leafCount * 4];
+    ::memcpy( words, leaves, leafCount * sizeof( KdasmU64 ) );
+    AddLeafWords( leafCount, words, KdasmEncodingHeader::LEAF_BITS_64 );
+}
+
+// Blocks of KdasmEncoding::LEAF_COUNT_OVERFLOW words or more have a 32 bit count.
+void KdasmAssemblerNode::AddLeafWords( intptr_t leafCount, KdasmU16* words, KdasmEncodingHeader::LeafBits leafBits )
+{
+    KdasmAssert( "Leaf data block is too large", leafCount >= 0 && ( (KdasmU64)leafCount << leafBits ) <= 0xffffffffull );
 
     Clear();
     m_leafCount = leafCount;
-    m_leaves = leaves;
+    m_leaves = words;
+    m_leafBits = leafBits;
 }
 
 bool KdasmAssemblerNode::Equals( const KdasmAssemblerNode& n, bool checkSubnodes ) const
@@ -118,11 +144,11 @@ bool KdasmAssemblerNode::Equals( const KdasmAssemblerNode& n, bool checkSubnodes
         return ( m_subnodes[0] == NULL || m_subnodes[0]->Equals( *n.m_subnodes[0], checkSubnodes ) )
             && ( m_subnodes[1] == NULL || m_subnodes[1]->Equals( *n.m_subnodes[1], checkSubnodes ) );
     }
-    if( m_leafCount != n.m_leafCount )
+    if( m_leafCount != n.m_leafCount || m_leafBits != n.m_leafBits )
     {
         return false;
     }
-    return ::memcmp( m_leaves, n.m_leaves, m_leafCount * sizeof( KdasmU16 ) ) == 0;
+    return ::memcmp( m_leaves, n.m_leaves, ( m_leafCount << m_leafBits ) * sizeof( KdasmU16 ) ) == 0;
 }
 
 bool KdasmAssemblerNode::TrimEmpty( void )
@@ -143,6 +169,62 @@ bool KdasmAssemblerNode::TrimEmpty( void )
     return m_leafCount == 0;
 }
 
+double KdasmAssemblerNode::CalculateSubtreeWeight( void ) const
+{
+    if( m_weight > 0.0 )
+    {
+        return m_weight;
+    }
+    if( !HasSubnodes() )
+    {
+        return 1.0;
+    }
+
+    double weight = 0.0;
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( m_subnodes[i] )
+        {
+            weight += m_subnodes[i]->CalculateSubtreeWeight();
+        }
+    }
+    return weight;
+}
+
+void KdasmAssemblerNode::SetVirtualPage( KdasmAssemblerVirtualPage* pg )
+{
+    m_virtualPage = pg;
+
+    // Identical subtrees are referenced where the shared encoding is.
+    if( m_nodeTempData && !m_nodeTempData->m_sharedNode )
+    {
+        for( KdasmAssemblerNode* n = m_nodeTempData->m_nextShare; n; n = n->m_nodeTempData->m_nextShare )
+        {
+            n->m_virtualPage = pg;
+        }
+    }
+}
+
+bool KdasmAssemblerNode::IsSharedSubtree( void ) const
+{
+    return m_nodeTempData && !m_nodeTempData->m_sharedNode && m_nodeTempData->m_nextShare;
+}
+
+intptr_t KdasmAssemblerNode::GetLeafWordCount( void ) const
+{
+    return ( m_nodeTempData && m_nodeTempData->m_leafWords ) ? m_nodeTempData->m_leafWordCount : m_leafCount << m_leafBits;
+}
+
+intptr_t KdasmAssemblerNode::GetLeafCapacity( void ) const
+{
+    return GetLeafWordCount() + ( m_nodeTempData ? m_nodeTempData->m_leafSlackWords : 0 );
+}
+
+const KdasmU16* KdasmAssemblerNode::GetLeafWords( void ) const
+{
+    return ( m_nodeTempData && m_nodeTempData->m_leafWords ) ? m_nodeTempData->m_leafWords : m_leaves;
+}
+
 intptr_t KdasmAssemblerNode::GetPhysicalPageStart( void )
 {
     return GetVirtualPage()->GetPhysicalPageStart();
@@ -166,6 +248,10 @@ intptr_t KdasmAssemblerNode::AssemblePrepare( KdasmAssemblerNode* supernode, int
     KdasmAssemblerPagePacker::ClearEncodingIndices( &m_nodeTempData->m_internalIndices );
     KdasmAssemblerPagePacker::ClearEncodingIndices( &m_nodeTempData->m_externalIndices );
 
+    // Subtree weight for now.  See AssembleWeights().
+    double weight = HasSubnodes() ? 0.0 : 1.0;
+    m_nodeTempData->m_height = 1;
+
     for( intptr_t i=0; i < 2; ++i )
     {
         if( m_subnodes[i] )
@@ -174,11 +260,110 @@ intptr_t KdasmAssemblerNode::AssemblePrepare( KdasmAssemblerNode* supernode, int
             KdasmAssert( "Distance length cannot vary within the tree", \
                 !m_subnodes[i]->HasSubnodes() || m_subnodes[i]->GetDistanceLength() == GetDistanceLength() );
             nextCompareToId = m_subnodes[i]->AssemblePrepare( this, nextCompareToId + 1 );
+            weight += m_subnodes[i]->GetNodeTemp()->m_weight;
+            m_nodeTempData->m_height = std::max( m_nodeTempData->m_height, m_subnodes[i]->GetNodeTemp()->m_height + 1 );
         }
     }
+    m_nodeTempData->m_weight = ( m_weight > 0.0 ) ? m_weight : weight;
     return nextCompareToId;
 }
 
+// Scales the subtree weights so the subnodes sum to the weight of their supernode.
+void KdasmAssemblerNode::AssembleWeights( double weight )
+{
+    if( m_nodeTempData->m_sharedNode )
+    {
+        m_nodeTempData->m_weight = weight;
+        return; // The subnodes are not assembled.
+    }
+
+    double subnodesWeight = 0.0;
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( m_subnodes[i] )
+        {
+            subnodesWeight += m_subnodes[i]->GetNodeTemp()->m_weight;
+        }
+    }
+
+    m_nodeTempData->m_weight = weight;
+
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( m_subnodes[i] )
+        {
+            m_subnodes[i]->AssembleWeights( weight * m_subnodes[i]->GetNodeTemp()->m_weight / subnodesWeight );
+        }
+    }
+}
+
+// Stores each leaf block as KdasmPackedLeaves.
+void KdasmAssemblerNode::AssemblePackLeaves( void )
+{
+    if( HasSubnodes() )
+    {
+        for( intptr_t i=0; i < 2; ++i )
+        {
+            if( m_subnodes[i] )
+            {
+                m_subnodes[i]->AssemblePackLeaves();
+            }
+        }
+        return;
+    }
+
+    KdasmAssert( "Packed leaves must be 16 bit", m_leafBits == KdasmEncodingHeader::LEAF_BITS_16 );
+    KdasmAssert( "Packed leaf block is too large", m_leafCount < KdasmEncoding::LEAF_COUNT_OVERFLOW );
+
+    int bitWidth = 0;
+    for( intptr_t i=1; i < m_leafCount; ++i )
+    {
+        KdasmU16 delta = (KdasmU16)( m_leaves[i] - m_leaves[i - 1] );
+        while( ( delta >> bitWidth ) != 0 )
+        {
+            ++bitWidth;
+        }
+    }
+
+    intptr_t headerLength = ( m_leafCount >= KdasmPackedLeaves::COUNT_ESCAPE ) ? 2 : 1;
+    intptr_t wordCount = headerLength + ( ( m_leafCount > 0 ) ? 1 + ( ( m_leafCount - 1 ) * bitWidth + 15 ) / 16 : 0 );
+    KdasmU16* words = new KdasmU16[wordCount];
+
+    words[0] = (KdasmU16)( bitWidth | ( std::min( m_leafCount, (intptr_t)KdasmPackedLeaves::COUNT_ESCAPE ) << KdasmPackedLeaves::COUNT_SHIFT ) );
+    if( headerLength == 2 )
+    {
+        words[1] = (KdasmU16)m_leafCount;
+    }
+
+    KdasmU16* w = words + headerLength;
+    if( m_leafCount > 0 )
+    {
+        *w++ = m_leaves[0];
+    }
+    unsigned int bits = 0;
+    int bitCount = 0;
+    for( intptr_t i=1; i < m_leafCount; ++i )
+    {
+        bits |= (unsigned int)(KdasmU16)( m_leaves[i] - m_leaves[i - 1] ) << bitCount;
+        bitCount += bitWidth;
+        if( bitCount >= 16 )
+        {
+            *w++ = (KdasmU16)bits;
+            bits >>= 16;
+            bitCount -= 16;
+        }
+    }
+    if( bitCount > 0 )
+    {
+        *w++ = (KdasmU16)bits;
+    }
+    KdasmAssertInternal( w == words + wordCount );
+    KdasmAssertInternal( KdasmPackedLeaves::GetLength( (const KdasmEncoding*)words ) == wordCount );
+
+    m_nodeTempData->m_leafWords = words;
+    m_nodeTempData->m_leafWordCount = wordCount;
+}
+
 void KdasmAssemblerNode::AssembleFinish( void )
 {
     KdasmAssertInternal( m_pageTempData == NULL );
@@ -186,6 +371,7 @@ void KdasmAssemblerNode::AssembleFinish( void )
     m_virtualPage = NULL;
     if( m_nodeTempData )
     {
+        delete[] m_nodeTempData->m_leafWords;
         delete m_nodeTempData;
         m_nodeTempData = NULL;
     }
@@ -251,6 +437,16 @@ void KdasmAssemblerVirtualPage::AppendSuperpages( std::vector<KdasmAssemblerVirt
                 pages.push_back( n->GetVirtualPage() );
             }
         }
+
+        // The supernodes of identical subtrees reference the encoding as well.
+        for( KdasmAssemblerNode* s = additionalNodes[i]->GetNodeTemp()->m_nextShare; s; s = s->GetNodeTemp()->m_nextShare )
+        {
+            n = s->GetNodeTemp()->m_supernode;
+            if( n->GetVirtualPage() != this && std::find( pages.begin(), pages.end(), n->GetVirtualPage() ) == pages.end() )
+            {
+                pages.push_back( n->GetVirtualPage() );
+            }
+        }
     }
 }
 
@@ -261,8 +457,9 @@ void KdasmAssemblerVirtualPage::FindSubpages( std::vector<KdasmAssemblerVirtualP
     {
         for( intptr_t j=0; j < 2; ++j )
         {
+            // Shared encodings are only a subpage of their own supernode's page.
             KdasmAssemblerNode* sn = m_nodes[i]->GetSubnode( j );
-            if( sn && sn->GetVirtualPage() != this )
+            if( sn && sn->GetVirtualPage() != this && !sn->GetNodeTemp()->m_sharedNode )
             {
                 if( std::find( pages.begin(), pages.end(), sn->GetVirtualPage() ) == pages.end() )
                 {
@@ -316,7 +513,8 @@ intptr_t KdasmAssemblerPageAllocator::GetPhysicalPagesRequired( KdasmAssemblerNo
 
     // The leaf block prefix word is accounted for.
     intptr_t header = ( n->GetNodeTemp()->m_supernode == NULL ) ? KdasmEncodingHeader::HEADER_LENGTH : 0;
-    return ( n->GetLeafCount() + header + m_physicalPageWords ) / m_physicalPageWords;
+    header += KdasmAssemblerPagePacker::CalculateLeafHeaderLength( n ) - 1 + KdasmAssemblerPagePacker::CalculateLeafCapacityLength( n );
+    return ( n->GetLeafCapacity() + header + m_physicalPageWords ) / m_physicalPageWords;
 }
 
 KdasmAssemblerVirtualPage* KdasmAssemblerPageAllocator::Allocate( intptr_t physicalPageCount )
@@ -457,7 +655,7 @@ void KdasmAssemblerNodeBreadthFirstQueue::Init( KdasmAssemblerNode* root, KdasmA
     {
         ptrdiff_t pagesRequired = pgAlloc.GetPhysicalPagesRequired( root );
         pgAlloc.Allocate( pagesRequired )->InsertNode( root );
-        root->GetNodeTemp()->m_forceFarAddressing = root->GetLeafCount() > KdasmEncoding::LEAF_WORD_LENGTH_MAX;
+        root->GetNodeTemp()->m_forceFarAddressing = root->GetLeafCapacity() > KdasmEncoding::LEAF_WORD_LENGTH_MAX || root->IsSharedSubtree();
     }
     m_nodes.push_back( root );
 }
@@ -476,12 +674,18 @@ KdasmAssemblerNode* KdasmAssemblerNodeBreadthFirstQueue::GetNext( KdasmAssembler
     {
         if( n->GetSubnode( i ) )
         {
+            // A far reference to a shared encoding needs the page it is in.
             KdasmAssemblerNode* sn = n->GetSubnode( i );
+            if( sn->GetNodeTemp()->m_sharedNode )
+            {
+                sn = sn->GetNodeTemp()->m_sharedNode;
+            }
             if( !sn->GetVirtualPage() )
             {
                 ptrdiff_t pagesRequired = pgAlloc.GetPhysicalPagesRequired( sn );
                 pgAlloc.Allocate( pagesRequired )->InsertNode( sn );
-                sn->GetNodeTemp()->m_forceFarAddressing = sn->GetLeafCount() > KdasmEncoding::LEAF_WORD_LENGTH_MAX;
+                // Shared leaf blocks need a header.
+                sn->GetNodeTemp()->m_forceFarAddressing = sn->GetLeafCapacity() > KdasmEncoding::LEAF_WORD_LENGTH_MAX || sn->IsSharedSubtree();
             }
         }
     }
@@ -499,10 +703,21 @@ void KdasmAssemblerNodeBreadthFirstQueue::PopNext( bool addSubnodes )
     {
         for( intptr_t i=0; i < 2; ++i )
         {
-            if( n->GetSubnode( i ) )
+            if( n->GetSubnode( i ) && !n->GetSubnode( i )->GetNodeTemp()->m_sharedNode )
             {
                 KdasmAssemblerNode* sn = n->GetSubnode( i );
-                m_nodes.push_back( sn );
+                if( m_order == ORDER_HEAVIEST_FIRST )
+                {
+                    m_nodes.insert( std::upper_bound( m_nodes.begin(), m_nodes.end(), sn, CompareByWeight ), sn );
+                }
+                else if( m_order == ORDER_DEEPEST_FIRST )
+                {
+                    m_nodes.insert( std::upper_bound( m_nodes.begin(), m_nodes.end(), sn, CompareByHeight ), sn );
+                }
+                else
+                {
+                    m_nodes.push_back( sn );
+                }
             }
         }
     }
@@ -513,6 +728,21 @@ void KdasmAssemblerNodeBreadthFirstQueue::Prepend( KdasmAssemblerNode* n )
     m_nodes.push_front( n );
 }
 
+bool KdasmAssemblerNodeBreadthFirstQueue::CompareByWeight( const KdasmAssemblerNode* a, const KdasmAssemblerNode* b )
+{
+    return a->GetNodeTemp()->m_weight > b->GetNodeTemp()->m_weight;
+}
+
+// Heavier subtrees go first among those of the same height.
+bool KdasmAssemblerNodeBreadthFirstQueue::CompareByHeight( const KdasmAssemblerNode* a, const KdasmAssemblerNode* b )
+{
+    if( a->GetNodeTemp()->m_height != b->GetNodeTemp()->m_height )
+    {
+        return a->GetNodeTemp()->m_height > b->GetNodeTemp()->m_height;
+    }
+    return a->GetNodeTemp()->m_weight > b->GetNodeTemp()->m_weight;
+}
+
 // ----------------------------------------------------------------------------
 // KdasmAssemblerPagePacker
 
@@ -521,6 +751,16 @@ KdasmAssemblerPagePacker::KdasmAssemblerPagePacker( void )
     Clear();
 }
 
+void KdasmAssemblerPagePacker::SetExactSearchLimit( intptr_t limit )
+{
+    m_exactSearchLimit = limit;
+}
+
+void KdasmAssemblerPagePacker::SetExactSearchFailuresOnly( bool b )
+{
+    m_exactSearchFailuresOnly = b;
+}
+
 void KdasmAssemblerPagePacker::SetPageSize( int pageBits )
 {
     // Words are two bytes wide.
@@ -573,7 +813,7 @@ bool KdasmAssemblerPagePacker::Pack( KdasmAssemblerVirtualPage* p, bool saveIfOk
     return packOk;
 }
 
-std::vector<KdasmEncoding>& KdasmAssemblerPagePacker::Encode( KdasmAssemblerVirtualPage* p )
+void KdasmAssemblerPagePacker::Encode( KdasmAssemblerVirtualPage* p, KdasmEncoding* encoding )
 {
     m_virtualPage = p;
 
@@ -592,15 +832,16 @@ std::vector<KdasmEncoding>& KdasmAssemblerPagePacker::Encode( KdasmAssemblerVirt
     KdasmAssertInternal( ValidateAllocationMap() );
 #endif
 
-    KdasmEncoding t;
-    t.SetRaw( (KdasmU16)KdasmEncoding::PAD_VALUE );
-    m_encoding.assign( m_currentPageWords, t );
+    m_encoding = encoding;
+    for( intptr_t i=0; i < m_currentPageWords; ++i )
+    {
+        m_encoding[i].SetRaw( (KdasmU16)KdasmEncoding::PAD_VALUE );
+    }
 
     WriteEncoding();
 
     ClearNodeTempData();
-
-    return m_encoding;
+    m_encoding = NULL;
 }
 
 void KdasmAssemblerPagePacker::Clear( void )
@@ -609,11 +850,16 @@ void KdasmAssemblerPagePacker::Clear( void )
     m_currentPageWords = 0;
     m_virtualPage = NULL;
     m_allocationMap.clear();
-    m_encoding.clear();
+    m_encoding = NULL;
     m_pageTempData.clear();
     m_bestFitTreeRoot = -1;
     m_bestFitPageIndex = -1;
     m_bestFitTreeIndex = -1;
+    m_exactSearchLimit = 0;
+    m_exactSearchRemaining = 0;
+    m_bestPadding = 0;
+    m_exactSearchFailuresOnly = false;
+    m_searchStates.clear();
 }
 
 void KdasmAssemblerPagePacker::ClearEncodingIndices( KdasmAssemblerEncodingIndices* indices )
@@ -665,8 +911,9 @@ void KdasmAssemblerPagePacker::BuildNodeTempData( KdasmAssemblerNode** additiona
             {
                 if( n->GetSubnode( j ) )
                 {
+                    // References to shared encodings are always far.
                     KdasmAssemblerNode* sn = n->GetSubnode( j );
-                    if( sn->GetVirtualPage() != m_virtualPage )
+                    if( sn->GetVirtualPage() != m_virtualPage || sn->GetNodeTemp()->m_sharedNode )
                     {
                         KdasmAssertInternal( !sn->GetPageTemp() );
                         t.m_node = sn;
@@ -756,15 +1003,69 @@ bool KdasmAssemblerPagePacker::PackEncodingWords( void )
         }
     }
 
-    while( !m_treeRootsRemaining.empty() )
+    // The root node is packed first as it must directly follow the header.
+    // Merges may have left other trees in the root page.
+    if( m_virtualPage->GetPhysicalPageStart() == 0 )
+    {
+        for( size_t i=0; i < m_treeRootsRemaining.size(); ++i )
+        {
+            KdasmAssemblerPageTempData* t = m_treeRootsRemaining[i];
+            if( t->m_node->GetNodeTemp()->m_supernode == NULL )
+            {
+                if( m_virtualPage->PageStart() >= m_extraDataStart )
+                {
+                    m_treeRootsRemaining.clear();
+                    return false;
+                }
+                m_treeRootsRemaining.erase( m_treeRootsRemaining.begin() + i );
+                CommitSubtreePacking( t, m_virtualPage->PageStart(), 0 );
+                break;
+            }
+        }
+    }
+
+    // Small pages are searched exhaustively when the greedy packing needs
+    // internal jumps or fails.  The result leaving the most padding is used.
+    bool searchOk = m_exactSearchLimit > 0 && m_currentPageWords <= EXACT_SEARCH_MAX_PAGE_WORDS;
+    if( searchOk )
+    {
+        SavePackingState( m_initialState );
+    }
+
+    bool packOk = PackTreeRootsGreedy();
+    intptr_t internalJumps = packOk ? CountInternalJumps() : 0;
+    if( searchOk && ( !packOk || ( internalJumps > 0 && !m_exactSearchFailuresOnly ) ) )
     {
-        PackingStats bestFit;
-        bestFit.m_encodingWords = 0;
-        bestFit.m_internalJumps = 1; // No point adding a single jump.
+        m_bestPadding = -1; // No packing found.
+        if( packOk )
+        {
+            m_bestPadding = CountPadding();
+            SavePackingState( m_bestState );
+        }
+
+        RestorePackingState( m_initialState );
+        m_exactSearchRemaining = m_exactSearchLimit;
+        SearchTreeRoots();
+
+        if( m_bestPadding >= 0 )
+        {
+            RestorePackingState( m_bestState );
+            packOk = true;
+        }
+        m_treeRootsRemaining.clear();
+    }
+    return packOk;
+}
 
+bool KdasmAssemblerPagePacker::PackTreeRootsGreedy( void )
+{
+    while( !m_treeRootsRemaining.empty() )
+    {
         m_bestFitTreeRoot = -1;
         m_bestFitPageIndex = -1;
         m_bestFitTreeIndex = -1;
+        m_bestFit.m_encodingWords = 0;
+        m_bestFit.m_internalJumps = 1; // No point adding a single jump.
 
         for( intptr_t i=0; i < (intptr_t)m_treeRootsRemaining.size(); ++i )
         {
@@ -784,7 +1085,7 @@ bool KdasmAssemblerPagePacker::PackEncodingWords( void )
                     }
                     for( intptr_t treeIndex=0; treeIndex < treeIndexEnd; ++treeIndex )
                     {
-                        if( EvaluatePacking( i, index, treeIndex, bestFit ) )
+                        if( EvaluatePacking( i, index, treeIndex ) )
                         {
                             break;
                         }
@@ -792,7 +1093,7 @@ bool KdasmAssemblerPagePacker::PackEncodingWords( void )
                 }
                 else
                 {
-                    EvaluatePacking( i, index, 0, bestFit );
+                    EvaluatePacking( i, index, 0 );
                 }
             }
         }
@@ -812,8 +1113,150 @@ bool KdasmAssemblerPagePacker::PackEncodingWords( void )
     return true;
 }
 
+// Tries every placement of the first remaining tree root and recurses.  Tree
+// roots added for internal jumps are placed after the others.  Each internal jump
+// takes a word that would have been left as padding.
+void KdasmAssemblerPagePacker::SearchTreeRoots( void )
+{
+    if( m_exactSearchRemaining <= 0 )
+    {
+        return;
+    }
+    intptr_t wordsFree = CountPadding();
+    if( m_treeRootsRemaining.empty() )
+    {
+        if( wordsFree > m_bestPadding )
+        {
+            m_bestPadding = wordsFree;
+            SavePackingState( m_bestState );
+        }
+        return;
+    }
+
+    // The remaining trees need at least this many words without any jumps.
+    intptr_t wordsRequired = 0;
+    for( size_t i=0; i < m_treeRootsRemaining.size(); ++i )
+    {
+        wordsRequired += CountSubtreeWords( m_treeRootsRemaining[i] );
+    }
+    if( wordsFree - wordsRequired <= m_bestPadding )
+    {
+        return;
+    }
+
+    m_searchStates.resize( m_searchStates.size() + 1 );
+    size_t depth = m_searchStates.size() - 1;
+    SavePackingState( m_searchStates[depth] );
+
+    KdasmAssemblerPageTempData* t = m_treeRootsRemaining[0];
+    bool anyTreeIndex = t->m_indices.m_treeIndex != 0;
+    for( intptr_t index=m_virtualPage->PageStart(); index < m_extraDataStart; ++index )
+    {
+        if( m_allocationMap[index] != NULL )
+        {
+            continue;
+        }
+
+        intptr_t treeIndexEnd = anyTreeIndex ? std::min( m_extraDataStart - index, (intptr_t)KdasmEncoding::TREE_INDEX_MAX+1 ) : 1;
+        for( intptr_t treeIndex=0; treeIndex < treeIndexEnd && m_exactSearchRemaining > 0; ++treeIndex )
+        {
+            // A tree root whose own subnodes do not fit would only jump again.
+            if( !SubnodesFit( t, index, treeIndex ) )
+            {
+                continue;
+            }
+            --m_exactSearchRemaining;
+
+            m_treeRootsRemaining.erase( m_treeRootsRemaining.begin() );
+            CommitSubtreePacking( t, index, treeIndex );
+            SearchTreeRoots();
+
+            RestorePackingState( m_searchStates[depth] );
+        }
+    }
+
+    m_searchStates.pop_back();
+}
+
+bool KdasmAssemblerPagePacker::SubnodesFit( KdasmAssemblerPageTempData* t, intptr_t index, intptr_t treeIndex )
+{
+    for( intptr_t j=0; j < 2; ++j )
+    {
+        if( t->m_node->GetSubnode( j ) )
+        {
+            intptr_t subIndex = index + treeIndex + 1 + j;
+            if( subIndex >= m_extraDataStart || m_allocationMap[subIndex] != NULL )
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Words used by the tree if all of its nodes fit without internal jumps.
+intptr_t KdasmAssemblerPagePacker::CountSubtreeWords( KdasmAssemblerPageTempData* t )
+{
+    KdasmAssemblerNode* n = t->m_node;
+    if( t->m_isExternal || !n->HasSubnodes() )
+    {
+        return 1;
+    }
+
+    intptr_t words = 1;
+    for( intptr_t j=0; j < 2; ++j )
+    {
+        if( n->GetSubnode( j ) )
+        {
+            words += CountSubtreeWords( n->GetSubnode( j )->GetPageTemp() );
+        }
+    }
+    return words;
+}
+
+intptr_t KdasmAssemblerPagePacker::CountInternalJumps( void )
+{
+    intptr_t internalJumps = 0;
+    for( size_t i=0; i < m_pageTempData.size(); ++i )
+    {
+        if( m_pageTempData[i].m_indices.m_internalJumpIndex != -1 )
+        {
+            ++internalJumps;
+        }
+    }
+    return internalJumps;
+}
+
+// Free words in the page before the extra data.
+intptr_t KdasmAssemblerPagePacker::CountPadding( void )
+{
+    return std::count( m_allocationMap.begin() + m_virtualPage->PageStart(),
+        m_allocationMap.begin() + m_extraDataStart, (KdasmAssemblerPageTempData*)NULL );
+}
+
+void KdasmAssemblerPagePacker::SavePackingState( PackingState& state )
+{
+    state.m_allocationMap = m_allocationMap;
+    state.m_treeRootsRemaining = m_treeRootsRemaining;
+    state.m_indices.resize( m_pageTempData.size() );
+    for( size_t i=0; i < m_pageTempData.size(); ++i )
+    {
+        state.m_indices[i] = m_pageTempData[i].m_indices;
+    }
+}
+
+void KdasmAssemblerPagePacker::RestorePackingState( const PackingState& state )
+{
+    m_allocationMap = state.m_allocationMap;
+    m_treeRootsRemaining = state.m_treeRootsRemaining;
+    for( size_t i=0; i < m_pageTempData.size(); ++i )
+    {
+        m_pageTempData[i].m_indices = state.m_indices[i];
+    }
+}
+
 // Returns true if no improvement is possible.
-bool KdasmAssemblerPagePacker::EvaluatePacking( intptr_t treeRoot, intptr_t index, intptr_t treeIndex, PackingStats& bestFit )
+bool KdasmAssemblerPagePacker::EvaluatePacking( intptr_t treeRoot, intptr_t index, intptr_t treeIndex )
 {
     KdasmAssemblerPageTempData* t = m_treeRootsRemaining[treeRoot];
 
@@ -823,10 +1266,11 @@ bool KdasmAssemblerPagePacker::EvaluatePacking( intptr_t treeRoot, intptr_t inde
 
     EvaluateSubnodePacking( t, index, treeIndex, stats );
 
-    if( bestFit.m_encodingWords < stats.m_encodingWords 
-        || ( bestFit.m_encodingWords == stats.m_encodingWords && bestFit.m_internalJumps < stats.m_internalJumps ) )
+    bool isBetter = m_bestFit.m_encodingWords < stats.m_encodingWords
+        || ( m_bestFit.m_encodingWords == stats.m_encodingWords && m_bestFit.m_internalJumps < stats.m_internalJumps );
+    if( isBetter )
     {
-        bestFit = stats;
+        m_bestFit = stats;
         m_bestFitTreeRoot = treeRoot;
         m_bestFitPageIndex = index;
         m_bestFitTreeIndex = treeIndex;
@@ -979,12 +1423,12 @@ intptr_t KdasmAssemblerPagePacker::CalculateNodeExtraDataSize( KdasmAssemblerPag
             if( t->m_isPageRoot )
             {
                 // Referenced by OPCODE_LEAVES_FAR.  Requires header.
-                return n->GetLeafCount() + 1;
+                return CalculateLeafCapacityLength( n ) + CalculateLeafHeaderLength( n ) + n->GetLeafCapacity();
             }
             else
             {
                 // OPCODE_LEAVES.
-                return n->GetLeafCount();
+                return CalculateLeafCapacityLength( n ) + n->GetLeafCapacity();
             }
         }
     }
@@ -993,14 +1437,32 @@ intptr_t KdasmAssemblerPagePacker::CalculateNodeExtraDataSize( KdasmAssemblerPag
         // OPCODE_JUMP_FAR or OPCODE_LEAVES_FAR.  This allows for subsequent
         // assignment of the actual locations.
 
-        intptr_t physicalPageDelta = ::abs( m_virtualPage->GetPhysicalPageStart() - n->GetVirtualPage()->GetPhysicalPageStart() );
-        physicalPageDelta += m_virtualPage->GetPhysicalPageCount() + n->GetVirtualPage()->GetPhysicalPageCount();
-        physicalPageDelta <<= m_pageWordBits;
-
-        return CalculateWordsRequired( physicalPageDelta );
+        return CalculateFarWordsRequired( m_virtualPage, n->GetVirtualPage(), m_pageWordBits );
     }
 }
 
+// Leaf blocks referenced by OPCODE_LEAVES_FAR start with their length.
+intptr_t KdasmAssemblerPagePacker::CalculateLeafHeaderLength( KdasmAssemblerNode* n )
+{
+    return ( n->GetLeafWordCount() < KdasmEncoding::LEAF_COUNT_OVERFLOW ) ? 1 : KdasmEncoding::LEAF_COUNT_OVERFLOW_LENGTH;
+}
+
+// Leaf blocks with room to grow start with their capacity.  See KdasmLeafUpdater.
+intptr_t KdasmAssemblerPagePacker::CalculateLeafCapacityLength( KdasmAssemblerNode* n )
+{
+    return n->GetNodeTemp()->m_isLeafCapacity ? 1 : 0;
+}
+
+// The most extra words a far reference between the pages could need.
+int KdasmAssemblerPagePacker::CalculateFarWordsRequired( KdasmAssemblerVirtualPage* a, KdasmAssemblerVirtualPage* b, int pageWordBits )
+{
+    intptr_t physicalPageDelta = ::abs( a->GetPhysicalPageStart() - b->GetPhysicalPageStart() );
+    physicalPageDelta += a->GetPhysicalPageCount() + b->GetPhysicalPageCount();
+    physicalPageDelta <<= pageWordBits;
+
+    return CalculateWordsRequired( physicalPageDelta );
+}
+
 void KdasmAssemblerPagePacker::CalculateNodeExtraData( KdasmAssemblerPageTempData* t )
 {
     KdasmAssemblerNode* n = t->m_node;
@@ -1021,33 +1483,46 @@ void KdasmAssemblerPagePacker::CalculateNodeExtraData( KdasmAssemblerPageTempDat
         }
         else
         {
-            intptr_t headerOffset = 0;
-            if( t->m_isPageRoot )
+            intptr_t headerOffset = CalculateLeafCapacityLength( n );
+            if( headerOffset != 0 )
             {
-
 #ifdef KDASM_INTERNAL_VALIDATION
                 KdasmAssertInternal( m_allocationMap[t->m_indices.m_extraDataIndex] == t );
 #endif
-                // Referenced by OPCODE_LEAVES_FAR.  Requires header.
-                if( n->GetLeafCount() < KdasmEncoding::LEAF_COUNT_OVERFLOW )
+                m_encoding[t->m_indices.m_extraDataIndex].SetRaw( (KdasmU16)n->GetLeafCapacity() );
+            }
+            if( t->m_isPageRoot )
+            {
+                headerOffset += CalculateLeafHeaderLength( n );
+
+#ifdef KDASM_INTERNAL_VALIDATION
+                for( intptr_t i=0; i < headerOffset; ++i )
+                {
+                    KdasmAssertInternal( m_allocationMap[t->m_indices.m_extraDataIndex + i] == t );
+                }
+#endif
+                // Referenced by OPCODE_LEAVES_FAR.  Requires header.
+                KdasmEncoding* header = &m_encoding[t->m_indices.m_extraDataIndex + CalculateLeafCapacityLength( n )];
+                if( CalculateLeafHeaderLength( n ) == 1 )
                 {
-                    m_encoding[t->m_indices.m_extraDataIndex].SetRaw( (KdasmU16)n->GetLeafCount() );
+                    header[0].SetRaw( (KdasmU16)n->GetLeafWordCount() );
                 }
                 else
                 {
-                    // Signal data is too long.
-                    m_encoding[t->m_indices.m_extraDataIndex].SetRaw( KdasmEncoding::LEAF_COUNT_OVERFLOW );
+                    // Signal data is too long and follow with the length.
+                    header[0].SetRaw( KdasmEncoding::LEAF_COUNT_OVERFLOW );
+                    header[1].SetRaw( (KdasmU16)( n->GetLeafWordCount() >> 16 ) );
+                    header[2].SetRaw( (KdasmU16)n->GetLeafWordCount() );
                 }
-                headerOffset = 1;
             }
 
             // OPCODE_LEAVES.
-            for( intptr_t i=0; i < n->GetLeafCount(); ++i )
+            for( intptr_t i=0; i < n->GetLeafWordCount(); ++i )
             {
 #ifdef KDASM_INTERNAL_VALIDATION
                 KdasmAssertInternal( m_allocationMap[t->m_indices.m_extraDataIndex + i + headerOffset] == t );
 #endif
-                m_encoding[t->m_indices.m_extraDataIndex + i + headerOffset].SetRaw( n->GetLeaves()[i] );
+                m_encoding[t->m_indices.m_extraDataIndex + i + headerOffset].SetRaw( n->GetLeafWords()[i] );
             }
         }
     }
@@ -1121,8 +1596,8 @@ void KdasmAssemblerPagePacker::CalculateNodeEncoding( KdasmAssemblerPageTempData
 
             x.SetNomal(  KdasmEncoding::NORMAL_OPCODE );
             x.SetOpcode( KdasmEncoding::OPCODE_LEAVES );
-            x.SetOffset( (KdasmU16)( t->m_indices.m_extraDataIndex - t->m_indices.m_encodingWordIndex ) );
-            x.SetLength( (KdasmU16)t->m_indices.m_extraDataSize );
+            x.SetOffset( (KdasmU16)( t->m_indices.m_extraDataIndex + CalculateLeafCapacityLength( n ) - t->m_indices.m_encodingWordIndex ) );
+            x.SetLength( (KdasmU16)n->GetLeafWordCount() );
         }
     }
     else
@@ -1204,13 +1679,18 @@ void KdasmAssemblerPagePacker::UseSavedEncodingIndices( void )
 intptr_t KdasmAssemblerPagePacker::CalculateNodeFarOffset( KdasmAssemblerPageTempData* t )
 {
     KdasmAssemblerNode* n = t->m_node;
+    if( t->m_isExternal && n->GetNodeTemp()->m_sharedNode )
+    {
+        n = n->GetNodeTemp()->m_sharedNode;
+    }
 
     intptr_t encodingWordIndex = n->GetNodeTemp()->m_internalIndices.m_encodingWordIndex;
-    if( !t->m_isExternal || encodingWordIndex == -1 )
+    if( !t->m_isExternal || !n->HasSubnodes() )
     {
         // Leaf nodes with far addressing have their extra data addressed directly.
+        // A shared leaf block may also have an OPCODE_LEAVES_FAR of its own.
         KdasmAssertInternal( !n->HasSubnodes() && t->m_indices.m_internalJumpIndex == -1 );
-        encodingWordIndex = n->GetNodeTemp()->m_internalIndices.m_extraDataIndex;
+        encodingWordIndex = n->GetNodeTemp()->m_internalIndices.m_extraDataIndex + CalculateLeafCapacityLength( n );
     }
 
     KdasmAssertInternal( encodingWordIndex >= 0 );
@@ -1303,8 +1783,8 @@ bool KdasmAssemblerPagePacker::ValidateNodeEncoding( KdasmAssemblerPageTempData*
         {
             KdasmAssertInternal( x.GetNomal() == KdasmEncoding::NORMAL_OPCODE );
             KdasmAssertInternal( x.GetOpcode() == KdasmEncoding::OPCODE_LEAVES );
-            KdasmAssertInternal( x.GetOffsetSigned() == ( t->m_indices.m_extraDataIndex - t->m_indices.m_encodingWordIndex ) );
-            KdasmAssertInternal( x.GetLength() == t->m_indices.m_extraDataSize );
+            KdasmAssertInternal( x.GetOffsetSigned() == ( t->m_indices.m_extraDataIndex + CalculateLeafCapacityLength( n ) - t->m_indices.m_encodingWordIndex ) );
+            KdasmAssertInternal( x.GetLength() == n->GetLeafWordCount() );
         }
 
         if( t->m_indices.m_internalJumpIndex != -1 )
@@ -1336,6 +1816,42 @@ KdasmAssembler::KdasmAssembler( void )
     m_activityData = NULL;
     m_activityFrequency = INT_MAX;
     m_activityCounter = 0;
+    m_deadline = 0.0;
+    m_rootWeight = 1.0;
+    m_leafBits = KdasmEncodingHeader::LEAF_BITS_16;
+    ::memset( &m_report, 0, sizeof m_report );
+}
+
+KdasmAssembler::CostModel::CostModel( void )
+{
+    // Once enabled nearly every merge that frees a page is kept.  A smaller
+    // m_paddingWord trades encoding size for fewer cache misses.
+    m_paddingWord = 1.0 / 1024.0;
+    m_farWord = 1.0 / 1024.0;
+    m_expectedMiss = 1.0;
+    m_enabled = false;
+}
+
+KdasmAssembler::Options::Options( OptimizationLevel level )
+{
+    m_objective = OBJECTIVE_AVERAGE_MISSES;
+    m_pageOrder = ( level >= OPTIMIZE_O3 ) ? PAGE_ORDER_DEPTH_FIRST : PAGE_ORDER_ALLOCATION;
+    m_subpageMerge = level >= OPTIMIZE_O1;
+    m_binPack = level >= OPTIMIZE_O1;
+    m_pageMergeScanDistance = ( level >= OPTIMIZE_O3 ) ? 16 : ( ( level >= OPTIMIZE_O2 ) ? 3 : 1 );
+    m_localSearchIterations = ( level >= OPTIMIZE_O3 ) ? ( 1 << 20 ) : 0;
+    m_exactSearchLimit = ( level >= OPTIMIZE_O3 ) ? EXACT_SEARCH_LIMIT : 0;
+    m_timeBudget = 0.0;
+    m_maxSize = 0;
+    m_reportCacheMisses = false;
+    m_shareSubtreesMinNodes = 0;
+    m_shareLeavesMinLength = 0;
+    m_packLeaves = false;
+    m_leafRanges = false;
+    m_remapLeaves = false;
+    m_relativeDistance = false;
+    m_leafSlack = 0.0;
+    m_compactGrowth = 1.0;
 }
 
 void KdasmAssembler::SetActivityCallback( KdasmAssembler::ActivityCallback callback, void* data, int activityFrequency )
@@ -1345,480 +1861,2415 @@ void KdasmAssembler::SetActivityCallback( KdasmAssembler::ActivityCallback callb
     m_activityFrequency = activityFrequency;
 }
 
-void KdasmAssembler::Assemble( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, std::vector<KdasmEncoding>& result )
+void KdasmAssembler::SetOptions( const KdasmAssembler::Options& options )
 {
-    result.clear();
+    m_options = options;
+}
+
+void KdasmAssembler::SetObjective( KdasmAssembler::Objective objective )
+{
+    m_options.m_objective = objective;
+}
+
+void KdasmAssembler::SetPageOrder( KdasmAssembler::PageOrder pageOrder )
+{
+    m_options.m_pageOrder = pageOrder;
+}
+
+void KdasmAssembler::SetLocalSearchIterations( intptr_t iterations )
+{
+    m_options.m_localSearchIterations = iterations;
+}
+
+void KdasmAssembler::SetCostModel( const KdasmAssembler::CostModel& costModel )
+{
+    m_options.m_costModel = costModel;
+}
+
+bool KdasmAssembler::Assemble( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, std::vector<KdasmEncoding>& result )
+{
+    AssembleReset( pageBits );
 
     KdasmAssemblerNode empty;
     if( root == NULL )
     {
         root = &empty;
     }
-
-    pageBits = ( pageBits < KdasmEncodingHeader::PAGE_BITS_32B )  ? KdasmEncodingHeader::PAGE_BITS_32B
-           : ( ( pageBits > KdasmEncodingHeader::PAGE_BITS_128B ) ? KdasmEncodingHeader::PAGE_BITS_128B : pageBits );
-    m_pagePacker.SetPageSize( (int)pageBits );
-    m_pageAllocator.SetPhysicalPageWords( (int)pageBits );
-
-    root->TrimEmpty();
-    root->AssemblePrepare( NULL, 1 ); // A CompareToId of 0 is invalid.
-    root->GetNodeTemp()->m_forceFarAddressing = true;
-
-    m_globalQueue.Init( root, m_pageAllocator );
-    KdasmAssertInternal( root->GetVirtualPage()->PageStart() != 0 ); // Is header page.
-
-    while( !m_globalQueue.Empty() )
+    if( !IsEncodable( root ) )
     {
-        PackNextPage();
+        result.clear();
+        return false;
     }
 
-    m_pageAllocator.CompactAndFreePhysicalPages();
-    SubpageMerge();
-    
-    m_pageAllocator.CompactAndFreePhysicalPages();
-    BinPack();
+    AssembleOnce( root, pageBits, result );
 
-    m_pageAllocator.CompactAndFreePhysicalPages();
-    Encode( root, pageBits, result );
+    // Denser settings are tried in turn until the encoding fits.  The smallest
+    // encoding found is kept along with its report.
+    if( m_options.m_maxSize > 0 && (intptr_t)result.size() > m_options.m_maxSize )
+    {
+        Options options = m_options;
+        Report report = m_report;
+        std::vector<KdasmEncoding> attemptResult;
+        std::vector<KdasmU16> leafArray;
+        std::vector<KdasmU64> leafRemap;
+        leafArray.swap( m_leafArray );
+        leafRemap.swap( m_leafRemap );
+        for( int attempt=0; attempt < MAX_BUDGET_ATTEMPTS && (intptr_t)result.size() > options.m_maxSize && !IsOutOfTime(); ++attempt )
+        {
+            SetBudgetOptions( options, attempt );
+            AssembleOnce( root, pageBits, attemptResult );
+            ++report.m_budgetAttempts;
+            if( attemptResult.size() < result.size() )
+            {
+                result.swap( attemptResult );
+                attemptResult.clear();
+                leafArray.swap( m_leafArray );
+                leafRemap.swap( m_leafRemap );
+                intptr_t budgetAttempts = report.m_budgetAttempts;
+                report = m_report;
+                report.m_budgetAttempts = budgetAttempts;
+            }
+        }
+        report.m_outOfTime |= m_report.m_outOfTime;
+        m_report = report;
+        m_options = options;
+        m_leafArray.swap( leafArray );
+        m_leafRemap.swap( leafRemap );
+    }
 
-    root->AssembleFinish();
+    m_report.m_overBudget = m_options.m_maxSize > 0 && (intptr_t)result.size() > m_options.m_maxSize;
+    CalculateReportStats( root, &result[0], (intptr_t)result.size() );
+    return !m_report.m_overBudget;
+}
 
-    Clear();
+bool KdasmAssembler::Assemble( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, KdasmEncodingBuffer& encoding,
+                               KdasmEncodingBuffer::HugePages hugePages )
+{
+    BufferOutput bufferOutput;
+    bufferOutput.m_buffer = &encoding;
+    bufferOutput.m_hugePages = hugePages;
+    return Assemble( root, pageBits, OutputToBuffer, &bufferOutput );
 }
 
-void KdasmAssembler::TickActivity( void )
+bool KdasmAssembler::Assemble( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, OutputCallback output, void* outputData )
 {
-    if( ++m_activityCounter >= m_activityFrequency )
+    if( root != NULL && !IsEncodable( root ) )
     {
-        m_activityCounter = 0;
-        if( m_activityCallback != NULL )
+        AssembleReset( pageBits );
+        return false;
+    }
+
+    // Budget attempts need somewhere to keep the smallest encoding found.
+    if( m_options.m_maxSize > 0 )
+    {
+        std::vector<KdasmEncoding> result;
+        bool isInBudget = Assemble( root, pageBits, result );
+        KdasmEncoding* encoding = output( outputData, (intptr_t)result.size() );
+        if( !encoding )
         {
-            m_activityCallback( m_activityData );
+            return false;
         }
+        ::memcpy( encoding, &result[0], result.size() * sizeof( KdasmEncoding ) );
+        return isInBudget;
+    }
+
+    AssembleReset( pageBits );
+
+    KdasmAssemblerNode empty;
+    if( root == NULL )
+    {
+        root = &empty;
     }
+
+    intptr_t size = 0;
+    KdasmEncoding* encoding = AssembleOnce( root, pageBits, output, outputData, size );
+    if( !encoding )
+    {
+        return false;
+    }
+    CalculateReportStats( root, encoding, size );
+    return true;
 }
 
-void KdasmAssembler::PackNextPage( void )
+// Relative distances are only encoded as a single KdasmU16.  The distance length
+// is the same throughout a tree.
+bool KdasmAssembler::IsEncodable( const KdasmAssemblerNode* root ) const
 {
-    TickActivity();
+    return !m_options.m_relativeDistance || !root->HasSubnodes() || root->GetDistanceLength() == 1;
+}
 
-    KdasmAssemblerNode* pageRootNode = m_globalQueue.GetNext( m_pageAllocator );
-    m_globalQueue.PopNext( false ); // remove node and subtree from global queue.
+void KdasmAssembler::AssembleReset( KdasmEncodingHeader::PageBits& pageBits )
+{
+    ::memset( &m_report, 0, sizeof m_report );
+    m_deadline = ( m_options.m_timeBudget > 0.0 ) ? GetTime() + m_options.m_timeBudget : 0.0;
 
-    KdasmAssertInternal( pageRootNode );
-    m_pageQueue.Init( pageRootNode, m_pageAllocator );
-    m_pageQueue.PopNext( true ); // add subnodes to page queue.
+    pageBits = ( pageBits < KdasmEncodingHeader::PAGE_BITS_32B )  ? KdasmEncodingHeader::PAGE_BITS_32B
+           : ( ( pageBits > KdasmEncodingHeader::PAGE_BITS_128B ) ? KdasmEncodingHeader::PAGE_BITS_128B : pageBits );
+}
 
-    KdasmAssemblerVirtualPage* virtualPage = pageRootNode->GetVirtualPage();
-    KdasmAssertInternal( virtualPage );
+KdasmEncoding* KdasmAssembler::OutputToVector( void* data, intptr_t size )
+{
+    std::vector<KdasmEncoding>* result = (std::vector<KdasmEncoding>*)data;
+    result->resize( size );
+    return &(*result)[0];
+}
 
-    while( !m_pageQueue.Empty() )
+KdasmEncoding* KdasmAssembler::OutputToBuffer( void* data, intptr_t size )
+{
+    BufferOutput* bufferOutput = (BufferOutput*)data;
+    // Every word is written by Encode().
+    return bufferOutput->m_buffer->Allocate( size, bufferOutput->m_hugePages, false ) ? bufferOutput->m_buffer->GetEncoding() : NULL;
+}
+
+bool KdasmAssembler::Reassemble( std::vector<KdasmEncoding>& encoding, const std::vector<int>& path, KdasmAssemblerNode* subtree )
+{
+    KdasmAssert( "Reassemble does not support these options", m_options.m_shareSubtreesMinNodes == 0 && m_options.m_shareLeavesMinLength == 0
+        && !m_options.m_leafRanges && !m_options.m_remapLeaves );
+
+    KdasmEncodingHeader header = *(KdasmEncodingHeader*)&encoding[0];
+    KdasmAssert( "Version Incorrect", header.VersionCheck() );
+    KdasmEncodingHeader::PageBits pageBits = header.GetPageBits();
+    if( path.empty() )
     {
-        KdasmAssemblerNode* nodeToAdd = m_pageQueue.GetNext( m_pageAllocator );
+        Assemble( subtree, pageBits, encoding );
+        return !encoding.empty();
+    }
+    if( header.IsLeavesAtRoot() )
+    {
+        return false;
+    }
 
-        KdasmAssemblerVirtualPage* virtualPagePrevioius = nodeToAdd->GetVirtualPage();
-        nodeToAdd->SetVirtualPage( virtualPage );
+    // Find the word that references each node on the path and where the node is.
+    intptr_t depth = (intptr_t)path.size();
+    std::vector<intptr_t> words( depth + 1 );
+    std::vector<intptr_t> wordTreeIndices( depth + 1 );
+    std::vector<intptr_t> nodes( depth + 1 );
+    std::vector<intptr_t> nodeTreeIndices( depth + 1 );
+    words[0] = KdasmEncodingHeader::HEADER_LENGTH;
+    wordTreeIndices[0] = 0;
+    for( intptr_t i=0; i <= depth; ++i )
+    {
+        intptr_t index = words[i];
+        intptr_t treeIndex = wordTreeIndices[i];
+        while( encoding[index].GetNomal() == KdasmEncoding::NORMAL_OPCODE && ( encoding[index].GetOpcode() & KdasmEncoding::OPCODE_JUMP ) != 0 )
+        {
+            if( encoding[index].GetOpcode() == KdasmEncoding::OPCODE_JUMP )
+            {
+                treeIndex = encoding[index].GetTreeIndexStart();
+                index += encoding[index].GetOffsetSigned();
+            }
+            else
+            {
+                treeIndex = 0;
+                index += encoding[index].GetFarOffset();
+            }
+        }
+        nodes[i] = index;
+        nodeTreeIndices[i] = treeIndex;
 
-        // Add one pad word to allow longer external references when bin packing.  This
-        // is the one bit of fudge factor and should be improved on.
-        if( m_pagePacker.Pack( virtualPage, true, &nodeToAdd, 1 ) )
+        if( i < depth )
         {
-            virtualPagePrevioius->RemoveNode( nodeToAdd );
-            KdasmAssertInternal( virtualPagePrevioius->GetNodeCount() == 0 );
-            virtualPage->InsertNode( nodeToAdd );
+            const KdasmEncoding& node = encoding[index];
+            int side = path[i];
+            if( node.GetNomal() == KdasmEncoding::NORMAL_OPCODE || ( side == 0 ? node.GetStop0() : node.GetStop1() ) )
+            {
+                return false;
+            }
+            words[i + 1] = index + treeIndex + 1 + side;
+            wordTreeIndices[i + 1] = treeIndex * 2 + 1 + side;
+        }
+    }
 
-            m_pageAllocator.Recycle( virtualPagePrevioius );
-            m_pageQueue.PopNext( true );
+    // Move up the path until the far offset fits.
+    KdasmDisassembler disassembler;
+    KdasmAssemblerNode* replacement = subtree;
+    intptr_t replacementDepth = depth;
+    intptr_t pageWords = (intptr_t)1 << ( pageBits - 1 );
+    std::vector<KdasmEncoding> appended;
+    for( intptr_t i=depth; i > 0; --i )
+    {
+        Assemble( replacement, pageBits, appended );
+        KdasmEncodingHeader* appendedHeader = (KdasmEncodingHeader*)&appended[0];
+        KdasmAssert( "Subtree does not match the encoding", appendedHeader->IsLeavesAtRoot()
+            || ( appendedHeader->GetDistanceLength() == header.GetDistanceLength() && appendedHeader->GetLeafBits() == header.GetLeafBits() ) );
+
+        // The pages keep their alignment after the header.  A leaf block at the root has
+        // no capacity word, so one is reserved before it.
+        bool isRootCapacity = header.IsLeafSlack() && appendedHeader->IsLeavesAtRoot()
+            && appended[KdasmEncodingHeader::HEADER_LENGTH].GetRaw() != KdasmEncoding::LEAF_COUNT_OVERFLOW;
+        intptr_t start = (intptr_t)encoding.size() + ( isRootCapacity ? 1 : 0 ) - KdasmEncodingHeader::HEADER_LENGTH;
+        start = ( ( start + pageWords - 1 ) / pageWords ) * pageWords + KdasmEncodingHeader::HEADER_LENGTH;
+        intptr_t offset = start - words[i];
+        intptr_t wordsRequired = KdasmAssemblerPagePacker::CalculateWordsRequired( offset );
+        intptr_t wordsOffset = 0;
+        if( wordsRequired <= FindFarWords( &encoding[words[i]], wordTreeIndices[i], wordsOffset ) )
+        {
+            KdasmEncoding x; x.SetRaw( 0 );
+            x.SetNomal( KdasmEncoding::NORMAL_OPCODE );
+            x.SetOpcode( appendedHeader->IsLeavesAtRoot() ? (KdasmU16)KdasmEncoding::OPCODE_LEAVES_FAR : (KdasmU16)KdasmEncoding::OPCODE_JUMP_FAR );
+            if( wordsRequired == 0 )
+            {
+                x.SetIsImmediateOffset( true );
+                x.SetImmediateOffset( (KdasmU16)offset );
+            }
+            else
+            {
+                x.SetIsImmediateOffset( false );
+                x.SetFarWordsOffset( (KdasmU16)wordsOffset );
+                x.SetFarWordsCount( (KdasmU16)wordsRequired );
+                for( intptr_t j = wordsRequired; j-- != 0; /**/ )
+                {
+                    encoding[words[i] + wordsOffset + j].SetRaw( (KdasmU16)offset );
+                    offset >>= 16;
+                }
+            }
+            encoding[words[i]] = x;
 
-            if( m_pageQueue.Empty() )
+            KdasmEncoding pad; pad.SetRaw( KdasmEncoding::PAD_VALUE );
+            encoding.resize( start, pad );
+            encoding.insert( encoding.end(), appended.begin() + KdasmEncodingHeader::HEADER_LENGTH, appended.end() );
+
+            // The page padding after the leaves is left for new ones.
+            if( isRootCapacity )
             {
-                return; // Correct result.
+                intptr_t capacity = (intptr_t)appended.size() - KdasmEncodingHeader::HEADER_LENGTH - 1;
+                capacity = std::min( capacity, (intptr_t)KdasmEncoding::LEAF_COUNT_OVERFLOW - 1 ) & ~( ( (intptr_t)1 << header.GetLeafBits() ) - 1 );
+                encoding[start - 1].SetRaw( (KdasmU16)capacity );
             }
+            break;
+        }
+
+        // Reassemble the cutting plane above with its other subtree.
+        const KdasmEncoding& node = encoding[nodes[i - 1]];
+        KdasmU16 distance[KdasmEncodingHeader::DISTANCE_LENGTH_MAX];
+        int distanceLength = (int)header.GetDistanceLength();
+        if( distanceLength == 1 )
+        {
+            distance[0] = node.GetDistanceImmediate();
         }
         else
         {
-            nodeToAdd->SetVirtualPage( virtualPagePrevioius );
+            distance[0] = node.GetDistancePrefix();
+            for( int j=1; j < distanceLength; ++j )
+            {
+                distance[j] = encoding[nodes[i - 1] + node.GetOffset() + j - 1].GetRaw();
+            }
+        }
 
-            // Prepend instead of append in order to reduce storage of far references.
-            m_globalQueue.Prepend( nodeToAdd );
-            m_pageQueue.PopNext( false );
+        int side = path[i - 1];
+        KdasmAssemblerNode* other = NULL;
+        if( !( side == 0 ? node.GetStop1() : node.GetStop0() ) )
+        {
+            intptr_t otherTreeIndex = nodeTreeIndices[i - 1] * 2 + 2 - side;
+            other = disassembler.DisassembleSubtree( &encoding[0], &encoding[nodes[i - 1] + otherTreeIndex - nodeTreeIndices[i - 1]], otherTreeIndex );
+        }
+        KdasmAssemblerNode* supernode = new KdasmAssemblerNode();
+        supernode->AddSubnodes( distance, distanceLength, node.GetNomal(), side == 0 ? replacement : other, side == 0 ? other : replacement );
+        replacement = supernode;
+        replacementDepth = i - 1;
+
+        if( i == 1 )
+        {
+            Assemble( replacement, pageBits, encoding );
         }
     }
 
-    if( virtualPage->GetNodeCount() == 1 )
+    // Free the supernodes without the subtree.
+    if( replacement != subtree )
     {
-        // Inital state was never stored.
-        bool result = m_pagePacker.Pack( virtualPage, true );
-        KdasmAssertInternal( result );
+        KdasmAssemblerNode* n = replacement;
+        for( intptr_t i=replacementDepth; i < depth; ++i )
+        {
+            KdasmAssemblerNode* subnode = n->GetSubnode( path[i] );
+            if( subnode == subtree )
+            {
+                n->DetachSubnode( path[i] );
+                break;
+            }
+            n = subnode;
+        }
+        delete replacement;
     }
+    return true;
 }
 
-void KdasmAssembler::SubpageMerge( void )
+bool KdasmAssembler::Compact( std::vector<KdasmEncoding>& encoding )
 {
-    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
-    if( pages.size() <= 2 )
+    KdasmEncodingHeader::PageBits pageBits = ( (KdasmEncodingHeader*)&encoding[0] )->GetPageBits();
+    KdasmDisassembler disassembler;
+    KdasmAssemblerNode* root = disassembler.Disassemble( &encoding[0] );
+    if( !root )
     {
-        return;
+        return false;
     }
+    bool isAssembled = Assemble( root, pageBits, encoding );
+    delete root;
+    return isAssembled;
+}
 
-    std::vector<KdasmAssemblerVirtualPage*> depthFirstStack;
-    depthFirstStack.reserve( 16 );
-    depthFirstStack.push_back( pages[0] );
+// Extra words for a far offset in place of the subtree referenced by word.  These
+// are the far words it already had, the words of its in page subnodes or its leaves.
+intptr_t KdasmAssembler::FindFarWords( const KdasmEncoding* word, intptr_t treeIndex, intptr_t& wordsOffset )
+{
+    intptr_t wordsCount = 0;
+    if( word->GetNomal() != KdasmEncoding::NORMAL_OPCODE )
+    {
+        if( !word->GetStop0() )
+        {
+            wordsOffset = treeIndex + 1;
+            wordsCount = word->GetStop1() ? 1 : 2;
+        }
+        else if( !word->GetStop1() )
+        {
+            wordsOffset = treeIndex + 2;
+            wordsCount = 1;
+        }
+    }
+    else if( word->GetOpcode() == KdasmEncoding::OPCODE_LEAVES )
+    {
+        wordsOffset = word->GetOffset();
+        wordsCount = word->GetLength();
+    }
+    else if( word->GetOpcode() != KdasmEncoding::OPCODE_JUMP && !word->GetIsImmediateOffset() )
+    {
+        wordsOffset = word->GetFarWordsOffset();
+        wordsCount = word->GetFarWordsCount();
+    }
+    if( wordsOffset > (intptr_t)0xff )
+    {
+        return 0; // Does not fit in the words offset field.
+    }
+    return std::min( wordsCount, (intptr_t)KdasmEncoding::FAR_WORDS_COUNT_MAX );
+}
 
-    KdasmAssemblerVirtualPage* bin = NULL;
-    std::vector<KdasmAssemblerVirtualPage*> subpages;
+// Trades cache misses for density.  Locality is ignored and the merge searches
+// are widened with each attempt.
+void KdasmAssembler::SetBudgetOptions( const Options& options, int attempt )
+{
+    m_options = options;
+    m_options.m_objective = OBJECTIVE_AVERAGE_MISSES;
+    m_options.m_subpageMerge = true;
+    m_options.m_binPack = true;
+    m_options.m_costModel.m_enabled = false;   // Pages hold the most nodes.
+    m_options.m_pageMergeScanDistance = std::max( options.m_pageMergeScanDistance, (intptr_t)( attempt == 0 ? 16 : 64 ) );
+    if( attempt > 0 )
+    {
+        m_options.m_localSearchIterations = std::max( options.m_localSearchIterations, (intptr_t)( 1 << 20 ) );
+        m_options.m_exactSearchLimit = std::max( options.m_exactSearchLimit, (intptr_t)EXACT_SEARCH_LIMIT );
+    }
+}
 
-    while( !depthFirstStack.empty() )
+void KdasmAssembler::CalculateReportStats( KdasmAssemblerNode* root, KdasmEncoding* result, intptr_t size )
+{
+    m_report.m_size = size;
+    if( !m_options.m_reportCacheMisses && m_options.m_maxSize <= 0 )
     {
-        KdasmAssemblerVirtualPage* pg = depthFirstStack.back();
-        depthFirstStack.pop_back();
+        return;
+    }
 
-        pg->FindSubpages( subpages );
-        if( !subpages.empty() )
+    KdasmDisassembler disassembler;
+    KdasmDisassembler::EncodingStats stats;
+    disassembler.CalculateStats( result, size, stats, root );
+
+    intptr_t leafNodeCount = stats.m_leafNodeCount + stats.m_leafNodeFarCount + stats.m_sharedLeafNodeCount;
+    m_report.m_averageCacheMisses = ( leafNodeCount > 0 ) ? (double)stats.m_totalCacheMissesForEachLeafNode / (double)leafNodeCount : 0.0;
+    m_report.m_expectedCacheMisses = ( stats.m_leafNodeWeight > 0.0 ) ? stats.m_totalWeightedCacheMisses / stats.m_leafNodeWeight : 0.0;
+    m_report.m_maxCacheMisses = stats.m_maxCacheMissesForEachLeafNode;
+}
+
+// Identical subtrees are found by hashing them bottom-up.  The first of each in
+// preorder that is not itself inside a shared subtree keeps its encoding and
+// the others are replaced by far references to it.  A shared branch starts a
+// page as OPCODE_JUMP_FAR addresses page roots.  A shared leaf block is given a
+// header and may stay in its supernode's page.
+void KdasmAssembler::ShareSubtrees( KdasmAssemblerNode* root )
+{
+    std::vector<SharedSubtree> subtrees;
+    intptr_t nodeCount = 0;
+    HashSubtree( root, nodeCount, subtrees );
+
+    // Hash collisions are told apart by comparing the subtrees.
+    std::sort( subtrees.begin(), subtrees.end(), CompareByHash );
+    for( size_t i=0; i < subtrees.size(); /**/ )
+    {
+        size_t end = i + 1;
+        while( end < subtrees.size() && subtrees[end].m_hash == subtrees[i].m_hash )
         {
-            depthFirstStack.insert( depthFirstStack.end(), subpages.rbegin(), subpages.rend() );
+            ++end;
         }
-        else
+        for( size_t j=i; j < end; ++j )
         {
-            if( bin == NULL )
+            subtrees[j].m_sharedId = subtrees[j].m_node->GetCompareToId();
+            for( size_t k=i; k < j; ++k )
             {
-                bin = pg;
-            }
-            else
-            {
-                if( TryBinPack( bin, pg ) )
-                {
-                    m_pageAllocator.Recycle( pg );
-                }
-                else
+                if( subtrees[k].m_sharedId == subtrees[k].m_node->GetCompareToId() && subtrees[k].m_node->Equals( *subtrees[j].m_node ) )
                 {
-                    bin = pg;
+                    subtrees[j].m_sharedId = subtrees[k].m_sharedId;
+                    break;
                 }
             }
         }
+        i = end;
     }
-}
 
-void KdasmAssembler::BinPack( void )
-{
-    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
-    if( pages.size() <= 2 )
+    // CompareToIds are assigned in preorder, so a subtree's nodes follow its root.
+    std::sort( subtrees.begin(), subtrees.end(), CompareByCompareToId );
+    std::vector<KdasmAssemblerNode*> sharedNodes( root->GetCompareToId() + nodeCount, NULL );
+    intptr_t sharedEnd = 0;
+    for( size_t i=0; i < subtrees.size(); ++i )
     {
-        return;
-    }
-
-    intptr_t pageWords = m_pageAllocator.GetPhysicalPageWords();
-    BuildPagesBySize( pageWords );
+        KdasmAssemblerNode* n = subtrees[i].m_node;
+        if( n->GetCompareToId() < sharedEnd )
+        {
+            continue; // Inside a subtree that is not encoded.
+        }
 
-    // Scan the "bins" from largest encoding to smallest.
-    ptrdiff_t compactPhysicalPagesCounter = 0;
-    for( ptrdiff_t i=pageWords; i > 0; --i )
-    {
-        while( !m_pagesBySize[i].empty() )
+        KdasmAssemblerNode*& sharedNode = sharedNodes[subtrees[i].m_sharedId];
+        if( sharedNode == NULL )
         {
-            KdasmAssemblerVirtualPage* bin = m_pagesBySize[i].back();
-            m_pagesBySize[i].pop_back();
+            sharedNode = n;
+            continue;
+        }
 
-            ptrdiff_t remainingWords = bin->GetPhysicalPageCount() * pageWords - bin->GetEncodingSize();
-            KdasmAssertInternal( remainingWords >= 0 && remainingWords < pageWords );
-            if( remainingWords > i )
+        KdasmAssemblerNodeTempData* nodeTemp = n->GetNodeTemp();
+        nodeTemp->m_sharedNode = sharedNode;
+        nodeTemp->m_nextShare = sharedNode->GetNodeTemp()->m_nextShare;
+        sharedNode->GetNodeTemp()->m_nextShare = n;
+        for( intptr_t j=0; j < 2; ++j )
+        {
+            if( n->GetSubnode( j ) )
             {
-                remainingWords = i; // Larger pages were already packed and removed.
+                n->GetSubnode( j )->AssembleFinish();
             }
+        }
 
-            // Look through physically nearby pages that might fit starting with pages
+        sharedEnd = n->GetCompareToId() + subtrees[i].m_nodeCount;
+        ++m_report.m_sharedSubtrees;
+        if( !n->HasSubnodes() )
+        {
+            m_report.m_sharedLeafWords += n->GetLeafWordCount();
+        }
+    }
+}
+
+// Records the subtrees and leaf blocks large enough to share.
+size_t KdasmAssembler::HashSubtree( KdasmAssemblerNode* n, intptr_t& nodeCount, std::vector<SharedSubtree>& subtrees )
+{
+    size_t hash = 0;
+    intptr_t leafWordCount = 0;
+    nodeCount = 1;
+    if( n->HasSubnodes() )
+    {
+        hash = n->GetNormal();
+        for( int i=0; i < n->GetDistanceLength(); ++i )
+        {
+            hash = hash * SHARE_HASH_MULTIPLIER + n->GetDistance()[i];
+        }
+        for( intptr_t i=0; i < 2; ++i )
+        {
+            intptr_t subnodeCount = 0;
+            size_t subnodeHash = n->GetSubnode( i ) ? HashSubtree( n->GetSubnode( i ), subnodeCount, subtrees ) : 0;
+            hash = hash * SHARE_HASH_MULTIPLIER + subnodeHash + subnodeCount;
+            nodeCount += subnodeCount;
+        }
+    }
+    else
+    {
+        // The leaves themselves, as leaf ranges are all zero until the page order is
+        // known.  Normals are never this large.
+        leafWordCount = n->GetLeafCount() << n->GetLeafBits();
+        hash = (size_t)leafWordCount + KdasmEncoding::NORMAL_OPCODE;
+        for( intptr_t i=0; i < leafWordCount; ++i )
+        {
+            hash = hash * SHARE_HASH_MULTIPLIER + n->GetLeaves()[i];
+        }
+    }
+
+    bool isShareable = ( m_options.m_shareSubtreesMinNodes > 0 && nodeCount >= m_options.m_shareSubtreesMinNodes )
+        || ( m_options.m_shareLeavesMinLength > 0 && !n->HasSubnodes() && leafWordCount >= m_options.m_shareLeavesMinLength );
+    if( isShareable && n->GetNodeTemp()->m_supernode )
+    {
+        SharedSubtree subtree;
+        subtree.m_hash = hash;
+        subtree.m_nodeCount = nodeCount;
+        subtree.m_sharedId = -1;
+        subtree.m_node = n;
+        subtrees.push_back( subtree );
+    }
+    return hash;
+}
+
+bool KdasmAssembler::CompareByHash( const SharedSubtree& a, const SharedSubtree& b )
+{
+    if( a.m_hash != b.m_hash )
+    {
+        return a.m_hash < b.m_hash;
+    }
+    return a.m_node->GetCompareToId() < b.m_node->GetCompareToId();
+}
+
+bool KdasmAssembler::CompareByCompareToId( const SharedSubtree& a, const SharedSubtree& b )
+{
+    return a.m_node->GetCompareToId() < b.m_node->GetCompareToId();
+}
+
+// The header has a single leaf width for the tree.
+void KdasmAssembler::FindLeafBits( KdasmAssemblerNode* n, KdasmAssemblerNode*& firstLeaf )
+{
+    if( !n->HasSubnodes() )
+    {
+        KdasmAssert( "Leaf width cannot vary within the tree", !firstLeaf || firstLeaf->GetLeafBits() == n->GetLeafBits() );
+        firstLeaf = firstLeaf ? firstLeaf : n;
+        return;
+    }
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( n->GetSubnode( i ) )
+        {
+            FindLeafBits( n->GetSubnode( i ), firstLeaf );
+        }
+    }
+}
+
+void KdasmAssembler::FindLeaves( KdasmAssemblerNode* n, std::vector<KdasmAssemblerNode*>& leaves )
+{
+    if( !n->HasSubnodes() )
+    {
+        leaves.push_back( n );
+        return;
+    }
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( n->GetSubnode( i ) )
+        {
+            FindLeaves( n->GetSubnode( i ), leaves );
+        }
+    }
+}
+
+// Leaf blocks are replaced by a KdasmLeafRange of the same size throughout.  It
+// is filled in once the page order is known.
+void KdasmAssembler::PrepareLeafRanges( KdasmAssemblerNode* root )
+{
+    KdasmAssert( "Packed leaves cannot be used with leaf ranges", !m_options.m_packLeaves );
+
+    std::vector<KdasmAssemblerNode*> leaves;
+    FindLeaves( root, leaves );
+    intptr_t leafCount = 0;
+    for( size_t i=0; i < leaves.size(); ++i )
+    {
+        leafCount += leaves[i]->GetLeafCount();
+    }
+
+    intptr_t rangeWords = ( leafCount <= 0xffff ) ? 2 : 4;
+    for( size_t i=0; i < leaves.size(); ++i )
+    {
+        KdasmAssemblerNodeTempData* nodeTemp = leaves[i]->GetNodeTemp();
+        nodeTemp->m_leafWords = new KdasmU16[rangeWords];
+        ::memset( nodeTemp->m_leafWords, 0, rangeWords * sizeof( KdasmU16 ) );
+        nodeTemp->m_leafWordCount = rangeWords;
+    }
+}
+
+// Leaf blocks are given room to grow in place.  Only blocks below the root start
+// with their capacity, as the root block must directly follow the header.
+void KdasmAssembler::PrepareLeafSlack( KdasmAssemblerNode* root )
+{
+    KdasmAssert( "Leaf slack cannot be used with packed leaves or leaf ranges", !m_options.m_packLeaves && !m_options.m_leafRanges );
+    KdasmAssert( "Leaf slack cannot be used with sharing", m_options.m_shareSubtreesMinNodes == 0 && m_options.m_shareLeavesMinLength == 0 );
+
+    std::vector<KdasmAssemblerNode*> leaves;
+    FindLeaves( root, leaves );
+    intptr_t leafWords = (intptr_t)1 << m_leafBits;
+    for( size_t i=0; i < leaves.size(); ++i )
+    {
+        intptr_t wordCount = leaves[i]->GetLeafWordCount();
+        if( wordCount >= KdasmEncoding::LEAF_COUNT_OVERFLOW )
+        {
+            continue;
+        }
+
+        // At least one leaf.  The capacity has to stay below LEAF_COUNT_OVERFLOW.
+        intptr_t slackWords = (intptr_t)( (double)wordCount * m_options.m_leafSlack );
+        slackWords = std::max( ( slackWords + leafWords - 1 ) & ~( leafWords - 1 ), leafWords );
+        slackWords = std::min( slackWords, ( KdasmEncoding::LEAF_COUNT_OVERFLOW - 1 - wordCount ) & ~( leafWords - 1 ) );
+
+        KdasmAssemblerNodeTempData* nodeTemp = leaves[i]->GetNodeTemp();
+        nodeTemp->m_isLeafCapacity = nodeTemp->m_supernode != NULL;
+        nodeTemp->m_leafSlackWords = slackWords;
+    }
+}
+
+// Leaf nodes in the order their blocks appear in the encoding.
+void KdasmAssembler::FindLeavesInEncodingOrder( std::vector<KdasmAssemblerNode*>& leaves )
+{
+    leaves.clear();
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    for( size_t i=0; i < pages.size(); ++i )
+    {
+        size_t pageStart = leaves.size();
+        std::vector<KdasmAssemblerNode*>& nodes = pages[i]->GetNodes();
+        for( size_t j=0; j < nodes.size(); ++j )
+        {
+            if( !nodes[j]->HasSubnodes() )
+            {
+                leaves.push_back( nodes[j] );
+            }
+        }
+        std::sort( leaves.begin() + pageStart, leaves.end(), CompareByExtraDataIndex );
+    }
+}
+
+// The leaves of each page are made adjacent in the leaf array.
+void KdasmAssembler::AssignLeafRanges( const std::vector<KdasmAssemblerNode*>& leaves )
+{
+    for( size_t i=0; i < leaves.size(); ++i )
+    {
+        KdasmAssemblerNode* n = leaves[i];
+        intptr_t start = (intptr_t)m_leafArray.size() >> m_leafBits;
+        m_leafArray.insert( m_leafArray.end(), n->GetLeaves(), n->GetLeaves() + ( n->GetLeafCount() << m_leafBits ) );
+
+        KdasmU16* words = n->GetNodeTemp()->m_leafWords;
+        if( n->GetNodeTemp()->m_leafWordCount == 2 )
+        {
+            words[0] = (KdasmU16)start;
+            words[1] = (KdasmU16)n->GetLeafCount();
+        }
+        else
+        {
+            words[0] = (KdasmU16)( start >> 16 );
+            words[1] = (KdasmU16)start;
+            words[2] = (KdasmU16)( n->GetLeafCount() >> 16 );
+            words[3] = (KdasmU16)n->GetLeafCount();
+        }
+    }
+}
+
+// Leaf values are renumbered in the order they are first found in the encoding.
+// Leaf ranges are renumbered in the leaf array and other leaves in a copy.
+void KdasmAssembler::RemapLeaves( const std::vector<KdasmAssemblerNode*>& leaves )
+{
+    KdasmAssert( "Packed leaves cannot be remapped", !m_options.m_packLeaves );
+
+    std::map<KdasmU64, KdasmU64> newValues;
+    if( m_options.m_leafRanges )
+    {
+        RemapLeafValues( &m_leafArray[0], (intptr_t)m_leafArray.size() >> m_leafBits, newValues );
+        return;
+    }
+
+    for( size_t i=0; i < leaves.size(); ++i )
+    {
+        KdasmAssemblerNode* n = leaves[i];
+        KdasmAssemblerNodeTempData* nodeTemp = n->GetNodeTemp();
+        nodeTemp->m_leafWordCount = n->GetLeafCount() << m_leafBits;
+        nodeTemp->m_leafWords = new KdasmU16[nodeTemp->m_leafWordCount];
+        ::memcpy( nodeTemp->m_leafWords, n->GetLeaves(), nodeTemp->m_leafWordCount * sizeof( KdasmU16 ) );
+        RemapLeafValues( nodeTemp->m_leafWords, n->GetLeafCount(), newValues );
+    }
+}
+
+void KdasmAssembler::RemapLeafValues( KdasmU16* words, intptr_t leafCount, std::map<KdasmU64, KdasmU64>& newValues )
+{
+    for( intptr_t i=0; i < leafCount; ++i )
+    {
+        KdasmU64 value = GetLeafValue( words, i, m_leafBits );
+        std::pair<std::map<KdasmU64, KdasmU64>::iterator, bool> inserted = newValues.insert( std::make_pair( value, (KdasmU64)m_leafRemap.size() ) );
+        if( inserted.second )
+        {
+            m_leafRemap.push_back( value );
+        }
+        SetLeafValue( words, i, m_leafBits, inserted.first->second );
+    }
+}
+
+KdasmU64 KdasmAssembler::GetLeafValue( const KdasmU16* words, intptr_t i, KdasmEncodingHeader::LeafBits leafBits )
+{
+    if( leafBits == KdasmEncodingHeader::LEAF_BITS_16 )
+    {
+        return words[i];
+    }
+    if( leafBits == KdasmEncodingHeader::LEAF_BITS_32 )
+    {
+        KdasmU32 x;
+        ::memcpy( &x, words + i * 2, sizeof x );
+        return x;
+    }
+    KdasmU64 x;
+    ::memcpy( &x, words + i * 4, sizeof x );
+    return x;
+}
+
+void KdasmAssembler::SetLeafValue( KdasmU16* words, intptr_t i, KdasmEncodingHeader::LeafBits leafBits, KdasmU64 value )
+{
+    if( leafBits == KdasmEncodingHeader::LEAF_BITS_16 )
+    {
+        words[i] = (KdasmU16)value;
+    }
+    else if( leafBits == KdasmEncodingHeader::LEAF_BITS_32 )
+    {
+        KdasmU32 x = (KdasmU32)value;
+        ::memcpy( words + i * 2, &x, sizeof x );
+    }
+    else
+    {
+        ::memcpy( words + i * 4, &value, sizeof value );
+    }
+}
+
+bool KdasmAssembler::CompareByExtraDataIndex( KdasmAssemblerNode* a, KdasmAssemblerNode* b )
+{
+    return a->GetNodeTemp()->m_internalIndices.m_extraDataIndex < b->GetNodeTemp()->m_internalIndices.m_extraDataIndex;
+}
+
+// A shared branch must start a page.  True if any of the nodes, once in pg,
+// would be there with the supernode of a shared branch.
+bool KdasmAssembler::HasSharedPageConflict( KdasmAssemblerNode** nodes, size_t nodesCount, KdasmAssemblerVirtualPage* pg )
+{
+    if( m_report.m_sharedSubtrees == 0 )
+    {
+        return false;
+    }
+
+    for( size_t i=0; i < nodesCount; ++i )
+    {
+        KdasmAssemblerNode* n = nodes[i];
+        if( n->IsSharedSubtree() && n->HasSubnodes() && n->GetNodeTemp()->m_supernode->GetVirtualPage() == pg )
+        {
+            return true;
+        }
+        for( intptr_t j=0; j < 2; ++j )
+        {
+            KdasmAssemblerNode* sn = n->GetSubnode( j );
+            if( sn && sn->IsSharedSubtree() && sn->HasSubnodes() && sn->GetVirtualPage() == pg )
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Moving a shared encoding changes the far references packed into the pages of the
+// nodes sharing it.
+bool KdasmAssembler::PackSharedReferences( KdasmAssemblerNode* n, KdasmAssemblerVirtualPage* pg, bool saveIfOk )
+{
+    for( KdasmAssemblerNode* s = n->GetNodeTemp()->m_nextShare; s; s = s->GetNodeTemp()->m_nextShare )
+    {
+        // Supernodes still waiting in a queue are packed when they are reached.
+        KdasmAssemblerNode* superNode = s->GetNodeTemp()->m_supernode;
+        KdasmAssemblerVirtualPage* superpage = superNode->GetVirtualPage();
+        if( !superpage || superpage == pg )
+        {
+            continue;
+        }
+        bool isQueued = false;
+        for( intptr_t i=0; i < 2; ++i )
+        {
+            KdasmAssemblerNode* sn = superNode->GetSubnode( i );
+            if( sn && sn->GetNodeTemp()->m_sharedNode )
+            {
+                sn = sn->GetNodeTemp()->m_sharedNode;
+            }
+            isQueued = isQueued || ( sn && !sn->GetVirtualPage() );
+        }
+        if( !isQueued && !m_pagePacker.Pack( superpage, saveIfOk ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void KdasmAssembler::AssembleOnce( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, std::vector<KdasmEncoding>& result )
+{
+    intptr_t size = 0;
+    result.clear();
+    AssembleOnce( root, pageBits, OutputToVector, &result, size );
+}
+
+KdasmEncoding* KdasmAssembler::AssembleOnce( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits,
+                                             OutputCallback output, void* outputData, intptr_t& size )
+{
+    m_leafArray.clear();
+    m_leafRemap.clear();
+    bool outOfTime = m_report.m_outOfTime;
+    ::memset( &m_report, 0, sizeof m_report );
+    m_report.m_outOfTime = outOfTime;
+
+    m_pagePacker.SetPageSize( (int)pageBits );
+    m_pagePacker.SetExactSearchLimit( m_options.m_exactSearchLimit );
+    m_pagePacker.SetExactSearchFailuresOnly( false );
+    m_pageAllocator.SetPhysicalPageWords( (int)pageBits );
+
+    root->TrimEmpty();
+    root->AssemblePrepare( NULL, 1 ); // A CompareToId of 0 is invalid.
+    KdasmAssemblerNode* firstLeaf = NULL;
+    FindLeafBits( root, firstLeaf );
+    m_leafBits = firstLeaf ? firstLeaf->GetLeafBits() : KdasmEncodingHeader::LEAF_BITS_16;
+    if( m_options.m_packLeaves )
+    {
+        root->AssemblePackLeaves();
+    }
+    if( m_options.m_leafRanges )
+    {
+        PrepareLeafRanges( root );
+    }
+    if( m_options.m_leafSlack > 0.0 )
+    {
+        PrepareLeafSlack( root );
+    }
+    if( m_options.m_shareSubtreesMinNodes > 0 || m_options.m_shareLeavesMinLength > 0 )
+    {
+        ShareSubtrees( root );
+    }
+    root->AssembleWeights( root->GetNodeTemp()->m_weight );
+    m_rootWeight = root->GetNodeTemp()->m_weight;
+    root->GetNodeTemp()->m_forceFarAddressing = true;
+
+    // Pages are filled along the hottest or longest paths first.
+    m_pageQueue.SetOrder( ( m_options.m_objective == OBJECTIVE_WEIGHTED_MISSES ) ? KdasmAssemblerNodeBreadthFirstQueue::ORDER_HEAVIEST_FIRST
+                        : ( ( m_options.m_objective == OBJECTIVE_MAX_MISSES ) ? KdasmAssemblerNodeBreadthFirstQueue::ORDER_DEEPEST_FIRST
+                                                                    : KdasmAssemblerNodeBreadthFirstQueue::ORDER_BREADTH_FIRST ) );
+
+    m_globalQueue.Init( root, m_pageAllocator );
+    KdasmAssertInternal( root->GetVirtualPage()->PageStart() != 0 ); // Is header page.
+
+    while( !m_globalQueue.Empty() )
+    {
+        // The exact search is optional and falls back to greedy packing when out of time.
+        if( m_options.m_exactSearchLimit > 0 && IsOutOfTime() )
+        {
+            m_pagePacker.SetExactSearchLimit( 0 );
+        }
+        PackNextPage();
+    }
+
+    // Merges and repairs repack many pages for each one they change.  They only
+    // search when the greedy packing fails, so pages packed by the search still fit.
+    m_pagePacker.SetExactSearchFailuresOnly( true );
+
+    m_pageAllocator.CompactAndFreePhysicalPages();
+    if( m_options.m_subpageMerge && !IsOutOfTime() )
+    {
+        SubpageMerge();
+    }
+    
+    m_pageAllocator.CompactAndFreePhysicalPages();
+    if( m_options.m_binPack && !IsOutOfTime() )
+    {
+        BinPack();
+    }
+
+    if( m_options.m_localSearchIterations > 0 && !IsOutOfTime() )
+    {
+        m_pageAllocator.CompactAndFreePhysicalPages();
+        LocalSearch();
+    }
+
+    m_pageAllocator.CompactAndFreePhysicalPages();
+    OrderPages( pageBits );
+
+    if( m_options.m_leafRanges || m_options.m_remapLeaves )
+    {
+        std::vector<KdasmAssemblerNode*> leaves;
+        FindLeavesInEncodingOrder( leaves );
+        if( m_options.m_leafRanges )
+        {
+            AssignLeafRanges( leaves );
+        }
+        if( m_options.m_remapLeaves )
+        {
+            RemapLeaves( leaves );
+        }
+    }
+
+    // Every page has its final location once they are ordered.
+    size = m_pageAllocator.AllocatedSize();
+    KdasmEncoding* result = output( outputData, size );
+    if( result )
+    {
+        Encode( root, pageBits, result );
+    }
+
+    root->AssembleFinish();
+
+    Clear();
+    return result;
+}
+
+void KdasmAssembler::TickActivity( void )
+{
+    if( ++m_activityCounter >= m_activityFrequency )
+    {
+        m_activityCounter = 0;
+        if( m_activityCallback != NULL )
+        {
+            m_activityCallback( m_activityData );
+        }
+    }
+}
+
+bool KdasmAssembler::IsOutOfTime( void )
+{
+    if( !m_report.m_outOfTime && m_deadline > 0.0 && GetTime() >= m_deadline )
+    {
+        m_report.m_outOfTime = true;
+    }
+    return m_report.m_outOfTime;
+}
+
+double KdasmAssembler::GetTime( void )
+{
+#if defined(_WIN32)
+    // clock() measures wall-clock time with the Microsoft CRT.
+    return (double)::clock() / (double)CLOCKS_PER_SEC;
+#else
+    timespec t;
+    ::clock_gettime( CLOCK_MONOTONIC, &t );
+    return (double)t.tv_sec + (double)t.tv_nsec * 1.0e-9;
+#endif
+}
+
+void KdasmAssembler::PackNextPage( void )
+{
+    TickActivity();
+
+    KdasmAssemblerNode* pageRootNode = m_globalQueue.GetNext( m_pageAllocator );
+    m_globalQueue.PopNext( false ); // remove node and subtree from global queue.
+
+    KdasmAssertInternal( pageRootNode );
+    m_pageQueue.Init( pageRootNode, m_pageAllocator );
+    m_pageQueue.PopNext( true ); // add subnodes to page queue.
+
+    KdasmAssemblerVirtualPage* virtualPage = pageRootNode->GetVirtualPage();
+    KdasmAssertInternal( virtualPage );
+
+    while( !m_pageQueue.Empty() )
+    {
+        KdasmAssemblerNode* nodeToAdd = m_pageQueue.GetNext( m_pageAllocator );
+
+        KdasmAssemblerVirtualPage* virtualPagePrevioius = nodeToAdd->GetVirtualPage();
+        nodeToAdd->SetVirtualPage( virtualPage );
+
+        // Add one pad word to allow longer external references when bin packing.  This
+        // is the one bit of fudge factor and should be improved on.
+        if( !HasSharedPageConflict( &nodeToAdd, 1, virtualPage ) && PackSharedReferences( nodeToAdd, virtualPage, false )
+            && m_pagePacker.Pack( virtualPage, true, &nodeToAdd, 1 ) )
+        {
+            bool packOk = PackSharedReferences( nodeToAdd, virtualPage, true );
+            KdasmAssertInternal( packOk ); (void)packOk;
+
+            virtualPagePrevioius->RemoveNode( nodeToAdd );
+            KdasmAssertInternal( virtualPagePrevioius->GetNodeCount() == 0 );
+            virtualPage->InsertNode( nodeToAdd );
+
+            m_pageAllocator.Recycle( virtualPagePrevioius );
+            m_pageQueue.PopNext( true );
+
+            if( m_pageQueue.Empty() )
+            {
+                return; // Correct result.
+            }
+        }
+        else
+        {
+            nodeToAdd->SetVirtualPage( virtualPagePrevioius );
+
+            // Prepend instead of append in order to reduce storage of far references.
+            m_globalQueue.Prepend( nodeToAdd );
+            m_pageQueue.PopNext( false );
+        }
+    }
+
+    if( virtualPage->GetNodeCount() == 1 )
+    {
+        // Inital state was never stored.
+        bool result = m_pagePacker.Pack( virtualPage, true );
+        KdasmAssertInternal( result );
+    }
+}
+
+void KdasmAssembler::SubpageMerge( void )
+{
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    if( pages.size() <= 2 )
+    {
+        return;
+    }
+
+    std::vector<KdasmAssemblerVirtualPage*> depthFirstStack;
+    depthFirstStack.reserve( 16 );
+    depthFirstStack.push_back( pages[0] );
+
+    // Moving a supernode into a bin can leave a cycle in the page graph.
+    std::vector<KdasmAssemblerVirtualPage*> pagesByAddress( pages );
+    std::sort( pagesByAddress.begin(), pagesByAddress.end() );
+    std::vector<bool> visited( pages.size(), false );
+
+    KdasmAssemblerVirtualPage* bin = NULL;
+    std::vector<KdasmAssemblerVirtualPage*> subpages;
+
+    while( !depthFirstStack.empty() && !IsOutOfTime() )
+    {
+        KdasmAssemblerVirtualPage* pg = depthFirstStack.back();
+        depthFirstStack.pop_back();
+        if( pg->GetNodeCount() == 0 )
+        {
+            continue; // Already merged after being reached from another superpage.
+        }
+        size_t pageIndex = std::lower_bound( pagesByAddress.begin(), pagesByAddress.end(), pg ) - pagesByAddress.begin();
+        if( visited[pageIndex] )
+        {
+            continue;
+        }
+        visited[pageIndex] = true;
+
+        pg->FindSubpages( subpages );
+        if( !subpages.empty() )
+        {
+            depthFirstStack.insert( depthFirstStack.end(), subpages.rbegin(), subpages.rend() );
+        }
+        else if( m_options.m_objective == OBJECTIVE_AVERAGE_MISSES || !TrySuperpageMerge( pg ) )
+        {
+            if( bin == NULL )
+            {
+                bin = pg;
+            }
+            else
+            {
+                if( TryBinPack( bin, pg ) )
+                {
+                    m_pageAllocator.Recycle( pg );
+                }
+                else
+                {
+                    bin = pg;
+                }
+            }
+        }
+    }
+}
+
+// Merging into a superpage saves the cache miss of referencing it.  The
+// superpages with the highest priority references are tried first.
+bool KdasmAssembler::TrySuperpageMerge( KdasmAssemblerVirtualPage* pg )
+{
+    pg->FindSuperpages( m_adjacentPages );
+
+    std::vector<std::pair<double, KdasmAssemblerVirtualPage*> > bins;
+    for( size_t i=0; i < m_adjacentPages.size(); ++i )
+    {
+        // Negate to sort heaviest first.
+        bins.push_back( std::make_pair( -CalculateMergePriority( m_adjacentPages[i], pg ), m_adjacentPages[i] ) );
+    }
+    std::stable_sort( bins.begin(), bins.end(), CompareByPriority );
+
+    for( size_t i=0; i < bins.size(); ++i )
+    {
+        if( TryBinPack( bins[i].second, pg ) )
+        {
+            m_pageAllocator.Recycle( pg );
+            return true;
+        }
+    }
+    return false;
+}
+
+void KdasmAssembler::BinPack( void )
+{
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    if( pages.size() <= 2 )
+    {
+        return;
+    }
+
+    intptr_t pageWords = m_pageAllocator.GetPhysicalPageWords();
+    BuildPagesBySize( pageWords );
+
+    // Scan the "bins" from largest encoding to smallest.
+    ptrdiff_t compactPhysicalPagesCounter = 0;
+    for( ptrdiff_t i=pageWords; i > 0; --i )
+    {
+        while( !m_pagesBySize[i].empty() )
+        {
+            if( IsOutOfTime() )
+            {
+                return;
+            }
+
+            KdasmAssemblerVirtualPage* bin = m_pagesBySize[i].back();
+            m_pagesBySize[i].pop_back();
+
+            if( m_options.m_objective != OBJECTIVE_AVERAGE_MISSES )
+            {
+                BinPackAdjacentPages( bin );
+            }
+
+            ptrdiff_t remainingWords = bin->GetPhysicalPageCount() * pageWords - bin->GetEncodingSize();
+            KdasmAssertInternal( remainingWords >= 0 && remainingWords < pageWords );
+            if( remainingWords > i )
+            {
+                remainingWords = i; // Larger pages were already packed and removed.
+            }
+
+            // Look through physically nearby pages that might fit starting with pages
             // that are the same size as the remaining space and then on down.
             for( ptrdiff_t j=remainingWords; j > 0; --j )
             {
-                std::vector<KdasmAssemblerVirtualPage*>& currentPagesBySize = m_pagesBySize[j];
-                if( currentPagesBySize.empty() )
+                std::vector<KdasmAssemblerVirtualPage*>& currentPagesBySize = m_pagesBySize[j];
+                if( currentPagesBySize.empty() )
+                {
+                    continue;
+                }
+
+                intptr_t pivot = FindClosestPhysicalPage( bin, currentPagesBySize );
+                intptr_t distance = 0;
+                bool step = true;
+
+                while( !currentPagesBySize.empty() )
+                {
+                    KdasmAssemblerVirtualPage* pg = currentPagesBySize[pivot + distance];
+
+                    if( TryBinPack( bin, pg ) )
+                    {
+                        currentPagesBySize.erase( currentPagesBySize.begin() + pivot + distance );
+
+                        compactPhysicalPagesCounter += pg->GetPhysicalPageCount();
+                        m_pageAllocator.Recycle( pg );
+                        if( compactPhysicalPagesCounter > (KdasmEncoding::IMMEDIATE_OFFSET_MAX/2) )
+                        {
+                            compactPhysicalPagesCounter = 0;
+                            m_pageAllocator.CompactAndFreePhysicalPages();
+                        }
+
+                        remainingWords = bin->GetPhysicalPageCount() * pageWords - bin->GetEncodingSize();
+                        KdasmAssertInternal( remainingWords >= 0 && remainingWords < pageWords );
+                        if( j > remainingWords )
+                        {
+                            j = remainingWords + 1; // skip to remainingWords.
+                            break;
+                        }
+
+                        if( distance <= 0 && pivot > 0 )
+                        {
+                            --pivot;
+                        }
+                        step = false;
+                    }
+
+                    distance = -distance;
+                    if( step )
+                    {
+                        distance += ( distance >= 0 ) ? 1 : -1;
+                    }
+                    step = !step;
+                    if( ( pivot + distance ) < 0 || ( pivot + distance ) >= (intptr_t)currentPagesBySize.size() )
+                    {
+                        distance = -distance;
+                        if( step )
+                        {
+                            distance += ( distance >= 0 ) ? 1 : -1;
+                        }
+                        step = !step;
+                        if( ( pivot + distance ) < 0 || ( pivot + distance ) >= (intptr_t)currentPagesBySize.size() )
+                        {
+                            break;
+                        }
+                    }
+                    if( ::abs( distance ) > m_options.m_pageMergeScanDistance )
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Packs the subpages and superpages of the bin with the highest priority
+// references before any physically nearby pages are considered.
+void KdasmAssembler::BinPackAdjacentPages( KdasmAssemblerVirtualPage* bin )
+{
+    intptr_t pageWords = m_pageAllocator.GetPhysicalPageWords();
+
+    bin->FindSubpages( m_adjacentPages );
+    std::vector<KdasmAssemblerVirtualPage*> superpages;
+    bin->FindSuperpages( superpages );
+    m_adjacentPages.insert( m_adjacentPages.end(), superpages.begin(), superpages.end() );
+
+    std::vector<std::pair<double, KdasmAssemblerVirtualPage*> > candidates;
+    for( size_t i=0; i < m_adjacentPages.size(); ++i )
+    {
+        KdasmAssemblerVirtualPage* pg = m_adjacentPages[i];
+        if( pg->GetEncodingSize() < (pageWords - 1) )
+        {
+            // Negate to sort heaviest first.
+            candidates.push_back( std::make_pair( -CalculateMergePriority( bin, pg ), pg ) );
+        }
+    }
+    std::stable_sort( candidates.begin(), candidates.end(), CompareByPriority );
+
+    for( size_t i=0; i < candidates.size(); ++i )
+    {
+        KdasmAssemblerVirtualPage* pg = candidates[i].second;
+        intptr_t remainingWords = bin->GetPhysicalPageCount() * pageWords - bin->GetEncodingSize();
+        if( pg->GetEncodingSize() > remainingWords )
+        {
+            continue;
+        }
+
+        // Only pages still waiting to be packed are candidates.
+        std::vector<KdasmAssemblerVirtualPage*>& pagesBySize = m_pagesBySize[pg->GetEncodingSize()];
+        std::vector<KdasmAssemblerVirtualPage*>::iterator it = std::find( pagesBySize.begin(), pagesBySize.end(), pg );
+        if( it != pagesBySize.end() && TryBinPack( bin, pg ) )
+        {
+            pagesBySize.erase( it );
+            m_pageAllocator.Recycle( pg );
+        }
+    }
+}
+
+// The weighted cache misses saved by merging two pages, or the height of the
+// tallest subtree referenced between them when minimizing the most misses.
+double KdasmAssembler::CalculateMergePriority( KdasmAssemblerVirtualPage* a, KdasmAssemblerVirtualPage* b )
+{
+    double weight = 0.0;
+    for( int pass=0; pass < 2; ++pass )
+    {
+        std::vector<KdasmAssemblerNode*>& nodes = ( pass == 0 ? a : b )->GetNodes();
+        KdasmAssemblerVirtualPage* other = ( pass == 0 ) ? b : a;
+        for( size_t i=0; i < nodes.size(); ++i )
+        {
+            for( intptr_t j=0; j < 2; ++j )
+            {
+                KdasmAssemblerNode* sn = nodes[i]->GetSubnode( j );
+                if( sn && sn->GetVirtualPage() == other )
+                {
+                    if( m_options.m_objective == OBJECTIVE_MAX_MISSES )
+                    {
+                        weight = std::max( weight, (double)sn->GetNodeTemp()->m_height );
+                    }
+                    else
+                    {
+                        weight += sn->GetNodeTemp()->m_weight;
+                    }
+                }
+            }
+        }
+    }
+    return weight;
+}
+
+void KdasmAssembler::BuildPagesBySize( intptr_t pageWords )
+{
+    // Last index is actually for pages larger than a single physical page.
+    m_pagesBySize.clear();
+    m_pagesBySize.resize( pageWords + 1 );
+
+    // Skip bin packing the root page.  It should be well packed anyway.
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+
+    // Queue bins earlier in the address space before those that come after.  This gives
+    // pages closer to the root of the tree a chance to gather nearby nodes first.
+    // Pages of size "pageWords" and "pageWords-1" are not added as they are full.
+    for( size_t i=pages.size()-1; i >= 1; --i )
+    {
+        KdasmAssemblerVirtualPage* pg = pages[i];
+        if( pg->GetEncodingSize() >= (pageWords + 1) )
+        {
+            m_pagesBySize[pageWords].push_back( pg );
+        }
+        else if( pg->GetEncodingSize() < (pageWords - 1) )
+        {
+            m_pagesBySize[pg->GetEncodingSize()].push_back( pg );
+        }
+    }
+    KdasmAssertInternal( m_pagesBySize[0].empty() );
+
+    // As a special case, oversize pages are packed first and are bins only, but at
+    // least hit them in the right order.
+    std::sort( m_pagesBySize[pageWords].begin(), m_pagesBySize[pageWords].end(), KdasmAssemblerVirtualPage::CompareByEncodingSize );
+}
+
+intptr_t KdasmAssembler::FindClosestPhysicalPage( KdasmAssemblerVirtualPage* bin, std::vector<KdasmAssemblerVirtualPage*>& pages )
+{
+    KdasmAssertInternal( !pages.empty() );
+
+    // This early out is normal with large data sets.  The pages are stored in
+    // reverse physical order to make it efficient to remove entries.
+    if( pages.back()->GetPhysicalPageStart() < bin->GetPhysicalPageStart() )
+    {
+        return pages.size() - 1;
+    }
+    
+    std::vector<KdasmAssemblerVirtualPage*>::iterator i = std::lower_bound( pages.begin(), pages.end(),
+        bin, KdasmAssemblerVirtualPage::CompareByPhysicalPagesReverse );
+    if( i == pages.end() )
+    {
+        i = pages.end() - 1;
+    }
+
+    return (intptr_t)( i - pages.begin() );
+}
+
+bool KdasmAssembler::TryBinPack( KdasmAssemblerVirtualPage* bin, KdasmAssemblerVirtualPage* pg )
+{
+    TickActivity();
+
+    double mergeCost = m_options.m_costModel.m_enabled ? CalculateMergeCost( bin, pg ) : 0.0;
+    if( mergeCost > 0.0 )
+    {
+        ++m_report.m_mergesRejected;
+        return false;
+    }
+
+    std::vector<KdasmAssemblerNode*>& pgNodes = pg->GetNodes();
+    size_t pgNodeCount = pgNodes.size();
+
+    for( size_t i=0; i < pgNodeCount; ++i )
+    {
+        pgNodes[i]->SetVirtualPage( bin );
+    }
+  
+    bin->FindSuperpages( m_superpages );
+    bin->AppendSuperpages( m_superpages, &pgNodes[0], pgNodeCount );
+
+    // Test if bin and referring pages can encode within size limits.
+    bool packOk = !HasSharedPageConflict( &pgNodes[0], pgNodeCount, bin ) && m_pagePacker.Pack( bin, false, &pgNodes[0], pgNodeCount );
+    KdasmAssemblerVirtualPage* failingPage = NULL;
+    if( packOk )
+    {
+        for( size_t i=0; i < m_superpages.size(); ++i )
+        {
+            if( m_superpages[i] == pg )
+            {
+                continue;
+            }
+            if( !m_pagePacker.Pack( m_superpages[i], false ) )
+            {
+                if( failingPage == NULL )
+                {
+                    failingPage = m_superpages[i];
+                    KdasmAssertInternal( failingPage != bin );
+                }
+                else
+                {
+                    packOk = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    if( packOk && failingPage != NULL )
+    {
+        // Try moving the branch node down into the bin from the failing super page.
+        std::vector<KdasmAssemblerNode*>& superNodes = failingPage->GetNodes();
+        KdasmAssemblerNode* superNode = NULL;
+        for( size_t i=0; i < superNodes.size(); ++i )
+        {
+            KdasmAssemblerNode* n = superNodes[i];
+            for( intptr_t j=0; j < 2; ++j )
+            {
+                if( n->GetSubnode( j ) && n->GetSubnode( j )->GetVirtualPage() == bin )
+                {
+                    superNode = n;
+                    break;
+                }
+            }
+        }
+        KdasmAssertInternal( superNode != NULL );
+
+        failingPage->FindSuperpages( m_failingPageSuperpages );
+
+        failingPage->RemoveNode( superNode );
+        bin->InsertNode( superNode );
+
+        packOk = !HasSharedPageConflict( &superNode, 1, bin ) && m_pagePacker.Pack( bin, false, &pgNodes[0], pgNodeCount );
+        if( packOk )
+        {
+            packOk = m_pagePacker.Pack( failingPage, false );
+            if( packOk )
+            {
+                for( size_t i=0; i < m_superpages.size(); ++i )
+                {
+                    if( pg != m_superpages[i] )
+                    {
+                        if( !m_pagePacker.Pack( m_superpages[i], false ) )
+                        {
+                            packOk = false;
+                            break;
+                        }
+                    }
+                }
+                if( packOk )
+                {
+                    for( size_t i=0; i < m_failingPageSuperpages.size(); ++i )
+                    {
+                        if( bin != m_failingPageSuperpages[i] && pg != m_failingPageSuperpages[i] )
+                        {
+                            if( !m_pagePacker.Pack( m_failingPageSuperpages[i], false ) )
+                            {
+                                packOk = false;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        if( packOk && m_options.m_costModel.m_enabled
+            && ( mergeCost + CalculateNodeMoveCost( superNode, failingPage, bin ) ) > 0.0 )
+        {
+            ++m_report.m_mergesRejected;
+            packOk = false;
+        }
+        if( packOk )
+        {
+            // Commit to modification of failing super page.
+            packOk = m_pagePacker.Pack( failingPage, true );
+            for( size_t i=0; i < m_failingPageSuperpages.size(); ++i )
+            {
+                if( bin != m_failingPageSuperpages[i] && pg != m_failingPageSuperpages[i] )
                 {
-                    continue;
+                    packOk |= m_pagePacker.Pack( m_failingPageSuperpages[i], true );
                 }
+            }
+            KdasmAssertInternal( packOk );
+        }
+        else
+        {
+            bin->RemoveNode( superNode );
+            failingPage->InsertNode( superNode );
+        }
+    }    
+    
+    if( packOk )
+    {
+        // Commit to page merge.
+        std::vector<KdasmAssemblerNode*>& binNodes = bin->GetNodes();
+        binNodes.insert( binNodes.end(), pgNodes.begin(), pgNodes.end() );
 
-                intptr_t pivot = FindClosestPhysicalPage( bin, currentPagesBySize );
-                intptr_t distance = 0;
-                bool step = true;
+        pgNodes.clear();
 
-                while( !currentPagesBySize.empty() )
+        bool packOk = m_pagePacker.Pack( bin, true );
+        for( size_t i=0; i < m_superpages.size(); ++i )
+        {
+            packOk |= m_pagePacker.Pack( m_superpages[i], true );
+        }
+        KdasmAssertInternal( packOk );
+    }
+    else
+    {
+        // Revert changes.
+        for( size_t i=0; i < pgNodeCount; ++i )
+        {
+            pgNodes[i]->SetVirtualPage( pg );
+        }
+    }
+
+    return packOk;
+}
+
+// The cost of moving every node of pg into bin using the current physical pages
+// to estimate far words.  Negative when the merge is worth making.
+double KdasmAssembler::CalculateMergeCost( KdasmAssemblerVirtualPage* bin, KdasmAssemblerVirtualPage* pg )
+{
+    const CostModel& costs = m_options.m_costModel;
+    int pageWordBits = m_pagePacker.GetPageWordBits();
+    double missWeight = 0.0;
+    intptr_t farWords = 0;
+
+    std::vector<KdasmAssemblerNode*>& nodes = pg->GetNodes();
+    for( size_t i=0; i < nodes.size(); ++i )
+    {
+        KdasmAssemblerNode* n = nodes[i];
+        KdasmAssemblerNode* supernode = n->GetNodeTemp()->m_supernode;
+        if( supernode && supernode->GetVirtualPage() != pg )
+        {
+            KdasmAssemblerVirtualPage* other = supernode->GetVirtualPage();
+            farWords -= KdasmAssemblerPagePacker::CalculateFarWordsRequired( other, pg, pageWordBits );
+            if( other == bin )
+            {
+                missWeight -= n->GetNodeTemp()->m_weight;
+            }
+            else
+            {
+                farWords += KdasmAssemblerPagePacker::CalculateFarWordsRequired( other, bin, pageWordBits );
+            }
+        }
+
+        for( intptr_t j=0; j < 2; ++j )
+        {
+            KdasmAssemblerNode* sn = n->GetSubnode( j );
+            if( sn && sn->GetVirtualPage() != pg )
+            {
+                KdasmAssemblerVirtualPage* other = sn->GetVirtualPage();
+                farWords -= KdasmAssemblerPagePacker::CalculateFarWordsRequired( pg, other, pageWordBits );
+                if( other == bin )
                 {
-                    KdasmAssemblerVirtualPage* pg = currentPagesBySize[pivot + distance];
+                    missWeight -= sn->GetNodeTemp()->m_weight;
+                }
+                else
+                {
+                    farWords += KdasmAssemblerPagePacker::CalculateFarWordsRequired( bin, other, pageWordBits );
+                }
+            }
+        }
+    }
+
+    // The physical pages of pg are freed.
+    intptr_t paddingWords = -pg->GetPhysicalPageCount() * m_pageAllocator.GetPhysicalPageWords();
+
+    return costs.m_expectedMiss * missWeight / m_rootWeight + costs.m_farWord * (double)farWords
+        + costs.m_paddingWord * (double)paddingWords;
+}
+
+// The change in expected cache misses from moving a single node between pages.
+// Called after the move so subnodes already moved are in their new page.
+double KdasmAssembler::CalculateNodeMoveCost( KdasmAssemblerNode* n, KdasmAssemblerVirtualPage* from, KdasmAssemblerVirtualPage* to )
+{
+    double missWeight = 0.0;
+    KdasmAssemblerNode* supernode = n->GetNodeTemp()->m_supernode;
+    if( supernode )
+    {
+        KdasmAssemblerVirtualPage* superpage = supernode->GetVirtualPage();
+        missWeight += n->GetNodeTemp()->m_weight * (double)( ( superpage != to ) - ( superpage != from ) );
+    }
+    for( intptr_t j=0; j < 2; ++j )
+    {
+        KdasmAssemblerNode* sn = n->GetSubnode( j );
+        if( sn )
+        {
+            KdasmAssemblerVirtualPage* subpage = sn->GetVirtualPage();
+            missWeight += sn->GetNodeTemp()->m_weight * (double)( ( subpage != to ) - ( subpage != from ) );
+        }
+    }
+    return m_options.m_costModel.m_expectedMiss * missWeight / m_rootWeight;
+}
+
+// Hill climbing over the page assignment.  The nodes of a page that hang from
+// a single node, or the top of them, are moved into an adjacent page when that
+// page still packs and the weighted cache misses go down.  Nodes left behind in
+// the page become cache misses, so the worst case can still get worse.  Emptied
+// pages are freed.
+void KdasmAssembler::LocalSearch( void )
+{
+    std::vector<KdasmAssemblerNode*> subtree;
+    std::vector<KdasmAssemblerNode*> subtreeRoots;
+    std::vector<std::pair<double, KdasmAssemblerVirtualPage*> > candidates;
+
+    intptr_t iterations = m_options.m_localSearchIterations;
+    bool improved = true;
+    while( improved && iterations > 0 && !IsOutOfTime() )
+    {
+        improved = false;
+
+        // Copied as pages are freed by moves.
+        std::vector<KdasmAssemblerVirtualPage*> pages = m_pageAllocator.GetAllocatedPages();
+        for( size_t i=0; i < pages.size() && iterations > 0 && !IsOutOfTime(); ++i )
+        {
+            KdasmAssemblerVirtualPage* pg = pages[i];
+            if( pg->GetNodeCount() == 0 )
+            {
+                continue; // Already freed.
+            }
+
+            // The root node has no supernode and stays in the root page.
+            subtreeRoots.clear();
+            std::vector<KdasmAssemblerNode*>& pgNodes = pg->GetNodes();
+            for( size_t j=0; j < pgNodes.size(); ++j )
+            {
+                KdasmAssemblerNode* supernode = pgNodes[j]->GetNodeTemp()->m_supernode;
+                if( supernode && supernode->GetVirtualPage() != pg )
+                {
+                    subtreeRoots.push_back( pgNodes[j] );
+                }
+            }
+
+            for( size_t j=0; j < subtreeRoots.size() && iterations > 0; ++j )
+            {
+                FindPageSubtree( subtreeRoots[j], subtree );
+
+                // The pages referenced by the subtree are the candidates.
+                m_adjacentPages.clear();
+                m_adjacentPages.push_back( subtreeRoots[j]->GetNodeTemp()->m_supernode->GetVirtualPage() );
+                for( size_t k=0; k < subtree.size(); ++k )
+                {
+                    for( intptr_t m=0; m < 2; ++m )
+                    {
+                        KdasmAssemblerNode* sn = subtree[k]->GetSubnode( m );
+                        if( sn && sn->GetVirtualPage() != pg
+                            && std::find( m_adjacentPages.begin(), m_adjacentPages.end(), sn->GetVirtualPage() ) == m_adjacentPages.end() )
+                        {
+                            m_adjacentPages.push_back( sn->GetVirtualPage() );
+                        }
+                    }
+                }
+
+                candidates.clear();
+                for( size_t k=0; k < m_adjacentPages.size(); ++k )
+                {
+                    // Misses are counted per physical page.
+                    if( m_adjacentPages[k]->GetPhysicalPageCount() == 1 )
+                    {
+                        // Negate to sort heaviest first.
+                        candidates.push_back( std::make_pair( -CalculateMoveGain( &subtree[0], subtree.size(), m_adjacentPages[k] ), m_adjacentPages[k] ) );
+                    }
+                }
+                std::stable_sort( candidates.begin(), candidates.end(), CompareByPriority );
+
+                for( size_t k=0; k < candidates.size() && iterations > 0; ++k )
+                {
+                    if( TryMoveSubtreePrefix( subtree, candidates[k].second, iterations ) )
+                    {
+                        ++m_report.m_localSearchMoves;
+                        improved = true;
+                        break;
+                    }
+                }
+            }
+
+            if( pg->GetNodeCount() == 0 )
+            {
+                m_pageAllocator.Recycle( pg );
+                ++m_report.m_localSearchPagesFreed;
+            }
+        }
+    }
+}
+
+// Finds the nodes of the root's page reachable from the root without leaving
+// it.  Breadth first, so any prefix includes the supernodes of its nodes.
+void KdasmAssembler::FindPageSubtree( KdasmAssemblerNode* root, std::vector<KdasmAssemblerNode*>& nodes )
+{
+    nodes.clear();
+    nodes.push_back( root );
+    for( size_t i=0; i < nodes.size(); ++i )
+    {
+        for( intptr_t j=0; j < 2; ++j )
+        {
+            KdasmAssemblerNode* sn = nodes[i]->GetSubnode( j );
+            if( sn && sn->GetVirtualPage() == root->GetVirtualPage() && !sn->GetNodeTemp()->m_sharedNode )
+            {
+                nodes.push_back( sn );
+            }
+        }
+    }
+}
+
+// Moves the whole subtree or else a prefix of it that saves cache misses.  The
+// prefix is halved after each one that does not fit, so it is not always the
+// longest that would.  Each packing attempt uses up an iteration.
+bool KdasmAssembler::TryMoveSubtreePrefix( std::vector<KdasmAssemblerNode*>& subtree, KdasmAssemblerVirtualPage* pg, intptr_t& iterations )
+{
+    size_t low = 1;
+    size_t high = subtree.size();
+    size_t count = high;
+    while( low <= high && iterations > 0 )
+    {
+        if( CalculateMoveGain( &subtree[0], count, pg ) > 0.0 )
+        {
+            --iterations;
+            if( TryMoveSubtree( &subtree[0], count, pg ) )
+            {
+                return true;
+            }
+        }
+        high = count - 1;
+        count = ( low + high ) / 2;
+    }
+    return false;
+}
+
+// The change in weighted cache misses from moving the nodes into the page.
+// References to the page stop being misses, references to the rest of the
+// subtree start being them.
+double KdasmAssembler::CalculateMoveGain( KdasmAssemblerNode** nodes, size_t nodesCount, KdasmAssemblerVirtualPage* pg )
+{
+    KdasmAssemblerVirtualPage* source = nodes[0]->GetVirtualPage();
+    double gain = 0.0;
+    if( nodes[0]->GetNodeTemp()->m_supernode->GetVirtualPage() == pg )
+    {
+        gain += nodes[0]->GetNodeTemp()->m_weight;
+    }
+    for( size_t i=0; i < nodesCount; ++i )
+    {
+        for( intptr_t j=0; j < 2; ++j )
+        {
+            KdasmAssemblerNode* sn = nodes[i]->GetSubnode( j );
+            if( sn && sn->GetVirtualPage() == pg )
+            {
+                gain += sn->GetNodeTemp()->m_weight;
+            }
+            else if( sn && sn->GetVirtualPage() == source && std::find( nodes, nodes + nodesCount, sn ) == nodes + nodesCount )
+            {
+                gain -= sn->GetNodeTemp()->m_weight;
+            }
+        }
+    }
+    return gain;
+}
+
+// Like TryBinPack() except only some nodes leave their page.  The page left
+// behind and the superpages of both pages are packed again.
+bool KdasmAssembler::TryMoveSubtree( KdasmAssemblerNode** nodes, size_t nodesCount, KdasmAssemblerVirtualPage* pg )
+{
+    TickActivity();
+
+    KdasmAssemblerVirtualPage* source = nodes[0]->GetVirtualPage();
+    std::vector<KdasmAssemblerNode*>& sourceNodes = source->GetNodes();
+    m_savedNodes = sourceNodes;
+
+    for( size_t i=0; i < nodesCount; ++i )
+    {
+        nodes[i]->SetVirtualPage( pg );
+    }
+    size_t sourceNodeCount = 0;
+    for( size_t i=0; i < m_savedNodes.size(); ++i )
+    {
+        if( m_savedNodes[i]->GetVirtualPage() == source )
+        {
+            sourceNodes[sourceNodeCount++] = m_savedNodes[i];
+        }
+    }
+    sourceNodes.resize( sourceNodeCount );
+
+    pg->FindSuperpages( m_superpages );
+    pg->AppendSuperpages( m_superpages, nodes, nodesCount );
+    if( sourceNodeCount != 0 )
+    {
+        source->AppendSuperpages( m_superpages, &sourceNodes[0], sourceNodeCount );
+    }
+
+    bool packOk = !HasSharedPageConflict( nodes, nodesCount, pg ) && m_pagePacker.Pack( pg, false, nodes, nodesCount );
+    if( packOk && sourceNodeCount != 0 )
+    {
+        packOk = m_pagePacker.Pack( source, false );
+    }
+    for( size_t i=0; packOk && i < m_superpages.size(); ++i )
+    {
+        if( m_superpages[i] != pg && m_superpages[i] != source )
+        {
+            packOk = m_pagePacker.Pack( m_superpages[i], false );
+        }
+    }
+
+    if( packOk )
+    {
+        std::vector<KdasmAssemblerNode*>& pgNodes = pg->GetNodes();
+        pgNodes.insert( pgNodes.end(), nodes, nodes + nodesCount );
+
+        packOk = m_pagePacker.Pack( pg, true );
+        if( sourceNodeCount != 0 )
+        {
+            packOk &= m_pagePacker.Pack( source, true );
+        }
+        for( size_t i=0; i < m_superpages.size(); ++i )
+        {
+            if( m_superpages[i] != pg && m_superpages[i] != source )
+            {
+                packOk &= m_pagePacker.Pack( m_superpages[i], true );
+            }
+        }
+        KdasmAssertInternal( packOk );
+    }
+    else
+    {
+        // Revert changes.
+        for( size_t i=0; i < nodesCount; ++i )
+        {
+            nodes[i]->SetVirtualPage( source );
+        }
+        sourceNodes = m_savedNodes;
+    }
+
+    return packOk;
+}
+
+void KdasmAssembler::OrderPages( KdasmEncodingHeader::PageBits pageBits )
+{
+    CalculateFarWordsHistogram( m_report.m_farWordsHistogramBefore );
+    m_report.m_encodingWordsBefore = CalculateEncodingWords();
+    m_report.m_totalSizeBefore = m_pageAllocator.AllocatedSize();
+
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    if( m_options.m_pageOrder != PAGE_ORDER_ALLOCATION && pages.size() > 2 && !IsOutOfTime() )
+    {
+        // Pages are sorted by physical page, which allows the page index to be
+        // found by searching.  Page index 0 is the root page.
+        m_pageSubpages.assign( pages.size(), std::vector<intptr_t>() );
+        std::vector<KdasmAssemblerVirtualPage*> subpages;
+        for( size_t i=0; i < pages.size(); ++i )
+        {
+            FindSubpagesByWeight( pages[i], subpages );
+            for( size_t j=0; j < subpages.size(); ++j )
+            {
+                m_pageSubpages[i].push_back( FindPageIndex( subpages[j] ) );
+            }
+        }
+
+        std::vector<intptr_t> previousPhysicalPageStart( pages.size() );
+        for( size_t i=0; i < pages.size(); ++i )
+        {
+            previousPhysicalPageStart[i] = pages[i]->GetPhysicalPageStart();
+        }
+
+        // A page whose subpages have moved away may need more far reference
+        // words than it has room for.  Those pages are repaired by swapping pages
+        // around them, and any that still fail adjust the order of their subpages
+        // on the next attempt.
+        m_pageOrderHints.m_superpage.assign( pages.size(), -1 );
+        m_pageOrderHints.m_firstSubpages.assign( pages.size(), std::vector<intptr_t>() );
+        m_pageOrderHints.m_subpagesFirst.assign( pages.size(), false );
+
+        intptr_t immediatePages = KdasmEncoding::IMMEDIATE_OFFSET_MAX >> ( (int)pageBits - 1 );
+        std::vector<intptr_t> order;
+        std::vector<intptr_t> failingPages;
+        for( int attempt=0; attempt < MAX_PAGE_ORDER_ATTEMPTS && !m_report.m_pageOrderApplied && !IsOutOfTime(); ++attempt )
+        {
+            if( !BuildPageOrder( order ) )
+            {
+                break;
+            }
+            PlacePages( order );
+            m_report.m_pageOrderApplied = RepairPageOrder( failingPages );
+            if( !m_report.m_pageOrderApplied )
+            {
+                AddPageOrderHints( failingPages, immediatePages );
+            }
+        }
+
+        if( !m_report.m_pageOrderApplied )
+        {
+            for( size_t i=0; i < pages.size(); ++i )
+            {
+                pages[i]->SetPhysicalPageStart( previousPhysicalPageStart[i] );
+            }
+        }
 
-                    if( TryBinPack( bin, pg ) )
-                    {
-                        currentPagesBySize.erase( currentPagesBySize.begin() + pivot + distance );
+        // Restores physical page order to the page list.
+        m_pageAllocator.CompactPhysicalPages();
+        m_pageSubpages.clear();
+        m_pageTree.clear();
+        m_pageOrderHints.m_superpage.clear();
+        m_pageOrderHints.m_firstSubpages.clear();
+        m_pageOrderHints.m_subpagesFirst.clear();
+    }
 
-                        compactPhysicalPagesCounter += pg->GetPhysicalPageCount();
-                        m_pageAllocator.Recycle( pg );
-                        if( compactPhysicalPagesCounter > (KdasmEncoding::IMMEDIATE_OFFSET_MAX/2) )
-                        {
-                            compactPhysicalPagesCounter = 0;
-                            m_pageAllocator.CompactAndFreePhysicalPages();
-                        }
+    CalculateFarWordsHistogram( m_report.m_farWordsHistogramAfter );
+    m_report.m_encodingWordsAfter = CalculateEncodingWords();
+    m_report.m_totalSizeAfter = m_pageAllocator.AllocatedSize();
+}
 
-                        remainingWords = bin->GetPhysicalPageCount() * pageWords - bin->GetEncodingSize();
-                        KdasmAssertInternal( remainingWords >= 0 && remainingWords < pageWords );
-                        if( j > remainingWords )
-                        {
-                            j = remainingWords + 1; // skip to remainingWords.
-                            break;
-                        }
+// Builds a depth first spanning tree of the page graph visiting the subpages
+// with the most leaf nodes first, and orders the pages by it.  Returns false
+// if some pages cannot be reached from the root page.
+bool KdasmAssembler::BuildPageOrder( std::vector<intptr_t>& order )
+{
+    size_t pageCount = m_pageSubpages.size();
+    std::vector<bool> visited;
+    std::vector<std::pair<intptr_t, intptr_t> > depthFirstStack; // Page index and parent page index.
+    std::vector<intptr_t> subpageIndices;
+    for( ;; )
+    {
+        order.clear();
+        order.reserve( pageCount );
+        m_pageTree.assign( pageCount, std::vector<intptr_t>() );
+        visited.assign( pageCount, false );
+        depthFirstStack.push_back( std::make_pair( (intptr_t)0, (intptr_t)-1 ) );
 
-                        if( distance <= 0 && pivot > 0 )
-                        {
-                            --pivot;
-                        }
-                        step = false;
-                    }
+        while( !depthFirstStack.empty() )
+        {
+            intptr_t pageIndex = depthFirstStack.back().first;
+            intptr_t parentIndex = depthFirstStack.back().second;
+            depthFirstStack.pop_back();
+            if( visited[pageIndex] )
+            {
+                continue; // Reached from more than one superpage.
+            }
+            visited[pageIndex] = true;
+            order.push_back( pageIndex );
+            if( parentIndex != -1 )
+            {
+                m_pageTree[parentIndex].push_back( pageIndex );
+            }
 
-                    distance = -distance;
-                    if( step )
-                    {
-                        distance += ( distance >= 0 ) ? 1 : -1;
-                    }
-                    step = !step;
-                    if( ( pivot + distance ) < 0 || ( pivot + distance ) >= (intptr_t)currentPagesBySize.size() )
-                    {
-                        distance = -distance;
-                        if( step )
-                        {
-                            distance += ( distance >= 0 ) ? 1 : -1;
-                        }
-                        step = !step;
-                        if( ( pivot + distance ) < 0 || ( pivot + distance ) >= (intptr_t)currentPagesBySize.size() )
-                        {
-                            break;
-                        }
-                    }
-                    if( ::abs( distance ) > MAX_PAGE_MERGE_SCAN_DISTANCE )
-                    {
-                        break;
-                    }
+            subpageIndices = m_pageOrderHints.m_firstSubpages[pageIndex];
+            subpageIndices.insert( subpageIndices.end(), m_pageSubpages[pageIndex].begin(), m_pageSubpages[pageIndex].end() );
+            for( size_t i=subpageIndices.size(); i-- != 0; /**/ )
+            {
+                intptr_t subpageIndex = subpageIndices[i];
+                intptr_t superpageIndex = m_pageOrderHints.m_superpage[subpageIndex];
+                if( !visited[subpageIndex] && ( superpageIndex == -1 || superpageIndex == pageIndex ) )
+                {
+                    depthFirstStack.push_back( std::make_pair( subpageIndex, pageIndex ) );
                 }
             }
+            TickActivity();
+        }
+
+        if( order.size() == pageCount )
+        {
+            break;
+        }
+
+        // Merged pages may reference each other, leaving a hinted page only
+        // reachable through itself.  Drop those hints and start over.  Each pass
+        // drops at least one hint or gives up.
+        bool isHintDropped = false;
+        for( size_t i=0; i < pageCount; ++i )
+        {
+            if( !visited[i] && m_pageOrderHints.m_superpage[i] != -1 )
+            {
+                m_pageOrderHints.m_superpage[i] = -1;
+                isHintDropped = true;
+            }
         }
+        KdasmAssertInternal( isHintDropped ); // Every page is referenced.
+        if( !isHintDropped )
+        {
+            return false;
+        }
+    }
+
+    if( m_options.m_pageOrder == PAGE_ORDER_VAN_EMDE_BOAS )
+    {
+        // Children always follow their parent in depth first order.
+        std::vector<intptr_t> heights( pageCount, 1 );
+        for( size_t i=order.size(); i-- != 0; /**/ )
+        {
+            std::vector<intptr_t>& children = m_pageTree[order[i]];
+            for( size_t j=0; j < children.size(); ++j )
+            {
+                heights[order[i]] = std::max( heights[order[i]], heights[children[j]] + 1 );
+            }
+        }
+        order.clear();
+        OrderPagesVanEmdeBoas( 0, heights[0], order );
+        KdasmAssertInternal( order.size() == pageCount );
     }
+    return true;
 }
 
-void KdasmAssembler::BuildPagesBySize( intptr_t pageWords )
+// Assigns physical pages in the given order.  Pages flagged subpagesFirst are
+// followed directly by any of their subpages that have not been placed yet.
+void KdasmAssembler::PlacePages( const std::vector<intptr_t>& order )
 {
-    // Last index is actually for pages larger than a single physical page.
-    m_pagesBySize.clear();
-    m_pagesBySize.resize( pageWords + 1 );
-
-    // Skip bin packing the root page.  It should be well packed anyway.
     std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    std::vector<bool> placed( pages.size(), false );
+    std::vector<intptr_t> placedOrder;
+    placedOrder.reserve( pages.size() );
 
-    // Queue bins earlier in the address space before those that come after.  This gives
-    // pages closer to the root of the tree a chance to gather nearby nodes first.
-    // Pages of size "pageWords" and "pageWords-1" are not added as they are full.
-    for( size_t i=pages.size()-1; i >= 1; --i )
+    for( size_t i=0; i < order.size(); ++i )
     {
-        KdasmAssemblerVirtualPage* pg = pages[i];
-        if( pg->GetEncodingSize() >= (pageWords + 1) )
-        {
-            m_pagesBySize[pageWords].push_back( pg );
-        }
-        else if( pg->GetEncodingSize() < (pageWords - 1) )
+        if( placed[order[i]] )
         {
-            m_pagesBySize[pg->GetEncodingSize()].push_back( pg );
+            continue;
         }
+        placed[order[i]] = true;
+        placedOrder.push_back( order[i] );
+
+        PlaceSubpagesFirst( order[i], placed, placedOrder );
     }
-    KdasmAssertInternal( m_pagesBySize[0].empty() );
 
-    // As a special case, oversize pages are packed first and are bins only, but at
-    // least hit them in the right order.
-    std::sort( m_pagesBySize[pageWords].begin(), m_pagesBySize[pageWords].end(), KdasmAssemblerVirtualPage::CompareByEncodingSize );
+    intptr_t physicalPageStart = 0;
+    for( size_t i=0; i < placedOrder.size(); ++i )
+    {
+        KdasmAssemblerVirtualPage* pg = pages[placedOrder[i]];
+        pg->SetPhysicalPageStart( physicalPageStart );
+        physicalPageStart += pg->GetPhysicalPageCount();
+    }
 }
 
-intptr_t KdasmAssembler::FindClosestPhysicalPage( KdasmAssemblerVirtualPage* bin, std::vector<KdasmAssemblerVirtualPage*>& pages )
+// The subpages placed may be flagged as well.
+void KdasmAssembler::PlaceSubpagesFirst( intptr_t pageIndex, std::vector<bool>& placed, std::vector<intptr_t>& placedOrder )
 {
-    KdasmAssertInternal( !pages.empty() );
-
-    // This early out is normal with large data sets.  The pages are stored in
-    // reverse physical order to make it efficient to remove entries.
-    if( pages.back()->GetPhysicalPageStart() < bin->GetPhysicalPageStart() )
+    if( !m_pageOrderHints.m_subpagesFirst[pageIndex] )
     {
-        return pages.size() - 1;
+        return;
     }
-    
-    std::vector<KdasmAssemblerVirtualPage*>::iterator i = std::lower_bound( pages.begin(), pages.end(),
-        bin, KdasmAssemblerVirtualPage::CompareByPhysicalPagesReverse );
-    if( i == pages.end() )
+
+    size_t placedBegin = placedOrder.size();
+    std::vector<intptr_t>& subpageIndices = m_pageSubpages[pageIndex];
+    for( size_t i=0; i < subpageIndices.size(); ++i )
     {
-        i = pages.end() - 1;
+        if( !placed[subpageIndices[i]] )
+        {
+            placed[subpageIndices[i]] = true;
+            placedOrder.push_back( subpageIndices[i] );
+        }
     }
 
-    return (intptr_t)( i - pages.begin() );
+    size_t placedEnd = placedOrder.size();
+    for( size_t i=placedBegin; i < placedEnd; ++i )
+    {
+        PlaceSubpagesFirst( placedOrder[i], placed, placedOrder );
+    }
 }
 
-bool KdasmAssembler::TryBinPack( KdasmAssemblerVirtualPage* bin, KdasmAssemblerVirtualPage* pg )
+// Swaps pages near each page that fails to pack with the pages it references
+// until every page packs.  Saves the packing and returns true on success,
+// otherwise returns the pages that still fail.
+bool KdasmAssembler::RepairPageOrder( std::vector<intptr_t>& failingPages )
 {
-    TickActivity();
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
 
-    std::vector<KdasmAssemblerNode*>& pgNodes = pg->GetNodes();
-    size_t pgNodeCount = pgNodes.size();
+    std::vector<std::vector<intptr_t> > superpageIndices( pages.size() );
+    for( size_t i=0; i < pages.size(); ++i )
+    {
+        for( size_t j=0; j < m_pageSubpages[i].size(); ++j )
+        {
+            superpageIndices[m_pageSubpages[i][j]].push_back( (intptr_t)i );
+        }
+    }
 
-    for( size_t i=0; i < pgNodeCount; ++i )
+    // Maps physical pages back to the page starting there.
+    std::vector<intptr_t> pageAtPhysicalPage;
+    for( size_t i=0; i < pages.size(); ++i )
     {
-        pgNodes[i]->SetVirtualPage( bin );
+        intptr_t physicalPageEnd = pages[i]->GetPhysicalPageStart() + pages[i]->GetPhysicalPageCount();
+        if( (intptr_t)pageAtPhysicalPage.size() < physicalPageEnd )
+        {
+            pageAtPhysicalPage.resize( physicalPageEnd, -1 );
+        }
+        pageAtPhysicalPage[pages[i]->GetPhysicalPageStart()] = (intptr_t)i;
     }
-  
-    bin->FindSuperpages( m_superpages );
-    bin->AppendSuperpages( m_superpages, &pgNodes[0], pgNodeCount );
 
-    // Test if bin and referring pages can encode within size limits.
-    bool packOk = m_pagePacker.Pack( bin, false, &pgNodes[0], pgNodeCount );
-    KdasmAssemblerVirtualPage* failingPage = NULL;
-    if( packOk )
+    failingPages.clear();
+    std::vector<bool> isFailing( pages.size(), false );
+    for( size_t i=0; i < pages.size(); ++i )
     {
-        for( size_t i=0; i < m_superpages.size(); ++i )
+        TickActivity();
+        if( !m_pagePacker.Pack( pages[i], false ) )
         {
-            if( m_superpages[i] == pg )
-            {
-                continue;
-            }
-            if( !m_pagePacker.Pack( m_superpages[i], false ) )
-            {
-                if( failingPage == NULL )
-                {
-                    failingPage = m_superpages[i];
-                    KdasmAssertInternal( failingPage != bin );
-                }
-                else
-                {
-                    packOk = false;
-                    break;
-                }
-            }
+            failingPages.push_back( (intptr_t)i );
+            isFailing[i] = true;
         }
     }
 
-    if( packOk && failingPage != NULL )
+    std::vector<intptr_t> affected;
+    std::vector<bool> affectedFailing;
+    std::vector<intptr_t> stillFailing;
+    for( int pass=0; pass < MAX_PAGE_ORDER_REPAIR_PASSES && !failingPages.empty(); ++pass )
     {
-        // Try moving the branch node down into the bin from the failing super page.
-        std::vector<KdasmAssemblerNode*>& superNodes = failingPage->GetNodes();
-        KdasmAssemblerNode* superNode = NULL;
-        for( size_t i=0; i < superNodes.size(); ++i )
+        stillFailing.clear();
+        for( size_t i=0; i < failingPages.size(); ++i )
         {
-            KdasmAssemblerNode* n = superNodes[i];
-            for( intptr_t j=0; j < 2; ++j )
+            intptr_t pageIndex = failingPages[i];
+            if( !isFailing[pageIndex] )
             {
-                if( n->GetSubnode( j ) && n->GetSubnode( j )->GetVirtualPage() == bin )
-                {
-                    superNode = n;
-                    break;
-                }
+                continue; // Repaired by an earlier swap.
             }
-        }
-        KdasmAssertInternal( superNode != NULL );
-
-        failingPage->FindSuperpages( m_failingPageSuperpages );
 
-        failingPage->RemoveNode( superNode );
-        bin->InsertNode( superNode );
-
-        packOk = m_pagePacker.Pack( bin, false, &pgNodes[0], pgNodeCount );
-        if( packOk )
-        {
-            packOk = m_pagePacker.Pack( failingPage, false );
-            if( packOk )
+            // Try moving each subpage next to the page, then the page next to each
+            // subpage.  The root page stays first.
+            const std::vector<intptr_t>& subpageIndices = m_pageSubpages[pageIndex];
+            for( size_t j=0; j < subpageIndices.size() * 2 && isFailing[pageIndex]; ++j )
             {
-                for( size_t i=0; i < m_superpages.size(); ++i )
+                bool movingSubpage = j < subpageIndices.size();
+                intptr_t movingIndex = movingSubpage ? subpageIndices[j] : pageIndex;
+                intptr_t targetIndex = movingSubpage ? pageIndex : subpageIndices[j - subpageIndices.size()];
+                if( movingIndex == 0 )
                 {
-                    if( pg != m_superpages[i] )
+                    continue;
+                }
+
+                for( intptr_t distance=-MAX_PAGE_ORDER_REPAIR_DISTANCE; distance <= MAX_PAGE_ORDER_REPAIR_DISTANCE && isFailing[pageIndex]; ++distance )
+                {
+                    intptr_t physicalPage = pages[targetIndex]->GetPhysicalPageStart() + distance;
+                    if( distance == 0 || physicalPage <= 0 || physicalPage >= (intptr_t)pageAtPhysicalPage.size() )
                     {
-                        if( !m_pagePacker.Pack( m_superpages[i], false ) )
+                        continue;
+                    }
+                    intptr_t swapIndex = pageAtPhysicalPage[physicalPage];
+                    if( swapIndex == -1 || swapIndex == movingIndex
+                        || pages[swapIndex]->GetPhysicalPageCount() != pages[movingIndex]->GetPhysicalPageCount() )
+                    {
+                        continue;
+                    }
+
+                    affected.clear();
+                    affected.push_back( pageIndex );
+                    affected.push_back( movingIndex );
+                    affected.push_back( swapIndex );
+                    affected.insert( affected.end(), superpageIndices[movingIndex].begin(), superpageIndices[movingIndex].end() );
+                    affected.insert( affected.end(), superpageIndices[swapIndex].begin(), superpageIndices[swapIndex].end() );
+                    std::sort( affected.begin() + 1, affected.end() );
+                    affected.erase( std::unique( affected.begin() + 1, affected.end() ), affected.end() );
+
+                    SwapPhysicalPages( movingIndex, swapIndex, pageAtPhysicalPage );
+
+                    // The failing page must pack, and pages that packed before must still pack.
+                    bool swapOk = true;
+                    affectedFailing.assign( affected.size(), false );
+                    for( size_t k=0; k < affected.size() && swapOk; ++k )
+                    {
+                        TickActivity();
+                        if( k == 0 || affected[k] != pageIndex )
                         {
-                            packOk = false;
-                            break;
+                            affectedFailing[k] = !m_pagePacker.Pack( pages[affected[k]], false );
+                            swapOk = !affectedFailing[k] || ( k != 0 && isFailing[affected[k]] );
                         }
                     }
-                }
-                if( packOk )
-                {
-                    for( size_t i=0; i < m_failingPageSuperpages.size(); ++i )
+
+                    if( swapOk )
                     {
-                        if( bin != m_failingPageSuperpages[i] && pg != m_failingPageSuperpages[i] )
+                        for( size_t k=0; k < affected.size(); ++k )
                         {
-                            if( !m_pagePacker.Pack( m_failingPageSuperpages[i], false ) )
-                            {
-                                packOk = false;
-                                break;
-                            }
+                            isFailing[affected[k]] = affectedFailing[k];
                         }
                     }
+                    else
+                    {
+                        SwapPhysicalPages( movingIndex, swapIndex, pageAtPhysicalPage );
+                    }
                 }
             }
+
+            if( isFailing[pageIndex] )
+            {
+                stillFailing.push_back( pageIndex );
+            }
         }
-        if( packOk )
+        failingPages.swap( stillFailing );
+    }
+
+    if( !failingPages.empty() )
+    {
+        return false;
+    }
+
+    bool packOk = true;
+    for( size_t i=0; i < pages.size(); ++i )
+    {
+        packOk &= m_pagePacker.Pack( pages[i], true );
+    }
+    KdasmAssertInternal( packOk );
+    return true;
+}
+
+void KdasmAssembler::SwapPhysicalPages( intptr_t pageIndexA, intptr_t pageIndexB, std::vector<intptr_t>& pageAtPhysicalPage )
+{
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    intptr_t physicalPageStartA = pages[pageIndexA]->GetPhysicalPageStart();
+    intptr_t physicalPageStartB = pages[pageIndexB]->GetPhysicalPageStart();
+    pages[pageIndexA]->SetPhysicalPageStart( physicalPageStartB );
+    pages[pageIndexB]->SetPhysicalPageStart( physicalPageStartA );
+    pageAtPhysicalPage[physicalPageStartA] = pageIndexB;
+    pageAtPhysicalPage[physicalPageStartB] = pageIndexA;
+}
+
+// Subpages out of immediate range of a failing page are visited first, or only
+// from the failing page if they were reached from another superpage.  Pages that
+// fail again have all of their subpages placed directly after them.
+void KdasmAssembler::AddPageOrderHints( const std::vector<intptr_t>& failingPages, intptr_t immediatePages )
+{
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    for( size_t i=0; i < failingPages.size(); ++i )
+    {
+        intptr_t pageIndex = failingPages[i];
+        std::vector<intptr_t>& firstSubpages = m_pageOrderHints.m_firstSubpages[pageIndex];
+        const std::vector<intptr_t>& subpageIndices = m_pageSubpages[pageIndex];
+        bool hinted = false;
+        for( size_t j=0; j < subpageIndices.size(); ++j )
         {
-            // Commit to modification of failing super page.
-            packOk = m_pagePacker.Pack( failingPage, true );
-            for( size_t i=0; i < m_failingPageSuperpages.size(); ++i )
+            intptr_t subpageIndex = subpageIndices[j];
+            intptr_t distance = pages[subpageIndex]->GetPhysicalPageStart() - pages[pageIndex]->GetPhysicalPageStart();
+            if( ::abs( distance ) <= immediatePages )
+            {
+                continue;
+            }
+
+            intptr_t& superpageIndex = m_pageOrderHints.m_superpage[subpageIndex];
+            if( distance < 0 && superpageIndex == -1 )
+            {
+                superpageIndex = pageIndex;
+                hinted = true;
+            }
+            else if( distance > 0 && std::find( firstSubpages.begin(), firstSubpages.end(), subpageIndex ) == firstSubpages.end() )
+            {
+                firstSubpages.push_back( subpageIndex );
+                hinted = true;
+            }
+        }
+
+        if( !hinted )
+        {
+            m_pageOrderHints.m_subpagesFirst[pageIndex] = true;
+        }
+    }
+}
+
+// Subpages sorted by the weight of the nodes they contain that are referenced from pg.
+void KdasmAssembler::FindSubpagesByWeight( KdasmAssemblerVirtualPage* pg, std::vector<KdasmAssemblerVirtualPage*>& subpages )
+{
+    std::vector<std::pair<double, KdasmAssemblerVirtualPage*> > weights;
+
+    std::vector<KdasmAssemblerNode*>& nodes = pg->GetNodes();
+    for( size_t i=0; i < nodes.size(); ++i )
+    {
+        for( intptr_t j=0; j < 2; ++j )
+        {
+            KdasmAssemblerNode* sn = nodes[i]->GetSubnode( j );
+            if( sn && sn->GetVirtualPage() != pg )
             {
-                if( bin != m_failingPageSuperpages[i] && pg != m_failingPageSuperpages[i] )
+                size_t k=0;
+                while( k < weights.size() && weights[k].second != sn->GetVirtualPage() )
                 {
-                    packOk |= m_pagePacker.Pack( m_failingPageSuperpages[i], true );
+                    ++k;
+                }
+                if( k == weights.size() )
+                {
+                    weights.push_back( std::make_pair( 0.0, sn->GetVirtualPage() ) );
                 }
+                // Negate to sort heaviest first.
+                weights[k].first -= sn->GetNodeTemp()->m_weight;
             }
-            KdasmAssertInternal( packOk );
-        }
-        else
-        {
-            bin->RemoveNode( superNode );
-            failingPage->InsertNode( superNode );
         }
-    }    
-    
-    if( packOk )
+    }
+
+    std::stable_sort( weights.begin(), weights.end(), CompareByPriority );
+
+    subpages.clear();
+    for( size_t i=0; i < weights.size(); ++i )
     {
-        // Commit to page merge.
-        std::vector<KdasmAssemblerNode*>& binNodes = bin->GetNodes();
-        binNodes.insert( binNodes.end(), pgNodes.begin(), pgNodes.end() );
+        subpages.push_back( weights[i].second );
+    }
+}
 
-        pgNodes.clear();
+// Ties keep their order.  Comparing the page pointers would make the result
+// depend on where the pages were allocated.
+bool KdasmAssembler::CompareByPriority( const std::pair<double, KdasmAssemblerVirtualPage*>& a, const std::pair<double, KdasmAssemblerVirtualPage*>& b )
+{
+    return a.first < b.first;
+}
 
-        bool packOk = m_pagePacker.Pack( bin, true );
-        for( size_t i=0; i < m_superpages.size(); ++i )
-        {
-            packOk |= m_pagePacker.Pack( m_superpages[i], true );
-        }
-        KdasmAssertInternal( packOk );
+intptr_t KdasmAssembler::FindPageIndex( KdasmAssemblerVirtualPage* pg )
+{
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    std::vector<KdasmAssemblerVirtualPage*>::iterator i = std::lower_bound( pages.begin(), pages.end(),
+        pg, KdasmAssemblerVirtualPage::CompareByPhysicalPages );
+    KdasmAssertInternal( i != pages.end() && *i == pg );
+    return (intptr_t)( i - pages.begin() );
+}
+
+// Lays out the top half of the tree followed by each of the bottom subtrees.
+void KdasmAssembler::OrderPagesVanEmdeBoas( intptr_t pageIndex, intptr_t height, std::vector<intptr_t>& order )
+{
+    if( height <= 1 )
+    {
+        order.push_back( pageIndex );
+        return;
     }
-    else
+
+    intptr_t topHeight = height / 2;
+    OrderPagesVanEmdeBoas( pageIndex, topHeight, order );
+
+    std::vector<intptr_t> bottomPageIndices;
+    FindPagesAtDepth( pageIndex, topHeight, bottomPageIndices );
+    for( size_t i=0; i < bottomPageIndices.size(); ++i )
     {
-        // Revert changes.
-        for( size_t i=0; i < pgNodeCount; ++i )
+        OrderPagesVanEmdeBoas( bottomPageIndices[i], height - topHeight, order );
+    }
+}
+
+void KdasmAssembler::FindPagesAtDepth( intptr_t pageIndex, intptr_t depth, std::vector<intptr_t>& pageIndices )
+{
+    if( depth == 0 )
+    {
+        pageIndices.push_back( pageIndex );
+        return;
+    }
+
+    std::vector<intptr_t>& children = m_pageTree[pageIndex];
+    for( size_t i=0; i < children.size(); ++i )
+    {
+        FindPagesAtDepth( children[i], depth - 1, pageIndices );
+    }
+}
+
+// The saved external indices of each node describe how its reference was packed.
+void KdasmAssembler::CalculateFarWordsHistogram( intptr_t* histogram )
+{
+    ::memset( histogram, 0, sizeof( intptr_t ) * ( KdasmEncoding::FAR_WORDS_COUNT_MAX + 1 ) );
+
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    for( size_t i=0; i < pages.size(); ++i )
+    {
+        std::vector<KdasmAssemblerNode*>& nodes = pages[i]->GetNodes();
+        for( size_t j=0; j < nodes.size(); ++j )
         {
-            pgNodes[i]->SetVirtualPage( pg );
+            KdasmAssemblerNodeTempData* nodeTemp = nodes[j]->GetNodeTemp();
+            for( KdasmAssemblerNode* s = nodeTemp->m_nextShare; s; s = s->GetNodeTemp()->m_nextShare )
+            {
+                ++histogram[s->GetNodeTemp()->m_externalIndices.m_extraDataSize];
+            }
+            if( nodeTemp->m_supernode == NULL )
+            {
+                continue; // Referenced by the header.
+            }
+            if( nodeTemp->m_supernode->GetVirtualPage() != pages[i] )
+            {
+                KdasmAssertInternal( nodeTemp->m_externalIndices.m_extraDataSize <= KdasmEncoding::FAR_WORDS_COUNT_MAX );
+                ++histogram[nodeTemp->m_externalIndices.m_extraDataSize];
+            }
+            else if( nodeTemp->m_forceFarAddressing )
+            {
+                ++histogram[0];
+            }
         }
     }
+}
 
-    return packOk;
+intptr_t KdasmAssembler::CalculateEncodingWords( void )
+{
+    intptr_t encodingWords = 0;
+
+    std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
+    for( size_t i=0; i < pages.size(); ++i )
+    {
+        encodingWords += pages[i]->GetEncodingSize();
+    }
+    return encodingWords;
 }
 
-void KdasmAssembler::Encode( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, std::vector<KdasmEncoding>& result )
+// Pages do not overlap, so they are written in any order.
+void KdasmAssembler::Encode( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, KdasmEncoding* result )
 {
-    size_t expectedSize = m_pageAllocator.AllocatedSize();
-    result.reserve( expectedSize );
+    intptr_t pageWords = m_pageAllocator.GetPhysicalPageWords();
+    intptr_t size = m_pageAllocator.AllocatedSize();
+    intptr_t encodedWords = 0;
 
     std::vector<KdasmAssemblerVirtualPage*>& pages = m_pageAllocator.GetAllocatedPages();
     for( size_t i=0; i < pages.size(); ++i )
     {
-        std::vector<KdasmEncoding>& pageEncoding = m_pagePacker.Encode( pages[i] );
-        result.insert( result.end(), pageEncoding.begin(), pageEncoding.end() );
+        if( pages[i]->GetPhysicalPageCount() == 0 )
+        {
+            continue;
+        }
+        KdasmAssertInternal( ( pages[i]->GetPhysicalPageStart() + pages[i]->GetPhysicalPageCount() ) * pageWords <= size );
+        m_pagePacker.Encode( pages[i], result + pages[i]->GetPhysicalPageStart() * pageWords );
+        encodedWords += pages[i]->GetPhysicalPageCount() * pageWords;
         TickActivity();
     }
 
-    KdasmAssertInternal( result.size() == expectedSize );
+    KdasmAssertInternal( encodedWords == size ); (void)size;
     KdasmAssertInternal( pages[0]->GetNodes().front() == root );
 
+    KdasmAssertInternal( IsEncodable( root ) );
+
     KdasmEncodingHeader h;
     h.Reset();
     h.SetDistanceLength( (KdasmU16)root->GetDistanceLength() );
     h.SetIsLeavesAtRoot( !root->HasSubnodes() );
     h.SetPageBits( pageBits );
+    h.SetIsPackedLeaves( m_options.m_packLeaves );
+    h.SetLeafBits( m_leafBits );
+    h.SetIsLeafRanges( m_options.m_leafRanges );
+    h.SetIsRelativeDistance( m_options.m_relativeDistance );
+    h.SetIsLeafSlack( m_options.m_leafSlack > 0.0 );
 
     for( int i=0; i < KdasmEncodingHeader::HEADER_LENGTH; ++i )
     {
@@ -1834,21 +4285,19 @@ void KdasmAssembler::Clear( void )
     m_pageQueue.Clear();
     m_pagePacker.Clear();
     m_pagesBySize.clear();
+    m_pageTree.clear();
 }
 
 // ----------------------------------------------------------------------------
 
-KdasmAssemblerNode* KdasmDisassembler::Disassemble( KdasmEncoding* encodingRoot, KdasmAssemblerNode* compareTo )
+KdasmAssemblerNode* KdasmDisassembler::Disassemble( KdasmEncoding* encodingRoot, KdasmAssemblerNode* compareTo, const KdasmU16* leafArray )
 {
-    ::memset( this, 0, sizeof *this );
-
-    KdasmEncodingHeader* header = (KdasmEncodingHeader*)encodingRoot;
-    if( !header->VersionCheck() )
+    if( !Prepare( encodingRoot, leafArray ) )
     {
-        KdasmAssert( "Version Incorrect", 0 );
         return NULL;
     }
 
+    KdasmEncodingHeader* header = (KdasmEncodingHeader*)encodingRoot;
     KdasmAssemblerNode* result = NULL;
     if( header->IsLeavesAtRoot() )
     {
@@ -1856,8 +4305,6 @@ KdasmAssemblerNode* KdasmDisassembler::Disassemble( KdasmEncoding* encodingRoot,
     }
     else
     {
-        m_pageAddressMask = ((intptr_t)1 << (header->GetPageBits() - 1)) - 1;
-        m_distanceLength = (int)header->GetDistanceLength();
         result = DisassembleEncoding( encodingRoot + KdasmEncodingHeader::HEADER_LENGTH, 0, compareTo );
     }
 
@@ -1869,6 +4316,35 @@ KdasmAssemblerNode* KdasmDisassembler::Disassemble( KdasmEncoding* encodingRoot,
     return result;
 }
 
+KdasmAssemblerNode* KdasmDisassembler::DisassembleSubtree( KdasmEncoding* encodingRoot, KdasmEncoding* encoding, intptr_t treeIndex )
+{
+    if( !Prepare( encodingRoot, NULL ) )
+    {
+        return NULL;
+    }
+    return DisassembleEncoding( encoding, treeIndex, NULL );
+}
+
+bool KdasmDisassembler::Prepare( KdasmEncoding* encodingRoot, const KdasmU16* leafArray )
+{
+    ::memset( this, 0, sizeof *this );
+
+    KdasmEncodingHeader* header = (KdasmEncodingHeader*)encodingRoot;
+    if( !header->VersionCheck() )
+    {
+        KdasmAssert( "Version Incorrect", 0 );
+        return false;
+    }
+
+    m_isPackedLeaves = header->IsPackedLeaves();
+    m_leafBits = header->GetLeafBits();
+    KdasmAssert( "Leaf ranges require the leaf array", !header->IsLeafRanges() || leafArray );
+    m_leafArray = header->IsLeafRanges() ? leafArray : NULL;
+    m_pageAddressMask = ((intptr_t)1 << (header->GetPageBits() - 1)) - 1;
+    m_distanceLength = (int)header->GetDistanceLength();
+    return true;
+}
+
 KdasmAssemblerNode* KdasmDisassembler::DisassembleEncoding( KdasmEncoding* encoding, intptr_t treeIndex, KdasmAssemblerNode* compareTo )
 {
     KdasmU16 normal = encoding->GetNomal();
@@ -1992,29 +4468,49 @@ KdasmAssemblerNode* KdasmDisassembler::DisassembleEncoding( KdasmEncoding* encod
 
 KdasmAssemblerNode* KdasmDisassembler::DisassembleLeavesFar( KdasmEncoding* encoding, KdasmAssemblerNode* compareTo )
 {
-    intptr_t leafCount = (intptr_t)encoding->GetRaw();
-    KdasmAssert( "Leaf data block overflow.  Will require a header.", leafCount < KdasmEncoding::LEAF_COUNT_OVERFLOW );
-    ++encoding;
-    return DisassembleLeaves( encoding, leafCount, compareTo );
+    KdasmLeafSpan<KdasmU16> words = KdasmLeafSpan<KdasmU16>::FromLeavesFar( encoding );
+    return DisassembleLeaves( (KdasmEncoding*)words.GetWords(), words.Size(), compareTo );
 }
 
-KdasmAssemblerNode* KdasmDisassembler::DisassembleLeaves( KdasmEncoding* encoding, intptr_t leafCount, KdasmAssemblerNode* compareTo )
+KdasmAssemblerNode* KdasmDisassembler::DisassembleLeaves( KdasmEncoding* encoding, intptr_t leafWordCount, KdasmAssemblerNode* compareTo )
 {
-    KdasmU16* leaves = new KdasmU16[leafCount];
-    for( intptr_t i=0; i < leafCount; ++i )
+    intptr_t leafCount = leafWordCount >> m_leafBits;
+    KdasmU16* leaves = NULL;
+    if( m_leafArray )
+    {
+        KdasmLeafRange range = KdasmLeafRange::FromWords( encoding, leafWordCount );
+        leafCount = range.m_count;
+        leafWordCount = range.m_count << m_leafBits;
+        leaves = new KdasmU16[leafWordCount];
+        ::memcpy( leaves, m_leafArray + ( range.m_start << m_leafBits ), leafWordCount * sizeof( KdasmU16 ) );
+    }
+    else if( m_isPackedLeaves )
+    {
+        KdasmAssert( "Packed leaf block length incorrect", KdasmPackedLeaves::GetLength( encoding ) == leafWordCount );
+        leafCount = KdasmPackedLeaves::GetLeafCount( encoding );
+        leafWordCount = leafCount;
+        leaves = new KdasmU16[leafCount];
+        KdasmPackedLeaves::Unpack( encoding, leaves );
+    }
+    else
     {
-        leaves[i] = encoding[i].GetRaw();
+        KdasmAssert( "Leaf block length is not a whole number of leaves", ( leafCount << m_leafBits ) == leafWordCount );
+        leaves = new KdasmU16[leafWordCount];
+        for( intptr_t i=0; i < leafWordCount; ++i )
+        {
+            leaves[i] = encoding[i].GetRaw();
+        }
     }
 
     if( compareTo )
     {
-        if( compareTo->GetLeafCount() != leafCount )
+        if( compareTo->GetLeafCount() != leafCount || compareTo->GetLeafBits() != m_leafBits )
         {
             KdasmAssert( "Leaf Count Incorrect", 0 );
             m_compareToFailId = compareTo->GetCompareToId();
             return NULL;
         }
-        for( intptr_t i=0; i < leafCount; ++i )
+        for( intptr_t i=0; i < leafWordCount; ++i )
         {
             if( leaves[i] != compareTo->GetLeaves()[i] )
             {
@@ -2026,11 +4522,11 @@ KdasmAssemblerNode* KdasmDisassembler::DisassembleLeaves( KdasmEncoding* encodin
     }
 
     KdasmAssemblerNode* n = new KdasmAssemblerNode;
-    n->AddLeaves( leafCount, leaves );
+    n->AddLeafWords( leafCount, leaves, m_leafBits );
     return n;
 }
 
-void KdasmDisassembler::CalculateStats( KdasmEncoding* encodingRoot, intptr_t encodingSize, EncodingStats& stats )
+void KdasmDisassembler::CalculateStats( KdasmEncoding* encodingRoot, intptr_t encodingSize, EncodingStats& stats, const KdasmAssemblerNode* weights )
 {
     ::memset( this, 0, sizeof *this );
     ::memset( &stats, 0, sizeof stats );
@@ -2050,16 +4546,22 @@ void KdasmDisassembler::CalculateStats( KdasmEncoding* encodingRoot, intptr_t en
     m_encodingRoot = encodingRoot;
     m_cacheMissDepth = 1;
 
+    std::vector<bool> farTargets( encodingSize, false );
+    m_farTargets = &farTargets;
+
+    std::map<const KdasmAssemblerNode*, double> subtreeWeights;
+    m_subtreeWeights = &subtreeWeights;
+    double weight = weights ? CalculateStatsWeights( weights ) : 0.0;
     if( header->IsLeavesAtRoot() )
     {
-        CalculateStatsLeavesFar( encodingRoot + KdasmEncodingHeader::HEADER_LENGTH, stats );
+        CalculateStatsLeavesFar( encodingRoot + KdasmEncodingHeader::HEADER_LENGTH, stats, weight );
         stats.m_headerData = 1;
         stats.m_leafNodeFarCount = 1;
     }
     else
     {
         m_distanceLength = (int)header->GetDistanceLength();
-        CalculateStatsEncoding( encodingRoot + KdasmEncodingHeader::HEADER_LENGTH, 0, stats );
+        CalculateStatsEncoding( encodingRoot + KdasmEncodingHeader::HEADER_LENGTH, 0, stats, weights, weight );
     }
 
     stats.m_totalEncodingData = stats.m_cuttingPlaneNodeCount + stats.m_cuttingPlaneExtraData
@@ -2071,9 +4573,30 @@ void KdasmDisassembler::CalculateStats( KdasmEncoding* encodingRoot, intptr_t en
                               + stats.m_headerData;
 
     stats.m_paddingData = encodingSize - stats.m_totalEncodingData;
+    m_farTargets = NULL;
+    m_subtreeWeights = NULL;
+}
+
+// The same as KdasmAssemblerNode::CalculateSubtreeWeight() for every node at once.
+double KdasmDisassembler::CalculateStatsWeights( const KdasmAssemblerNode* weights )
+{
+    double weight = weights->HasSubnodes() ? 0.0 : 1.0;
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( weights->GetSubnode( i ) )
+        {
+            weight += CalculateStatsWeights( weights->GetSubnode( i ) );
+        }
+    }
+    if( weights->GetWeight() > 0.0 )
+    {
+        weight = weights->GetWeight();
+    }
+    (*m_subtreeWeights)[weights] = weight;
+    return weight;
 }
 
-void KdasmDisassembler::CalculateStatsEncoding( KdasmEncoding* encoding, intptr_t treeIndex, EncodingStats& stats )
+void KdasmDisassembler::CalculateStatsEncoding( KdasmEncoding* encoding, intptr_t treeIndex, EncodingStats& stats, const KdasmAssemblerNode* weights, double weight )
 {
     KdasmU16 normal = encoding->GetNomal();
     if( normal == KdasmEncoding::NORMAL_OPCODE )
@@ -2086,7 +4609,7 @@ void KdasmDisassembler::CalculateStatsEncoding( KdasmEncoding* encoding, intptr_
 
                 ++stats.m_leafNodeCount;
                 stats.m_leafblockData += leafCount; // Technically extra data, but that confuses the point.
-                stats.m_totalCacheMissesForEachLeafNode += m_cacheMissDepth;
+                CalculateStatsCacheMisses( stats, weight );
                 return;
             }
             case KdasmEncoding::OPCODE_LEAVES_FAR:
@@ -2102,8 +4625,9 @@ void KdasmDisassembler::CalculateStatsEncoding( KdasmEncoding* encoding, intptr_
 
                 ++stats.m_leafNodeFarCount;
                 stats.m_leafNodeFarExtraData += encoding->GetIsImmediateOffset() ? 0 : encoding->GetFarWordsCount();
+                ++stats.m_farWordsHistogram[encoding->GetIsImmediateOffset() ? 0 : encoding->GetFarWordsCount()];
 
-                CalculateStatsLeavesFar( encodingOffset, stats );
+                CalculateStatsFar( encodingOffset, true, stats, weights, weight );
 
                 if( isCacheMiss )
                 {
@@ -2118,7 +4642,7 @@ void KdasmDisassembler::CalculateStatsEncoding( KdasmEncoding* encoding, intptr_
 
                 ++stats.m_jumpNodeCount;
 
-                CalculateStatsEncoding( encoding + offset, treeIndexStart, stats );
+                CalculateStatsEncoding( encoding + offset, treeIndexStart, stats, weights, weight );
                 return;
             }
             case KdasmEncoding::OPCODE_JUMP_FAR:
@@ -2134,8 +4658,9 @@ void KdasmDisassembler::CalculateStatsEncoding( KdasmEncoding* encoding, intptr_
 
                 ++stats.m_jumpNodeFarCount;
                 stats.m_jumpNodeFarExtraData += encoding->GetIsImmediateOffset() ? 0 : encoding->GetFarWordsCount();
+                ++stats.m_farWordsHistogram[encoding->GetIsImmediateOffset() ? 0 : encoding->GetFarWordsCount()];
 
-                CalculateStatsEncoding( encodingOffset, 0, stats );
+                CalculateStatsFar( encodingOffset, false, stats, weights, weight );
 
                 if( isCacheMiss )
                 {
@@ -2150,27 +4675,90 @@ void KdasmDisassembler::CalculateStatsEncoding( KdasmEncoding* encoding, intptr_
         ++stats.m_cuttingPlaneNodeCount;
         stats.m_cuttingPlaneExtraData += m_distanceLength - 1;
 
+        // Scaled the same way as KdasmAssemblerNode::AssembleWeights().
+        const KdasmAssemblerNode* subnodeWeights[2] = { NULL, NULL };
+        double subnodeWeight[2] = { 0.0, 0.0 };
+        if( weights )
+        {
+            for( intptr_t i=0; i < 2; ++i )
+            {
+                subnodeWeights[i] = weights->GetSubnode( i );
+                subnodeWeight[i] = subnodeWeights[i] ? (*m_subtreeWeights)[subnodeWeights[i]] : 0.0;
+            }
+            double subnodesWeight = subnodeWeight[0] + subnodeWeight[1];
+            for( intptr_t i=0; i < 2; ++i )
+            {
+                subnodeWeight[i] = ( subnodesWeight > 0.0 ) ? weight * subnodeWeight[i] / subnodesWeight : 0.0;
+            }
+        }
+
         if( !encoding->GetStop0() )
         {
             KdasmEncoding* destinationEncoding = encoding + ( treeIndex + 1 );
-            CalculateStatsEncoding( destinationEncoding, treeIndex * 2 + 1, stats );
+            CalculateStatsEncoding( destinationEncoding, treeIndex * 2 + 1, stats, subnodeWeights[0], subnodeWeight[0] );
         }
         if( !encoding->GetStop1() )
         {
             KdasmEncoding* destinationEncoding = encoding + ( treeIndex + 2 );
-            CalculateStatsEncoding( destinationEncoding, treeIndex * 2 + 2, stats );
+            CalculateStatsEncoding( destinationEncoding, treeIndex * 2 + 2, stats, subnodeWeights[1], subnodeWeight[1] );
         }
     }
 }
 
-void KdasmDisassembler::CalculateStatsLeavesFar( KdasmEncoding* encoding, EncodingStats& stats )
+void KdasmDisassembler::CalculateStatsLeavesFar( KdasmEncoding* encoding, EncodingStats& stats, double weight )
 {
-    intptr_t leafCount = (intptr_t)encoding->GetRaw();
-    KdasmAssert( "Leaf data block overflow.  Will require a header.", leafCount < KdasmEncoding::LEAF_COUNT_OVERFLOW );
+    KdasmLeafSpan<KdasmU16> words = KdasmLeafSpan<KdasmU16>::FromLeavesFar( encoding );
+
+    stats.m_leafHeaderCount += words.GetWords() - encoding; // In KdasmU16.
+    stats.m_leafblockData += words.Size();
+    CalculateStatsCacheMisses( stats, weight );
+}
+
+// An encoding shared by several far references is counted once.  The cache
+// misses of each path through it are still counted.
+void KdasmDisassembler::CalculateStatsFar( KdasmEncoding* encoding, bool isLeaves, EncodingStats& stats, const KdasmAssemblerNode* weights, double weight )
+{
+    intptr_t index = (intptr_t)( encoding - m_encodingRoot );
+    KdasmAssert( "Far reference out of range", index >= 0 && index < (intptr_t)m_farTargets->size() );
+    bool isShared = (*m_farTargets)[index];
+    (*m_farTargets)[index] = true;
+
+    EncodingStats counted;
+    if( isShared )
+    {
+        ++stats.m_sharedReferenceCount;
+        counted = stats;
+    }
+
+    if( isLeaves )
+    {
+        CalculateStatsLeavesFar( encoding, stats, weight );
+    }
+    else
+    {
+        CalculateStatsEncoding( encoding, 0, stats, weights, weight );
+    }
+
+    if( isShared )
+    {
+        counted.m_sharedLeafNodeCount += ( stats.m_leafNodeCount + stats.m_leafNodeFarCount + stats.m_sharedLeafNodeCount )
+                                       - ( counted.m_leafNodeCount + counted.m_leafNodeFarCount + counted.m_sharedLeafNodeCount );
+        counted.m_totalCacheMissesForEachLeafNode = stats.m_totalCacheMissesForEachLeafNode;
+        counted.m_leafNodeWeight = stats.m_leafNodeWeight;
+        counted.m_totalWeightedCacheMisses = stats.m_totalWeightedCacheMisses;
+        counted.m_maxCacheMissesForEachLeafNode = stats.m_maxCacheMissesForEachLeafNode;
+        ::memcpy( counted.m_cacheMissesHistogram, stats.m_cacheMissesHistogram, sizeof counted.m_cacheMissesHistogram );
+        stats = counted;
+    }
+}
 
-    ++stats.m_leafHeaderCount;
-    stats.m_leafblockData += leafCount;
+void KdasmDisassembler::CalculateStatsCacheMisses( EncodingStats& stats, double weight )
+{
     stats.m_totalCacheMissesForEachLeafNode += m_cacheMissDepth;
+    stats.m_leafNodeWeight += weight;
+    stats.m_totalWeightedCacheMisses += weight * m_cacheMissDepth;
+    stats.m_maxCacheMissesForEachLeafNode = std::max( stats.m_maxCacheMissesForEachLeafNode, m_cacheMissDepth );
+    ++stats.m_cacheMissesHistogram[std::min( m_cacheMissDepth, (intptr_t)CACHE_MISS_HISTOGRAM_LENGTH - 1 )];
 }
 
 bool KdasmDisassembler::IsCacheMiss( KdasmEncoding* node, KdasmEncoding* subnode )
@@ -2180,3 +4768,205 @@ bool KdasmDisassembler::IsCacheMiss( KdasmEncoding* node, KdasmEncoding* subnode
     return nodePage != subnodePage;
 }
 
+
+// ----------------------------------------------------------------------------
+// KdasmLeafUpdater
+
+KdasmLeafUpdater::KdasmLeafUpdater( KdasmAssembler& assembler, std::vector<KdasmEncoding>& encoding )
+    : m_assembler( assembler ), m_encoding( encoding ), m_compactSize( (intptr_t)encoding.size() )
+{
+    ::memset( &m_report, 0, sizeof m_report );
+}
+
+bool KdasmLeafUpdater::InsertLeaves( const std::vector<int>& path, const KdasmU16* leaves, intptr_t leafCount )
+{
+    LeafBlock block;
+    if( !FindLeafBlock( path, block ) )
+    {
+        return false;
+    }
+
+    KdasmEncodingHeader::LeafBits leafBits = ( (KdasmEncodingHeader*)&m_encoding[0] )->GetLeafBits();
+    intptr_t insertWords = leafCount << leafBits;
+    intptr_t wordCount = block.m_wordCount + insertWords;
+    if( wordCount <= block.m_capacity )
+    {
+        KdasmEncoding* data = &m_encoding[block.m_dataIndex + block.m_wordCount];
+        for( intptr_t i=0; i < insertWords; ++i )
+        {
+            data[i].SetRaw( leaves[i] );
+        }
+        SetWordCount( block, wordCount );
+        ++m_report.m_inPlaceUpdates;
+        return true;
+    }
+
+    // Out of slack.
+    KdasmU16* words = new KdasmU16[wordCount];
+    ::memcpy( words, &m_encoding[block.m_dataIndex], block.m_wordCount * sizeof( KdasmU16 ) );
+    ::memcpy( words + block.m_wordCount, leaves, insertWords * sizeof( KdasmU16 ) );
+    KdasmAssemblerNode* n = new KdasmAssemblerNode;
+    n->AddLeafWords( wordCount >> leafBits, words, leafBits );
+    bool isReassembled = m_assembler.Reassemble( m_encoding, path, n );
+    delete n;
+    if( !isReassembled )
+    {
+        return false;
+    }
+    ++m_report.m_reassemblies;
+
+    double compactGrowth = m_assembler.GetOptions().m_compactGrowth;
+    if( path.empty() )
+    {
+        m_compactSize = (intptr_t)m_encoding.size();
+    }
+    else if( compactGrowth > 0.0 && (double)m_encoding.size() > (double)m_compactSize * ( 1.0 + compactGrowth ) )
+    {
+        if( !m_assembler.Compact( m_encoding ) )
+        {
+            return false;
+        }
+        m_compactSize = (intptr_t)m_encoding.size();
+        ++m_report.m_compactions;
+    }
+    return true;
+}
+
+bool KdasmLeafUpdater::RemoveLeaves( const std::vector<int>& path, intptr_t index, intptr_t leafCount )
+{
+    LeafBlock block;
+    if( !FindLeafBlock( path, block ) )
+    {
+        return false;
+    }
+
+    KdasmEncodingHeader::LeafBits leafBits = ( (KdasmEncodingHeader*)&m_encoding[0] )->GetLeafBits();
+    intptr_t start = index << leafBits;
+    intptr_t removeWords = leafCount << leafBits;
+    if( index < 0 || leafCount < 0 || start + removeWords > block.m_wordCount )
+    {
+        return false;
+    }
+
+    // Leaf blocks with LEAF_COUNT_OVERFLOW keep their header length.
+    intptr_t wordCount = block.m_wordCount - removeWords;
+    KdasmEncoding* data = &m_encoding[block.m_dataIndex];
+    ::memmove( data + start, data + start + removeWords, ( wordCount - start ) * sizeof( KdasmU16 ) );
+    for( intptr_t i=wordCount; i < block.m_wordCount; ++i )
+    {
+        data[i].SetRaw( KdasmEncoding::PAD_VALUE );
+    }
+    SetWordCount( block, wordCount );
+    ++m_report.m_inPlaceUpdates;
+    return true;
+}
+
+bool KdasmLeafUpdater::FindLeafBlock( const std::vector<int>& path, LeafBlock& block )
+{
+    const KdasmEncodingHeader* header = (const KdasmEncodingHeader*)&m_encoding[0];
+    KdasmAssert( "Version Incorrect", header->VersionCheck() );
+    KdasmAssert( "Leaf updates do not support packed leaves or leaf ranges", !header->IsPackedLeaves() && !header->IsLeafRanges() );
+
+    intptr_t index = KdasmEncodingHeader::HEADER_LENGTH;
+    intptr_t treeIndex = 0;
+    intptr_t headerIndex = -1;
+    if( header->IsLeavesAtRoot() )
+    {
+        if( !path.empty() )
+        {
+            return false;
+        }
+        headerIndex = index;
+    }
+    else
+    {
+        for( size_t i=0; ; ++i )
+        {
+            while( m_encoding[index].GetNomal() == KdasmEncoding::NORMAL_OPCODE && ( m_encoding[index].GetOpcode() & KdasmEncoding::OPCODE_JUMP ) != 0 )
+            {
+                if( m_encoding[index].GetOpcode() == KdasmEncoding::OPCODE_JUMP )
+                {
+                    treeIndex = m_encoding[index].GetTreeIndexStart();
+                    index += m_encoding[index].GetOffsetSigned();
+                }
+                else
+                {
+                    treeIndex = 0;
+                    index += m_encoding[index].GetFarOffset();
+                }
+            }
+
+            const KdasmEncoding& node = m_encoding[index];
+            if( i == path.size() )
+            {
+                break;
+            }
+            if( node.GetNomal() == KdasmEncoding::NORMAL_OPCODE || ( path[i] == 0 ? node.GetStop0() : node.GetStop1() ) )
+            {
+                return false;
+            }
+            index += treeIndex + 1 + path[i];
+            treeIndex = treeIndex * 2 + 1 + path[i];
+        }
+    }
+
+    // Only OPCODE_LEAVES and OPCODE_LEAVES_FAR are left.
+    const KdasmEncoding& node = m_encoding[index];
+    if( headerIndex == -1 && node.GetNomal() != KdasmEncoding::NORMAL_OPCODE )
+    {
+        return false;
+    }
+    if( headerIndex == -1 && node.GetOpcode() == KdasmEncoding::OPCODE_LEAVES_FAR )
+    {
+        headerIndex = index + node.GetFarOffset();
+    }
+
+    // The capacity precedes the leaf block unless the block is at the root.
+    bool isCapacity = header->IsLeafSlack() && headerIndex != KdasmEncodingHeader::HEADER_LENGTH;
+    if( headerIndex == -1 )
+    {
+        block.m_lengthIndex = index;
+        block.m_dataIndex = index + node.GetOffset();
+        block.m_wordCount = node.GetLength();
+        block.m_isFar = false;
+    }
+    else
+    {
+        block.m_lengthIndex = headerIndex;
+        block.m_wordCount = m_encoding[headerIndex].GetRaw();
+        block.m_dataIndex = headerIndex + 1;
+        block.m_isFar = true;
+        if( block.m_wordCount == KdasmEncoding::LEAF_COUNT_OVERFLOW )
+        {
+            block.m_wordCount = ( (intptr_t)m_encoding[headerIndex + 1].GetRaw() << 16 ) | (intptr_t)m_encoding[headerIndex + 2].GetRaw();
+            block.m_dataIndex = headerIndex + KdasmEncoding::LEAF_COUNT_OVERFLOW_LENGTH;
+            isCapacity = false;
+        }
+    }
+    block.m_capacity = isCapacity ? (intptr_t)m_encoding[( block.m_isFar ? block.m_lengthIndex : block.m_dataIndex ) - 1].GetRaw() : block.m_wordCount;
+
+    // Nothing follows leaves at the root.
+    if( header->IsLeafSlack() && headerIndex == KdasmEncodingHeader::HEADER_LENGTH && block.m_dataIndex == headerIndex + 1 )
+    {
+        intptr_t capacity = std::min( (intptr_t)m_encoding.size() - block.m_dataIndex, (intptr_t)KdasmEncoding::LEAF_COUNT_OVERFLOW - 1 );
+        block.m_capacity = std::max( capacity & ~( ( (intptr_t)1 << header->GetLeafBits() ) - 1 ), block.m_wordCount );
+    }
+    return true;
+}
+
+void KdasmLeafUpdater::SetWordCount( const LeafBlock& block, intptr_t wordCount )
+{
+    if( !block.m_isFar )
+    {
+        m_encoding[block.m_lengthIndex].SetLength( (KdasmU16)wordCount );
+    }
+    else if( block.m_dataIndex == block.m_lengthIndex + 1 )
+    {
+        m_encoding[block.m_lengthIndex].SetRaw( (KdasmU16)wordCount );
+    }
+    else
+    {
+        m_encoding[block.m_lengthIndex + 1].SetRaw( (KdasmU16)( wordCount >> 16 ) );
+        m_encoding[block.m_lengthIndex + 2].SetRaw( (KdasmU16)wordCount );
+    }
+}
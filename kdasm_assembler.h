@@ -6,8 +6,10 @@
 
 #include <vector>
 #include <deque>
+#include <map>
 
 #include "kdasm.h"
+#include "kdasm_buffer.h"
 
 // ----------------------------------------------------------------------------
 
@@ -47,26 +49,43 @@ public:
     const KdasmAssemblerNode* GetSubnode( intptr_t i ) const    { KdasmAssert( "Index out of range", i >= 0 && i < 2 ); return m_subnodes[i]; }
           KdasmAssemblerNode* GetSubnode( intptr_t i )          { KdasmAssert( "Index out of range", i >= 0 && i < 2 ); return m_subnodes[i]; }
     intptr_t GetLeafCount( void ) const                         { return m_leafCount; }
-    KdasmU16* GetLeaves( void )                                 { return m_leaves; }
+    KdasmU16* GetLeaves( void )                                 { return m_leaves; } // KdasmU16 in native byte order for wider leaves.
+    KdasmEncodingHeader::LeafBits GetLeafBits( void ) const     { return m_leafBits; }
+    // Expected accesses to the leaf or subtree, e.g. hit counts.  Zero derives the
+    // weight from the subnodes, or 1 for leaves.  Subnode weights are scaled to agree.
+    double GetWeight( void ) const                              { return m_weight; }
+    void SetWeight( double weight )                             { KdasmAssert( "Weight cannot be negative", weight >= 0.0 ); m_weight = weight; }
+    double CalculateSubtreeWeight( void ) const;
 
     void AddSubnodes( KdasmU16 distance, KdasmU16 normal, KdasmAssemblerNode* less, KdasmAssemblerNode* greater );
     // Distance length should remain constant across entire tree as it is only encoded in the header.
     void AddSubnodes( intptr_t distance, int distanceLength, KdasmU16 normal, KdasmAssemblerNode* less, KdasmAssemblerNode* greater );
     void AddSubnodes( KdasmU16* distance, int distanceLength, KdasmU16 normal, KdasmAssemblerNode* less, KdasmAssemblerNode* greater );
     void AddLeaves( intptr_t leafCount, KdasmU16* leaves );
+    // Wider leaves are copied.  The leaf width cannot vary within the tree.
+    void AddLeaves( intptr_t leafCount, const KdasmU32* leaves );
+    void AddLeaves( intptr_t leafCount, const KdasmU64* leaves );
     void Clear( void );
+    KdasmAssemblerNode* DetachSubnode( intptr_t i ); // The caller deletes the subnode.
     bool Equals( const KdasmAssemblerNode& n, bool checkSubnodes=true ) const;
     bool TrimEmpty( void ); // Canonicalizes.  Returns true if root node is empty.
 
     // Internal
     KdasmAssemblerVirtualPage* GetVirtualPage( void )           { return m_virtualPage; }
-    void SetVirtualPage( KdasmAssemblerVirtualPage* pg )        { m_virtualPage = pg; }    
+    void SetVirtualPage( KdasmAssemblerVirtualPage* pg );
+    bool IsSharedSubtree( void ) const; // Encoding is also referenced in place of identical subtrees.
+    intptr_t GetLeafWordCount( void ) const; // Leaf data as stored in the encoding.
+    intptr_t GetLeafCapacity( void ) const; // Leaf data and the slack reserved after it.
+    void AddLeafWords( intptr_t leafCount, KdasmU16* words, KdasmEncodingHeader::LeafBits leafBits );
+    const KdasmU16* GetLeafWords( void ) const;
     intptr_t GetPhysicalPageStart( void );
     void SetPageTemp( KdasmAssemblerPageTempData* t )           { m_pageTempData = t; }
     KdasmAssemblerPageTempData* GetPageTemp( void );
     const KdasmAssemblerNodeTempData* GetNodeTemp( void ) const { return m_nodeTempData; }
           KdasmAssemblerNodeTempData* GetNodeTemp( void )       { return m_nodeTempData; }
     intptr_t AssemblePrepare( KdasmAssemblerNode* supernode, intptr_t nextCompareToId );
+    void AssembleWeights( double weight );
+    void AssemblePackLeaves( void );
     void AssembleFinish( void );
     // Debug ID.
     intptr_t GetCompareToId( void )                             { return m_compareToId; }
@@ -80,6 +99,8 @@ private:
     KdasmAssemblerNode*         m_subnodes[2];
     intptr_t                    m_leafCount;
     KdasmU16*                   m_leaves;
+    KdasmEncodingHeader::LeafBits m_leafBits;
+    double                      m_weight;
 
     // Compile time data.
     KdasmAssemblerVirtualPage*  m_virtualPage;
@@ -154,11 +175,20 @@ private:
 
 // ----------------------------------------------------------------------------
 // Encapsulates the traversal operations needed by the assembler.  Assigns
-// new default pages as required.
+// new default pages as required.  Subnodes may instead be queued ahead of
+// lighter or shallower pending nodes.
 
 class KdasmAssemblerNodeBreadthFirstQueue
 {
 public:
+    enum Order {
+        ORDER_BREADTH_FIRST,
+        ORDER_HEAVIEST_FIRST,           // By node weight.
+        ORDER_DEEPEST_FIRST             // By node height.
+    };
+
+    KdasmAssemblerNodeBreadthFirstQueue( void ) : m_order( ORDER_BREADTH_FIRST ) { }
+    void SetOrder( Order order )            { m_order = order; }
     void Init( KdasmAssemblerNode* root, KdasmAssemblerPageAllocator& pgAlloc );
     KdasmAssemblerNode* GetNext( KdasmAssemblerPageAllocator& pgAlloc );
     void PopNext( bool addSubnodes );
@@ -167,7 +197,11 @@ public:
     void Clear( void )                      { m_nodes.clear(); }
 
 private:
+    static bool CompareByWeight( const KdasmAssemblerNode* a, const KdasmAssemblerNode* b );
+    static bool CompareByHeight( const KdasmAssemblerNode* a, const KdasmAssemblerNode* b );
+
     std::deque<KdasmAssemblerNode*> m_nodes; // front is next
+    Order                           m_order;
 };
 
 // ----------------------------------------------------------------------------
@@ -197,8 +231,16 @@ struct KdasmAssemblerNodeTempData
 {
     KdasmAssemblerNode*           m_supernode;
     bool                          m_forceFarAddressing;
+    double                        m_weight;                 // Expected accesses.  Sums over subnodes.
+    intptr_t                      m_height;                 // Nodes on the longest path to a leaf.
     KdasmAssemblerEncodingIndices m_internalIndices;        // Page the node is encoded in
     KdasmAssemblerEncodingIndices m_externalIndices;        // Page that references the encoding
+    KdasmAssemblerNode*           m_sharedNode;             // Identical subtree encoded instead of this one.
+    KdasmAssemblerNode*           m_nextShare;              // Next node referencing this encoding instead of its own.
+    KdasmU16*                     m_leafWords;              // KdasmPackedLeaves or NULL.
+    intptr_t                      m_leafWordCount;
+    bool                          m_isLeafCapacity;         // Leaf block is preceded by its capacity.
+    intptr_t                      m_leafSlackWords;         // Reserved after the leaves.
 };
 
 // ----------------------------------------------------------------------------
@@ -209,23 +251,52 @@ class KdasmAssemblerPagePacker
 public:
     KdasmAssemblerPagePacker( void );
     void SetPageSize( int pageBits );
+    int GetPageWordBits( void ) const { return m_pageWordBits; }
+    // Placements tried by the exhaustive search of small pages.  0 disables it.
+    void SetExactSearchLimit( intptr_t limit );
+    void SetExactSearchFailuresOnly( bool b );
+    static int CalculateFarWordsRequired( KdasmAssemblerVirtualPage* a, KdasmAssemblerVirtualPage* b, int pageWordBits );
+    static int CalculateWordsRequired( intptr_t x );
+    static intptr_t CalculateLeafHeaderLength( KdasmAssemblerNode* n );
+    static intptr_t CalculateLeafCapacityLength( KdasmAssemblerNode* n );
     bool Pack( KdasmAssemblerVirtualPage* p, bool saveIfOk, KdasmAssemblerNode** additionalNodes=NULL, size_t additionalNodesCount=0 );
-    std::vector<KdasmEncoding>& Encode( KdasmAssemblerVirtualPage* p );
+    // Writes the page to its final location, encoding.
+    void Encode( KdasmAssemblerVirtualPage* p, KdasmEncoding* encoding );
     void Clear( void );
     static void ClearEncodingIndices( KdasmAssemblerEncodingIndices* indices );
 
 private:
+    enum {
+        EXACT_SEARCH_MAX_PAGE_WORDS = 16        // A single 32 byte page.
+    };
+
     struct PackingStats
     {
         intptr_t m_encodingWords;
         intptr_t m_internalJumps;
     };
 
+    // Everything CommitSubtreePacking() changes.
+    struct PackingState
+    {
+        std::vector<KdasmAssemblerPageTempData*>   m_allocationMap;
+        std::vector<KdasmAssemblerPageTempData*>   m_treeRootsRemaining;
+        std::vector<KdasmAssemblerEncodingIndices> m_indices;
+    };
+
     void BuildNodeTempData( KdasmAssemblerNode** additionalNodes, size_t additionalNodesCount );
     void ClearNodeTempData( void );
     bool PackExtraData( void );
     bool PackEncodingWords( void );
-    bool EvaluatePacking( intptr_t treeRoot, intptr_t index, intptr_t treeIndex, PackingStats& bestFit );
+    bool PackTreeRootsGreedy( void );
+    void SearchTreeRoots( void );
+    bool SubnodesFit( KdasmAssemblerPageTempData* t, intptr_t index, intptr_t treeIndex );
+    intptr_t CountSubtreeWords( KdasmAssemblerPageTempData* t );
+    intptr_t CountInternalJumps( void );
+    intptr_t CountPadding( void );
+    void SavePackingState( PackingState& state );
+    void RestorePackingState( const PackingState& state );
+    bool EvaluatePacking( intptr_t treeRoot, intptr_t index, intptr_t treeIndex );
     void EvaluateSubnodePacking( KdasmAssemblerPageTempData* t, intptr_t index, intptr_t treeIndex, PackingStats& stats );
     void CommitSubtreePacking( KdasmAssemblerPageTempData* t, intptr_t index, intptr_t treeIndex );
     void WriteEncoding( void );
@@ -236,7 +307,6 @@ private:
     void SaveEncodingIndices( void );
     void UseSavedEncodingIndices( void );
     intptr_t CalculateNodeFarOffset( KdasmAssemblerPageTempData* t );
-    int CalculateWordsRequired( intptr_t x );
     bool ValidateAllocationMap( void );
     bool ValidateNodeEncoding( KdasmAssemblerPageTempData* t );
 
@@ -245,12 +315,20 @@ private:
     intptr_t                                 m_extraDataStart;
     KdasmAssemblerVirtualPage*               m_virtualPage;
     std::vector<KdasmAssemblerPageTempData*> m_allocationMap;
-    std::vector<KdasmEncoding>               m_encoding;
+    KdasmEncoding*                           m_encoding;        // During Encode().
     std::vector<KdasmAssemblerPageTempData>  m_pageTempData;
     std::vector<KdasmAssemblerPageTempData*> m_treeRootsRemaining;
     intptr_t                                 m_bestFitTreeRoot;
     intptr_t                                 m_bestFitPageIndex;
     intptr_t                                 m_bestFitTreeIndex;
+    PackingStats                             m_bestFit;
+    intptr_t                                 m_exactSearchLimit;
+    intptr_t                                 m_exactSearchRemaining;
+    intptr_t                                 m_bestPadding;
+    bool                                     m_exactSearchFailuresOnly;
+    PackingState                             m_initialState;
+    PackingState                             m_bestState;
+    std::vector<PackingState>                m_searchStates;
 };
 
 // ----------------------------------------------------------------------------
@@ -260,32 +338,250 @@ class KdasmAssembler
 {
 public:
     typedef void (*ActivityCallback)( void* data );
+    // Returns memory for an encoding of size KdasmU16, or NULL to stop.
+    typedef KdasmEncoding* (*OutputCallback)( void* data, intptr_t size );
+
+    // Physical order of the pages in the final encoding.  Keeping parent and
+    // child pages close allows more far references to use an immediate offset
+    // and lets adjacent-line prefetching bring in useful neighbours.
+    enum PageOrder {
+        PAGE_ORDER_ALLOCATION,          // Whatever page compaction leaves behind.
+        PAGE_ORDER_DEPTH_FIRST,         // Hottest subpages first.
+        PAGE_ORDER_VAN_EMDE_BOAS        // Recursive split of the page tree at half its height.
+    };
+
+    // What the page packing minimizes.  Weighted misses use the node weights.
+    enum Objective {
+        OBJECTIVE_AVERAGE_MISSES,       // Cache misses averaged over leaf nodes.
+        OBJECTIVE_WEIGHTED_MISSES,      // Expected cache misses per access.
+        OBJECTIVE_MAX_MISSES            // Most cache misses on any path.  May add padding.
+    };
+
+    // Trades assembly time for encoding quality.
+    enum OptimizationLevel {
+        OPTIMIZE_O0,                    // Greedy page packing only.
+        OPTIMIZE_O1,                    // Merges pages with their nearest neighbours.
+        OPTIMIZE_O2,                    // Searches further for pages to merge.  The default.
+        OPTIMIZE_O3                     // Widest merge search, local search and depth first page order.
+    };
+
+    // Relative costs traded off while deciding which pages to merge when m_enabled.
+    // Far words are estimated from the physical pages at the time.  Pages are still
+    // packed with the most nodes, as charging for internal jumps there made larger
+    // encodings.
+    struct CostModel
+    {
+        CostModel( void );
+
+        double m_paddingWord;           // Each KdasmU16 of padding.
+        double m_farWord;               // Each extra KdasmU16 used by a far reference.
+        double m_expectedMiss;          // Each cache miss expected per access.
+        bool   m_enabled;               // Otherwise every merge is kept.
+    };
+
+    // The greedy page packing always runs to completion.  The passes after it
+    // stop early once the time budget is spent, keeping the result so far.
+    struct Options
+    {
+        Options( OptimizationLevel level=OPTIMIZE_O2 );
+
+        Objective m_objective;
+        PageOrder m_pageOrder;
+        bool      m_subpageMerge;
+        bool      m_binPack;
+        intptr_t  m_pageMergeScanDistance;  // Pages of each size tried on each side of a bin.
+        intptr_t  m_localSearchIterations;  // Moves tried after bin packing.  0 skips it.
+        intptr_t  m_exactSearchLimit;       // Placements tried for each new 32 byte page.  0 is greedy only.
+        double    m_timeBudget;             // Seconds of wall-clock time.  0 is unlimited.
+        intptr_t  m_maxSize;                // Encoding size limit in KdasmU16.  0 is unlimited.
+        bool      m_reportCacheMisses;      // Fills in the Report cache misses.  Walks the whole encoding.
+        intptr_t  m_shareSubtreesMinNodes;  // Identical subtrees of this many nodes are encoded once.  0 disables.
+        intptr_t  m_shareLeavesMinLength;   // Identical leaf blocks of this many KdasmU16 are stored once.  0 disables.
+        bool      m_packLeaves;             // Stores leaf blocks as KdasmPackedLeaves.  For sorted leaf ids.
+        bool      m_leafRanges;             // Moves the leaves to GetLeafArray().  Leaf blocks hold a KdasmLeafRange.
+        bool      m_remapLeaves;            // Renumbers the leaf values in encoding order.  See GetLeafRemap().
+        bool      m_relativeDistance;       // Immediate distances are relative to their cell.  See KdasmCell.  Distance length 1 only.
+        double    m_leafSlack;              // Fraction of each leaf block left free for KdasmLeafUpdater.
+        double    m_compactGrowth;          // KdasmLeafUpdater compacts once reassembly grows the encoding by this fraction.  0 never does.
+        CostModel m_costModel;
+    };
+
+    // Describes what the optional assembly passes did.  Sizes are in KdasmU16.
+    struct Report
+    {
+        intptr_t m_farWordsHistogramBefore[KdasmEncoding::FAR_WORDS_COUNT_MAX+1]; // Index 0 is immediate.
+        intptr_t m_farWordsHistogramAfter[KdasmEncoding::FAR_WORDS_COUNT_MAX+1];
+        intptr_t m_encodingWordsBefore;    // Excludes padding.
+        intptr_t m_encodingWordsAfter;
+        intptr_t m_totalSizeBefore;
+        intptr_t m_totalSizeAfter;
+        bool     m_pageOrderApplied;       // False if the requested order could not be encoded.
+        intptr_t m_localSearchMoves;       // Subtrees moved into an adjacent page.
+        intptr_t m_localSearchPagesFreed;
+        bool     m_outOfTime;              // The time budget cut the optional passes short.
+        intptr_t m_mergesRejected;         // Merges that cost more than they saved.  See CostModel.
+        intptr_t m_budgetAttempts;         // Denser assemblies tried to meet Options::m_maxSize.
+        bool     m_overBudget;             // Even the smallest encoding found was too large.
+        intptr_t m_size;                   // Of the encoding returned.
+        double   m_averageCacheMisses;     // Per leaf node.  Only with Options::m_reportCacheMisses or m_maxSize.
+        double   m_expectedCacheMisses;    // Per access using the node weights.
+        intptr_t m_maxCacheMisses;
+        intptr_t m_sharedSubtrees;         // Subtrees encoded as a far reference to an identical one.
+        intptr_t m_sharedLeafWords;        // Leaf data saved by storing identical leaf blocks once.
+    };
 
     KdasmAssembler( void );
     void SetActivityCallback( ActivityCallback callback, void* data=NULL, int activityFrequency=10000 );
-    void Assemble( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, std::vector<KdasmEncoding>& encoding );
+    void SetOptions( const Options& options );
+    const Options& GetOptions( void ) const { return m_options; }
+    void SetObjective( Objective objective );
+    void SetPageOrder( PageOrder pageOrder );
+    void SetLocalSearchIterations( intptr_t iterations );
+    void SetCostModel( const CostModel& costModel );
+    // Returns false if the encoding does not fit in Options::m_maxSize.  The
+    // smallest encoding found is still returned.  Also returns false with an empty
+    // encoding if Options::m_relativeDistance is set and the distance length is not 1.
+    bool Assemble( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, std::vector<KdasmEncoding>& encoding );
+    // Assembles into an aligned buffer.  Also returns false if the buffer cannot be allocated.
+    bool Assemble( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, KdasmEncodingBuffer& encoding,
+                   KdasmEncodingBuffer::HugePages hugePages=KdasmEncodingBuffer::HUGE_PAGES_NONE );
+    // Each page is written straight to its final location in memory from output, e.g. a
+    // writable mapping of a file.  output is called once the size is known.  With
+    // Options::m_maxSize the smallest encoding found is copied there instead.  Also
+    // returns false if output returns NULL.
+    bool Assemble( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, OutputCallback output, void* outputData );
+    // Replaces the subtree at the end of path in an encoding from Assemble().  path
+    // holds 0 for less and 1 for greater at each cutting plane from the root.  The
+    // subtree is assembled by itself and appended without its header, and the word in
+    // the encoding that referenced the old subtree becomes a far reference to it.  The
+    // far offset goes in words freed by the old subtree.  Without enough of them the
+    // cutting plane above is reassembled along with its other subtree instead.  No
+    // other words change and the old subtree is left as unused space until Compact().
+    // The subtree is not deleted.  Encodings with shared subtrees, leaf ranges or
+    // remapped leaves are not supported.  Returns false if path is not in the encoding.
+    bool Reassemble( std::vector<KdasmEncoding>& encoding, const std::vector<int>& path, KdasmAssemblerNode* subtree );
+    // Assembles an encoding again, dropping the space left unused by Reassemble().
+    // Returns false if it cannot be disassembled or does not fit in Options::m_maxSize.
+    bool Compact( std::vector<KdasmEncoding>& encoding );
+    const Report& GetReport( void ) const   { return m_report; }
+    // Leaves of the last encoding when Options::m_leafRanges, in the order of their blocks.
+    // KdasmU16 in native byte order for wider leaves.
+    const std::vector<KdasmU16>& GetLeafArray( void ) const { return m_leafArray; }
+    // Old leaf value of each new leaf value when Options::m_remapLeaves.  Application data
+    // indexed by leaf value is put in encoding order with data[i] = oldData[remap[i]].
+    const std::vector<KdasmU64>& GetLeafRemap( void ) const { return m_leafRemap; }
 
 private:
     enum {
-        MAX_PAGE_MERGE_SCAN_DISTANCE = 3
+        SHARE_HASH_MULTIPLIER = 0x01000193,
+        MAX_BUDGET_ATTEMPTS = 2,
+        MAX_PAGE_ORDER_ATTEMPTS = 8,
+        MAX_PAGE_ORDER_REPAIR_PASSES = 4,
+        MAX_PAGE_ORDER_REPAIR_DISTANCE = 8,
+        // Placements for O3 and the budget attempts.  Larger limits found no smaller
+        // encodings of 32 byte pages and only took longer.
+        EXACT_SEARCH_LIMIT = 4096
     };
 
     typedef std::vector<std::vector<KdasmAssemblerVirtualPage*> > PagesBySize;
 
+    // Adjustments to the requested page order made after pages fail to pack.
+    struct PageOrderHints
+    {
+        std::vector<intptr_t>               m_superpage;        // Only visit the page from this superpage, or -1.
+        std::vector<std::vector<intptr_t> > m_firstSubpages;    // Subpages to visit before the others.
+        std::vector<bool>                   m_subpagesFirst;    // Place all subpages directly after the page.
+    };
+
+    // A subtree that might be encoded once and shared.
+    struct SharedSubtree
+    {
+        size_t              m_hash;
+        intptr_t            m_nodeCount;
+        intptr_t            m_sharedId;     // CompareToId of the first identical subtree.
+        KdasmAssemblerNode* m_node;
+    };
+
+    // Where KdasmEncodingBuffer output goes.
+    struct BufferOutput
+    {
+        KdasmEncodingBuffer*           m_buffer;
+        KdasmEncodingBuffer::HugePages m_hugePages;
+    };
+
+    bool IsEncodable( const KdasmAssemblerNode* root ) const;
+    void AssembleReset( KdasmEncodingHeader::PageBits& pageBits );
+    void AssembleOnce( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, std::vector<KdasmEncoding>& result );
+    KdasmEncoding* AssembleOnce( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, OutputCallback output, void* outputData, intptr_t& size );
+    static KdasmEncoding* OutputToVector( void* data, intptr_t size );
+    static KdasmEncoding* OutputToBuffer( void* data, intptr_t size );
+    void SetBudgetOptions( const Options& options, int attempt );
+    void CalculateReportStats( KdasmAssemblerNode* root, KdasmEncoding* result, intptr_t size );
+    void ShareSubtrees( KdasmAssemblerNode* root );
+    static intptr_t FindFarWords( const KdasmEncoding* word, intptr_t treeIndex, intptr_t& wordsOffset );
+    size_t HashSubtree( KdasmAssemblerNode* n, intptr_t& nodeCount, std::vector<SharedSubtree>& subtrees );
+    static bool CompareByHash( const SharedSubtree& a, const SharedSubtree& b );
+    static bool CompareByCompareToId( const SharedSubtree& a, const SharedSubtree& b );
+    static void FindLeafBits( KdasmAssemblerNode* n, KdasmAssemblerNode*& firstLeaf );
+    static void FindLeaves( KdasmAssemblerNode* n, std::vector<KdasmAssemblerNode*>& leaves );
+    void PrepareLeafRanges( KdasmAssemblerNode* root );
+    void PrepareLeafSlack( KdasmAssemblerNode* root );
+    void FindLeavesInEncodingOrder( std::vector<KdasmAssemblerNode*>& leaves );
+    void AssignLeafRanges( const std::vector<KdasmAssemblerNode*>& leaves );
+    void RemapLeaves( const std::vector<KdasmAssemblerNode*>& leaves );
+    void RemapLeafValues( KdasmU16* words, intptr_t leafCount, std::map<KdasmU64, KdasmU64>& newValues );
+    static KdasmU64 GetLeafValue( const KdasmU16* words, intptr_t i, KdasmEncodingHeader::LeafBits leafBits );
+    static void SetLeafValue( KdasmU16* words, intptr_t i, KdasmEncodingHeader::LeafBits leafBits, KdasmU64 value );
+    static bool CompareByExtraDataIndex( KdasmAssemblerNode* a, KdasmAssemblerNode* b );
+    bool HasSharedPageConflict( KdasmAssemblerNode** nodes, size_t nodesCount, KdasmAssemblerVirtualPage* pg );
+    bool PackSharedReferences( KdasmAssemblerNode* n, KdasmAssemblerVirtualPage* pg, bool saveIfOk );
     void TickActivity( void );
+    bool IsOutOfTime( void );
+    static double GetTime( void );
     void PackNextPage( void );
     void SubpageMerge( void );
+    bool TrySuperpageMerge( KdasmAssemblerVirtualPage* pg );
     void BinPack( void );
+    void BinPackAdjacentPages( KdasmAssemblerVirtualPage* bin );
+    double CalculateMergePriority( KdasmAssemblerVirtualPage* a, KdasmAssemblerVirtualPage* b );
     void BuildPagesBySize( intptr_t pageWords );
     intptr_t FindClosestPhysicalPage( KdasmAssemblerVirtualPage* bin, std::vector<KdasmAssemblerVirtualPage*>& pages );
     bool TryBinPack( KdasmAssemblerVirtualPage* bin, KdasmAssemblerVirtualPage* pg );
-    void Encode( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, std::vector<KdasmEncoding>& result );
+    double CalculateMergeCost( KdasmAssemblerVirtualPage* bin, KdasmAssemblerVirtualPage* pg );
+    double CalculateNodeMoveCost( KdasmAssemblerNode* n, KdasmAssemblerVirtualPage* from, KdasmAssemblerVirtualPage* to );
+    void LocalSearch( void );
+    void FindPageSubtree( KdasmAssemblerNode* root, std::vector<KdasmAssemblerNode*>& nodes );
+    bool TryMoveSubtreePrefix( std::vector<KdasmAssemblerNode*>& subtree, KdasmAssemblerVirtualPage* pg, intptr_t& iterations );
+    double CalculateMoveGain( KdasmAssemblerNode** nodes, size_t nodesCount, KdasmAssemblerVirtualPage* pg );
+    bool TryMoveSubtree( KdasmAssemblerNode** nodes, size_t nodesCount, KdasmAssemblerVirtualPage* pg );
+    void OrderPages( KdasmEncodingHeader::PageBits pageBits );
+    bool BuildPageOrder( std::vector<intptr_t>& order );
+    void PlacePages( const std::vector<intptr_t>& order );
+    void PlaceSubpagesFirst( intptr_t pageIndex, std::vector<bool>& placed, std::vector<intptr_t>& placedOrder );
+    bool RepairPageOrder( std::vector<intptr_t>& failingPages );
+    void SwapPhysicalPages( intptr_t pageIndexA, intptr_t pageIndexB, std::vector<intptr_t>& pageAtPhysicalPage );
+    void AddPageOrderHints( const std::vector<intptr_t>& failingPages, intptr_t immediatePages );
+    void FindSubpagesByWeight( KdasmAssemblerVirtualPage* pg, std::vector<KdasmAssemblerVirtualPage*>& subpages );
+    static bool CompareByPriority( const std::pair<double, KdasmAssemblerVirtualPage*>& a, const std::pair<double, KdasmAssemblerVirtualPage*>& b );
+    intptr_t FindPageIndex( KdasmAssemblerVirtualPage* pg );
+    void OrderPagesVanEmdeBoas( intptr_t pageIndex, intptr_t height, std::vector<intptr_t>& order );
+    void FindPagesAtDepth( intptr_t pageIndex, intptr_t depth, std::vector<intptr_t>& pageIndices );
+    void CalculateFarWordsHistogram( intptr_t* histogram );
+    intptr_t CalculateEncodingWords( void );
+    void Encode( KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits, KdasmEncoding* result );
     void Clear( void );
 
     ActivityCallback                        m_activityCallback;
     void*                                   m_activityData;
     int                                     m_activityFrequency;
     int                                     m_activityCounter;
+    Options                                 m_options;
+    double                                  m_deadline;
+    double                                  m_rootWeight;
+    KdasmEncodingHeader::LeafBits           m_leafBits;
+    std::vector<KdasmU16>                   m_leafArray;
+    std::vector<KdasmU64>                   m_leafRemap;
+    Report                                  m_report;
 
     KdasmAssemblerPageAllocator             m_pageAllocator;
     KdasmAssemblerNodeBreadthFirstQueue     m_globalQueue;
@@ -293,7 +589,12 @@ private:
     KdasmAssemblerPagePacker                m_pagePacker;
     std::vector<KdasmAssemblerVirtualPage*> m_superpages;
     std::vector<KdasmAssemblerVirtualPage*> m_failingPageSuperpages;
+    std::vector<KdasmAssemblerVirtualPage*> m_adjacentPages;
+    std::vector<KdasmAssemblerNode*>        m_savedNodes;
     PagesBySize                             m_pagesBySize;
+    std::vector<std::vector<intptr_t> >     m_pageSubpages; // Page indices referenced by each page.
+    std::vector<std::vector<intptr_t> >     m_pageTree;     // Depth first spanning tree of the page graph.
+    PageOrderHints                          m_pageOrderHints;
 };
 
 // ----------------------------------------------------------------------------
@@ -302,6 +603,10 @@ private:
 class KdasmDisassembler
 {
 public:
+    enum {
+        CACHE_MISS_HISTOGRAM_LENGTH = 32
+    };
+
     struct EncodingStats
     {
         intptr_t m_totalEncodingData;
@@ -318,30 +623,103 @@ public:
         intptr_t m_jumpNodeFarCount;
         intptr_t m_jumpNodeFarExtraData;
         intptr_t m_totalCacheMissesForEachLeafNode;
+        double   m_leafNodeWeight;                   // Requires the weighted tree.
+        double   m_totalWeightedCacheMisses;         // Divide by m_leafNodeWeight for expected misses.
+        intptr_t m_maxCacheMissesForEachLeafNode;
+        intptr_t m_cacheMissesHistogram[CACHE_MISS_HISTOGRAM_LENGTH]; // Leaf nodes by cache misses.  Last entry includes more.
+        intptr_t m_farWordsHistogram[KdasmEncoding::FAR_WORDS_COUNT_MAX+1]; // Far references by extra words used.
+        intptr_t m_sharedReferenceCount;             // Far references to an encoding already counted.
+        intptr_t m_sharedLeafNodeCount;              // Leaf nodes reached again through them.
     };
 
     // Returns null on failure.  Optionally checks against compareTo in order to
     // identify the nodeId in case of failure. 
-    KdasmAssemblerNode* Disassemble( KdasmEncoding* encodingRoot, KdasmAssemblerNode* compareTo=NULL );
+    // The leaf array is required by KdasmEncodingHeader::IsLeafRanges().
+    KdasmAssemblerNode* Disassemble( KdasmEncoding* encodingRoot, KdasmAssemblerNode* compareTo=NULL, const KdasmU16* leafArray=NULL );
+    // The subtree in the encoding word at encoding with the tree index treeIndex.
+    KdasmAssemblerNode* DisassembleSubtree( KdasmEncoding* encodingRoot, KdasmEncoding* encoding, intptr_t treeIndex );
 
-    void CalculateStats( KdasmEncoding* encodingRoot, intptr_t encodingSize, EncodingStats& stats );
+    // Optionally uses the node weights of the assembled tree for weighted stats.
+    void CalculateStats( KdasmEncoding* encodingRoot, intptr_t encodingSize, EncodingStats& stats, const KdasmAssemblerNode* weights=NULL );
 
 private:
+    bool Prepare( KdasmEncoding* encodingRoot, const KdasmU16* leafArray );
     KdasmAssemblerNode* DisassembleEncoding( KdasmEncoding* encoding, intptr_t treeIndex, KdasmAssemblerNode* compareTo );
     KdasmAssemblerNode* DisassembleLeavesFar( KdasmEncoding* encoding, KdasmAssemblerNode* compareTo );
-    KdasmAssemblerNode* DisassembleLeaves( KdasmEncoding* encoding, intptr_t leafCount, KdasmAssemblerNode* compareTo );
+    KdasmAssemblerNode* DisassembleLeaves( KdasmEncoding* encoding, intptr_t leafWordCount, KdasmAssemblerNode* compareTo );
 
-    void CalculateStatsEncoding( KdasmEncoding* encoding, intptr_t treeIndex, EncodingStats& stats );
-    void CalculateStatsLeavesFar( KdasmEncoding* encoding, EncodingStats& stats );
+    double CalculateStatsWeights( const KdasmAssemblerNode* weights );
+    void CalculateStatsEncoding( KdasmEncoding* encoding, intptr_t treeIndex, EncodingStats& stats, const KdasmAssemblerNode* weights, double weight );
+    void CalculateStatsLeavesFar( KdasmEncoding* encoding, EncodingStats& stats, double weight );
+    void CalculateStatsFar( KdasmEncoding* encoding, bool isLeaves, EncodingStats& stats, const KdasmAssemblerNode* weights, double weight );
+    void CalculateStatsCacheMisses( EncodingStats& stats, double weight );
     void CalculateStatsLeaves( KdasmEncoding* encoding, intptr_t leafCount, EncodingStats& stats );
 
     bool IsCacheMiss( KdasmEncoding* node, KdasmEncoding* subnode );
 
     int            m_distanceLength;
+    const KdasmU16* m_leafArray;
+    bool           m_isPackedLeaves;
+    KdasmEncodingHeader::LeafBits m_leafBits;
     intptr_t       m_compareToFailId;
     intptr_t       m_pageAddressMask;
     KdasmEncoding* m_encodingRoot;
     intptr_t       m_cacheMissDepth;
+    std::vector<bool>* m_farTargets;   // Encodings reached by far references so far.
+    std::map<const KdasmAssemblerNode*, double>* m_subtreeWeights; // KdasmAssemblerNode::CalculateSubtreeWeight() of each node.
+};
+
+// ----------------------------------------------------------------------------
+// KdasmLeafUpdater inserts and removes leaves in an encoding in place.  New leaves
+// go in the slack reserved after each leaf block by KdasmAssembler::Options::m_leafSlack.
+// Once a block is full the leaf node is replaced using KdasmAssembler::Reassemble(),
+// which reserves new slack.  Leaves at the root have no capacity word and use the
+// rest of the encoding instead.  Once reassembly has grown the encoding by
+// KdasmAssembler::Options::m_compactGrowth it is compacted with
+// KdasmAssembler::Compact().  Packed leaves and leaf ranges are not supported.
+
+class KdasmLeafUpdater
+{
+public:
+    struct Report
+    {
+        intptr_t m_inPlaceUpdates;
+        intptr_t m_reassemblies;
+        intptr_t m_compactions;
+    };
+
+    // The assembler has the options used to assemble the encoding.
+    KdasmLeafUpdater( KdasmAssembler& assembler, std::vector<KdasmEncoding>& encoding );
+
+    // Appends leaves to the leaf node at the end of path.  KdasmU16 in native byte order
+    // for wider leaves.  path is as for KdasmAssembler::Reassemble().  Returns false if
+    // path does not end at a leaf node or the leaf node could not be reassembled.
+    bool InsertLeaves( const std::vector<int>& path, const KdasmU16* leaves, intptr_t leafCount );
+    // Removes leafCount leaves starting at index.  The remaining leaves keep their order.
+    bool RemoveLeaves( const std::vector<int>& path, intptr_t index, intptr_t leafCount );
+    const Report& GetReport( void ) const   { return m_report; }
+
+private:
+    // Indices into the encoding.  Sizes are in KdasmU16.
+    struct LeafBlock
+    {
+        intptr_t m_lengthIndex;     // OPCODE_LEAVES encoding or OPCODE_LEAVES_FAR header.
+        intptr_t m_dataIndex;
+        intptr_t m_wordCount;
+        intptr_t m_capacity;
+        bool     m_isFar;
+    };
+
+    KdasmLeafUpdater( const KdasmLeafUpdater& ); // undefined
+    KdasmLeafUpdater& operator=( const KdasmLeafUpdater& ); // undefined
+
+    bool FindLeafBlock( const std::vector<int>& path, LeafBlock& block );
+    void SetWordCount( const LeafBlock& block, intptr_t wordCount );
+
+    KdasmAssembler&             m_assembler;
+    std::vector<KdasmEncoding>& m_encoding;
+    intptr_t                    m_compactSize;   // Encoding size after the last compaction.
+    Report                      m_report;
 };
 
 #endif // KDASM_ASSEMBLER_H
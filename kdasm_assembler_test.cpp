@@ -4,9 +4,15 @@
 
 #include "kdasm_assembler.h"
 #include "kdasm_visualizer.h"
+#include "kdasm_builder.h"
+#include "kdasm_patch.h"
+#include "kdasm_file.h"
+#include "kdasm_verifier.h"
 
 #include <stdio.h>
+#include <math.h>
 #include <vector>
+#include <algorithm>
 
 #pragma warning( disable : 4996 ) 
 
@@ -33,14 +39,48 @@ public:
     int RandBool( unsigned int percentChance );
     intptr_t Rand( size_t max );
     KdasmAssemblerNode* GenerateRandomNodes( const KdasmTestRandomSettings& randomSettings );
+    void GenerateRandomWeights( KdasmAssemblerNode* node, double weight );
+    KdasmAssemblerNode* GenerateRandomCopies( const KdasmTestRandomSettings& randomSettings );
+    void GenerateSortedIds( KdasmAssemblerNode* node, KdasmU16 maxGap );
+    template<typename T> void GenerateWideLeaves( KdasmAssemblerNode* node );
+    bool CheckRemappedLeaves( KdasmAssemblerNode* node, KdasmAssemblerNode* remapped, const std::vector<KdasmU64>& remap );
+    void FindLeafBlocks( KdasmEncoding* encodingRoot, KdasmEncoding* encoding, intptr_t treeIndex, std::map<intptr_t, intptr_t>& blocks );
+    bool CheckBuiltCells( KdasmAssemblerNode* node, const KdasmCell& cell, bool isRelative, const float* point, const std::vector<KdasmBuilder::Box>& boxes );
+    bool AssembleAndCheck( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler, KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits,
+                           const KdasmAssembler::Options& options, std::vector<KdasmEncoding>& result, KdasmDisassembler::EncodingStats& stats );
 
     void TickActivity( bool callback );
     static void ActivityCallback( void* data );
+    static KdasmEncoding* NullOutput( void* data, intptr_t size );
 
     // Test cases
     void TestLeavesAtRoot( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
     void TestRandom( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
     void TestVisualizer( KdasmAssembler& kdasmAssembler );
+    void TestPageOrder( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestWeighted( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestMaxMisses( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestLocalSearch( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestOptions( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestExactSearch( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestCostModel( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestMemoryBudget( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestSharedSubtrees( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestSharedLeaves( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestPackedLeaves( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestLeafBits( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestLeafRanges( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestRemapLeaves( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestRelativeDistance( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestBuilder( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestBuilderPages( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestReassemble( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestLeafSlack( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestPatch( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestFile( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestEncodingBuffer( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestAssembleInPlace( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
+    void TestVerifier( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler );
 
 private:
     KdasmU16                        m_randSeed;
@@ -194,12 +234,203 @@ KdasmAssemblerNode* KdasmTest::GenerateRandomNodes( const KdasmTestRandomSetting
     return root;
 }
 
+// Skews accesses towards one side of each split, leaving a few hot paths.
+void KdasmTest::GenerateRandomWeights( KdasmAssemblerNode* node, double weight )
+{
+    if( !node->HasSubnodes() )
+    {
+        node->SetWeight( weight );
+        return;
+    }
+
+    double hotWeight = weight;
+    double coldWeight = weight;
+    if( node->GetSubnode( 0 ) && node->GetSubnode( 1 ) )
+    {
+        hotWeight = weight * 0.9;
+        coldWeight = weight * 0.1;
+    }
+    int hot = RandBool( 50 );
+    for( int i=0; i < 2; ++i )
+    {
+        if( node->GetSubnode( i ) )
+        {
+            GenerateRandomWeights( node->GetSubnode( i ), ( i == hot ) ? hotWeight : coldWeight );
+        }
+    }
+}
+
+// Four copies of the same random tree.
+KdasmAssemblerNode* KdasmTest::GenerateRandomCopies( const KdasmTestRandomSettings& randomSettings )
+{
+    KdasmAssemblerNode* copies[4];
+    for( int i=0; i < 4; ++i )
+    {
+        copies[i] = GenerateRandomNodes( randomSettings );
+    }
+    KdasmAssemblerNode* less = new KdasmAssemblerNode;
+    less->AddSubnodes( (intptr_t)0, randomSettings.m_distanceLength, 0, copies[0], copies[1] );
+    KdasmAssemblerNode* greater = new KdasmAssemblerNode;
+    greater->AddSubnodes( (intptr_t)0, randomSettings.m_distanceLength, 2, copies[2], copies[3] );
+    KdasmAssemblerNode* root = new KdasmAssemblerNode;
+    root->AddSubnodes( (intptr_t)0, randomSettings.m_distanceLength, 1, less, greater );
+    return root;
+}
+
+// Replaces the leaves with ascending ids, as a leaf block of triangle ids would be.
+void KdasmTest::GenerateSortedIds( KdasmAssemblerNode* node, KdasmU16 maxGap )
+{
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( node->GetSubnode( i ) )
+        {
+            GenerateSortedIds( node->GetSubnode( i ), maxGap );
+        }
+    }
+
+    KdasmU16 id = Rand16();
+    for( intptr_t i=0; i < node->GetLeafCount(); ++i )
+    {
+        node->GetLeaves()[i] = id;
+        id += (KdasmU16)Rand( maxGap ) + 1;
+    }
+}
+
+// Replaces each leaf with a wider value using all of its bytes.
+template<typename T> void KdasmTest::GenerateWideLeaves( KdasmAssemblerNode* node )
+{
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( node->GetSubnode( i ) )
+        {
+            GenerateWideLeaves<T>( node->GetSubnode( i ) );
+        }
+    }
+    if( node->HasSubnodes() || node->GetLeafCount() == 0 )
+    {
+        return;
+    }
+
+    std::vector<T> leaves( node->GetLeafCount() );
+    for( size_t i=0; i < leaves.size(); ++i )
+    {
+        T leaf = 0;
+        for( size_t j=0; j < sizeof( T ) / sizeof( KdasmU16 ); ++j )
+        {
+            leaf = ( leaf << 16 ) | Rand16();
+        }
+        leaves[i] = leaf;
+    }
+    node->AddLeaves( (intptr_t)leaves.size(), &leaves[0] );
+}
+
+// Compares trees that differ only in having their leaf values renumbered.
+bool KdasmTest::CheckRemappedLeaves( KdasmAssemblerNode* node, KdasmAssemblerNode* remapped, const std::vector<KdasmU64>& remap )
+{
+    if( node->HasSubnodes() && !node->Equals( *remapped, false ) )
+    {
+        return false;
+    }
+    for( intptr_t i=0; i < 2; ++i )
+    {
+        if( ( node->GetSubnode( i ) == NULL ) != ( remapped->GetSubnode( i ) == NULL ) )
+        {
+            return false;
+        }
+        if( node->GetSubnode( i ) && !CheckRemappedLeaves( node->GetSubnode( i ), remapped->GetSubnode( i ), remap ) )
+        {
+            return false;
+        }
+    }
+    if( node->GetLeafCount() != remapped->GetLeafCount() )
+    {
+        return false;
+    }
+    for( intptr_t i=0; i < node->GetLeafCount(); ++i )
+    {
+        KdasmU16 value = remapped->GetLeaves()[i];
+        if( value >= remap.size() || remap[value] != node->GetLeaves()[i] )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The KdasmU16 leaf blocks reached from encoding.  Maps the index of the first leaf
+// to the leaf count, so the blocks are in encoding order.
+void KdasmTest::FindLeafBlocks( KdasmEncoding* encodingRoot, KdasmEncoding* encoding, intptr_t treeIndex, std::map<intptr_t, intptr_t>& blocks )
+{
+    if( encoding->GetNomal() != KdasmEncoding::NORMAL_OPCODE )
+    {
+        for( intptr_t i=0; i < 2; ++i )
+        {
+            if( !( i == 0 ? encoding->GetStop0() : encoding->GetStop1() ) )
+            {
+                FindLeafBlocks( encodingRoot, encoding + treeIndex + 1 + i, treeIndex * 2 + 1 + i, blocks );
+            }
+        }
+        return;
+    }
+
+    KdasmLeafSpan<KdasmU16> span;
+    switch( encoding->GetOpcode() )
+    {
+        case KdasmEncoding::OPCODE_LEAVES:
+            span = KdasmLeafSpan<KdasmU16>::FromLeaves( encoding );
+            break;
+        case KdasmEncoding::OPCODE_LEAVES_FAR:
+            span = KdasmLeafSpan<KdasmU16>::FromLeavesFar( encoding + encoding->GetFarOffset() );
+            break;
+        case KdasmEncoding::OPCODE_JUMP:
+            FindLeafBlocks( encodingRoot, encoding + encoding->GetOffsetSigned(), encoding->GetTreeIndexStart(), blocks );
+            return;
+        case KdasmEncoding::OPCODE_JUMP_FAR:
+            FindLeafBlocks( encodingRoot, encoding + encoding->GetFarOffset(), 0, blocks );
+            return;
+    }
+    if( span.Size() > 0 )
+    {
+        blocks[span.GetWords() - encodingRoot] = span.Size();
+    }
+}
+
+// Assembles root with options, checks the disassembly and prints the stats.  Returns
+// the result of KdasmAssembler::Assemble().
+bool KdasmTest::AssembleAndCheck( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler, KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits,
+                                  const KdasmAssembler::Options& options, std::vector<KdasmEncoding>& result, KdasmDisassembler::EncodingStats& stats )
+{
+    kdasmAssembler.SetOptions( options );
+    bool isAssembled = kdasmAssembler.Assemble( root, pageBits, result );
+
+    // Remapped leaves are checked by the caller.
+    const std::vector<KdasmU16>& leafArray = kdasmAssembler.GetLeafArray();
+    KdasmAssemblerNode* compareTo = options.m_remapLeaves ? NULL : root;
+    KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &result[0], compareTo, leafArray.empty() ? NULL : &leafArray[0] );
+    KdasmAssert( "Disassembly failed", disassembly );
+    KdasmAssert( "Disassembly is not equal", !compareTo || compareTo->Equals( *disassembly ) );
+    delete disassembly;
+
+    kdasmDisassembler.CalculateStats( &result[0], (intptr_t)result.size(), stats, root );
+
+    intptr_t leafNodeCount = stats.m_leafNodeCount + stats.m_leafNodeFarCount;
+    printf( "\n%d total size, %d padding\n", (int)result.size(), stats.m_paddingData );
+    printf( "%f average cache-misses per-leaf node\n", (float)(stats.m_totalCacheMissesForEachLeafNode)/(float)(leafNodeCount) );
+    return isAssembled;
+}
+
 void KdasmTest::ActivityCallback( void* data )
 {
     KdasmTest* test = (KdasmTest*)data;
     test->TickActivity( true );
 }
 
+KdasmEncoding* KdasmTest::NullOutput( void* data, intptr_t size )
+{
+    (void)data; (void)size;
+    return NULL;
+}
+
 void KdasmTest::TickActivity( bool callback )
 {
     if( callback || ++m_activityCounter > m_activityIncrement )
@@ -311,6 +542,1623 @@ void KdasmTest::TestVisualizer( KdasmAssembler& kdasmAssembler )
     delete random;
 }
 
+void KdasmTest::TestPageOrder( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const char* names[] = { "allocation", "depth first", "van Emde Boas" };
+    static const int settingsIndices[] = { 5, 6 };
+    // The van Emde Boas order leaves a page of 73e5 shared by two distant pages out
+    // of immediate range of one of them.
+    static const bool isVanEmdeBoasApplied[] = { false, true };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+
+        for( int pageOrder=KdasmAssembler::PAGE_ORDER_ALLOCATION; pageOrder <= KdasmAssembler::PAGE_ORDER_VAN_EMDE_BOAS; ++pageOrder )
+        {
+            printf( "-----\nTest page order %x %s.", settings.m_seed, names[pageOrder] );
+
+            KdasmAssembler::Options options;
+            options.m_pageOrder = (KdasmAssembler::PageOrder)pageOrder;
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            const KdasmAssembler::Report& report = kdasmAssembler.GetReport();
+            KdasmAssert( "Page order changed size", report.m_totalSizeBefore == report.m_totalSizeAfter );
+            KdasmAssert( "Report size incorrect", report.m_totalSizeAfter == (intptr_t)randomResult.size() );
+            for( int j=0; j <= KdasmEncoding::FAR_WORDS_COUNT_MAX; ++j )
+            {
+                KdasmAssert( "Report histogram incorrect", report.m_farWordsHistogramAfter[j] == stats.m_farWordsHistogram[j] );
+            }
+            bool isApplied = ( pageOrder == KdasmAssembler::PAGE_ORDER_DEPTH_FIRST )
+                || ( pageOrder == KdasmAssembler::PAGE_ORDER_VAN_EMDE_BOAS && isVanEmdeBoasApplied[i] );
+            KdasmAssert( "Page order applied unexpectedly", report.m_pageOrderApplied == isApplied );
+            if( !isApplied )
+            {
+                // The allocation order is restored.
+                KdasmAssert( "Page order fallback changed encoding", report.m_encodingWordsBefore == report.m_encodingWordsAfter );
+                for( int j=0; j <= KdasmEncoding::FAR_WORDS_COUNT_MAX; ++j )
+                {
+                    KdasmAssert( "Page order fallback changed far words", report.m_farWordsHistogramBefore[j] == report.m_farWordsHistogramAfter[j] );
+                }
+            }
+            if( pageOrder == KdasmAssembler::PAGE_ORDER_DEPTH_FIRST )
+            {
+
+                // References that need far words.  Subpages follow their page.
+                intptr_t farReferencesBefore = 0;
+                intptr_t farReferencesAfter = 0;
+                for( int j=1; j <= KdasmEncoding::FAR_WORDS_COUNT_MAX; ++j )
+                {
+                    farReferencesBefore += report.m_farWordsHistogramBefore[j];
+                    farReferencesAfter += report.m_farWordsHistogramAfter[j];
+                }
+                KdasmAssert( "Depth first order added far references", farReferencesAfter <= farReferencesBefore );
+            }
+
+            printf( "order applied %d, encoding words %d -> %d, total size %d -> %d\n", (int)report.m_pageOrderApplied,
+                report.m_encodingWordsBefore, report.m_encodingWordsAfter, report.m_totalSizeBefore, report.m_totalSizeAfter );
+            printf( "far words histogram:" );
+            for( int j=0; j <= KdasmEncoding::FAR_WORDS_COUNT_MAX; ++j )
+            {
+                printf( " %d:%d->%d", j, report.m_farWordsHistogramBefore[j], report.m_farWordsHistogramAfter[j] );
+            }
+            printf( "\n" );
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestWeighted( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const char* names[] = { "average", "weighted" };
+    static const int settingsIndices[] = { 5, 6 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+        GenerateRandomWeights( random, 1.0 );
+
+        double expectedMisses[2] = { 0.0, 0.0 };
+        for( int objective=KdasmAssembler::OBJECTIVE_AVERAGE_MISSES; objective <= KdasmAssembler::OBJECTIVE_WEIGHTED_MISSES; ++objective )
+        {
+            printf( "-----\nTest weighted %x %s.", settings.m_seed, names[objective] );
+
+            KdasmAssembler::Options options;
+            options.m_objective = (KdasmAssembler::Objective)objective;
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            KdasmAssert( "Leaf weights do not sum to the root weight", ::fabs( stats.m_leafNodeWeight - 1.0 ) < 1.0e-6 );
+            printf( "%f expected cache-misses per-access\n", (float)(stats.m_totalWeightedCacheMisses/stats.m_leafNodeWeight) );
+            expectedMisses[objective] = stats.m_totalWeightedCacheMisses / stats.m_leafNodeWeight;
+        }
+        KdasmAssert( "Weighted objective did not lower the expected cache misses", expectedMisses[1] < expectedMisses[0] );
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestMaxMisses( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const char* names[] = { "average", "max" };
+    static const KdasmAssembler::Objective objectives[] = { KdasmAssembler::OBJECTIVE_AVERAGE_MISSES, KdasmAssembler::OBJECTIVE_MAX_MISSES };
+    static const int settingsIndices[] = { 5, 6, 7 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+
+        intptr_t maxMisses[2] = { 0, 0 };
+        for( int objective=0; objective < (sizeof objectives / sizeof *objectives); ++objective )
+        {
+            printf( "-----\nTest max misses %x %s.", settings.m_seed, names[objective] );
+
+            KdasmAssembler::Options options;
+            options.m_objective = objectives[objective];
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            intptr_t leafNodeCount = stats.m_leafNodeCount + stats.m_leafNodeFarCount;
+            intptr_t histogramCount = 0;
+            for( int j=0; j < KdasmDisassembler::CACHE_MISS_HISTOGRAM_LENGTH; ++j )
+            {
+                histogramCount += stats.m_cacheMissesHistogram[j];
+            }
+            KdasmAssert( "Cache miss histogram incorrect", histogramCount == leafNodeCount );
+            KdasmAssert( "Max cache misses incorrect", stats.m_maxCacheMissesForEachLeafNode >= KdasmDisassembler::CACHE_MISS_HISTOGRAM_LENGTH - 1
+                || stats.m_cacheMissesHistogram[stats.m_maxCacheMissesForEachLeafNode] != 0 );
+
+            printf( "%d max, cache-miss histogram:", stats.m_maxCacheMissesForEachLeafNode );
+            for( int j=1; j <= stats.m_maxCacheMissesForEachLeafNode && j < KdasmDisassembler::CACHE_MISS_HISTOGRAM_LENGTH; ++j )
+            {
+                printf( " %d:%d", j, stats.m_cacheMissesHistogram[j] );
+            }
+            printf( "\n" );
+            maxMisses[objective] = stats.m_maxCacheMissesForEachLeafNode;
+        }
+        KdasmAssert( "Max objective increased the max cache misses", maxMisses[1] <= maxMisses[0] );
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestLocalSearch( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const intptr_t iterations[] = { 0, 1000000 };
+    static const int settingsIndices[] = { 5, 6 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+
+        KdasmDisassembler::EncodingStats previousStats;
+        intptr_t previousSize = 0;
+        for( int j=0; j < (sizeof iterations / sizeof *iterations); ++j )
+        {
+            printf( "-----\nTest local search %x %d iterations.", settings.m_seed, (int)iterations[j] );
+
+            KdasmAssembler::Options options;
+            options.m_localSearchIterations = iterations[j];
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            if( j > 0 )
+            {
+                // Every move saves cache misses without allocating pages.
+                KdasmAssert( "Local search increased size", (intptr_t)randomResult.size() <= previousSize );
+                KdasmAssert( "Local search increased cache misses",
+                    stats.m_totalCacheMissesForEachLeafNode <= previousStats.m_totalCacheMissesForEachLeafNode );
+            }
+            previousStats = stats;
+            previousSize = (intptr_t)randomResult.size();
+
+            const KdasmAssembler::Report& report = kdasmAssembler.GetReport();
+            printf( "%d moves, %d pages freed\n", (int)report.m_localSearchMoves, (int)report.m_localSearchPagesFreed );
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestOptions( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const int settingsIndices[] = { 5, 6 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+
+        std::vector<KdasmEncoding> greedyResult;
+        intptr_t greedyMisses = 0;
+        for( int level=KdasmAssembler::OPTIMIZE_O0; level <= KdasmAssembler::OPTIMIZE_O3 + 1; ++level )
+        {
+            // The extra pass is O3 with a time budget that is over immediately.
+            bool outOfTime = level > KdasmAssembler::OPTIMIZE_O3;
+            KdasmAssembler::Options options( outOfTime ? KdasmAssembler::OPTIMIZE_O3 : (KdasmAssembler::OptimizationLevel)level );
+            options.m_timeBudget = outOfTime ? 1.0e-9 : 0.0;
+            printf( "-----\nTest options %x O%d%s.", settings.m_seed, outOfTime ? 3 : level, outOfTime ? " out of time" : "" );
+
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            const KdasmAssembler::Report& report = kdasmAssembler.GetReport();
+            KdasmAssert( "Time budget incorrect", report.m_outOfTime == outOfTime );
+            if( level == KdasmAssembler::OPTIMIZE_O0 )
+            {
+                greedyResult = randomResult;
+                greedyMisses = stats.m_totalCacheMissesForEachLeafNode;
+            }
+            else if( level == KdasmAssembler::OPTIMIZE_O3 )
+            {
+                KdasmAssert( "O3 is worse than O0", randomResult.size() <= greedyResult.size()
+                    || stats.m_totalCacheMissesForEachLeafNode <= greedyMisses );
+            }
+            else if( outOfTime )
+            {
+                // Only the greedy packing runs once the budget is spent.
+                KdasmAssert( "Out of time result incorrect", randomResult.size() == greedyResult.size()
+                    && ::memcmp( &randomResult[0], &greedyResult[0], randomResult.size() * sizeof( KdasmEncoding ) ) == 0 );
+            }
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestExactSearch( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    // maxNodes, maxLeaves, distanceLength, percentSubnodes, percentEmpty,   seed, pageBits
+    static KdasmTestRandomSettings smallPageSettings[] =
+    {
+        {       300,        10,              4,              73,           20, 0x73e5, KdasmEncodingHeader::PAGE_BITS_32B  },
+        {     10000,         8,              1,              73,           20, 0xd8e2, KdasmEncodingHeader::PAGE_BITS_32B  },
+    };
+    static const intptr_t limits[] = { 0, 4096 };
+    for( int i=0; i < (sizeof smallPageSettings / sizeof *smallPageSettings); ++i )
+    {
+        KdasmTestRandomSettings& settings = smallPageSettings[i];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+
+        size_t greedySize = 0;
+        for( int j=0; j < (sizeof limits / sizeof *limits); ++j )
+        {
+            printf( "-----\nTest exact search %x %d placements.", settings.m_seed, (int)limits[j] );
+
+            KdasmAssembler::Options options;
+            options.m_exactSearchLimit = limits[j];
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            printf( "%d jumps\n", stats.m_jumpNodeCount );
+
+            if( j == 0 )
+            {
+                greedySize = randomResult.size();
+            }
+            KdasmAssert( "Exact search result larger", randomResult.size() <= greedySize );
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestCostModel( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const char* names[] = { "default", "size", "misses" };
+    static const int settingsIndices[] = { 5, 6 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+        GenerateRandomWeights( random, 1.0 );
+
+        double defaultMisses = 0.0;
+        size_t defaultSize = 0;
+        for( int model=0; model < (sizeof names / sizeof *names); ++model )
+        {
+            printf( "-----\nTest cost model %x %s.", settings.m_seed, names[model] );
+
+            KdasmAssembler::Options options;
+            options.m_objective = KdasmAssembler::OBJECTIVE_WEIGHTED_MISSES;
+            if( model == 1 )
+            {
+                options.m_costModel.m_paddingWord = 1.0;
+                options.m_costModel.m_farWord = 1.0;
+                options.m_costModel.m_expectedMiss = 1.0 / 1024.0;
+                options.m_costModel.m_enabled = true;
+            }
+            else if( model == 2 )
+            {
+                options.m_costModel.m_paddingWord = 1.0 / 65536.0;
+                options.m_costModel.m_enabled = true;
+            }
+
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            double expectedMisses = stats.m_totalWeightedCacheMisses / stats.m_leafNodeWeight;
+            printf( "%d merges rejected\n", (int)kdasmAssembler.GetReport().m_mergesRejected );
+            printf( "%f expected cache-misses per-access\n", (float)expectedMisses );
+
+            if( model == 0 )
+            {
+                defaultMisses = expectedMisses;
+                defaultSize = randomResult.size();
+            }
+            else if( model == 1 )
+            {
+                KdasmAssert( "Cost model did not reduce size", randomResult.size() <= defaultSize );
+            }
+            else if( model == 2 )
+            {
+                KdasmAssert( "Cost model did not reduce cache misses", expectedMisses <= defaultMisses + 1.0e-9 );
+            }
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestMemoryBudget( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const char* names[] = { "unlimited", "default size", "half size" };
+    static const int settingsIndices[] = { 5, 6 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+
+        std::vector<KdasmEncoding> defaultResult;
+        kdasmAssembler.Assemble( random, settings.m_pageBits, defaultResult );
+        intptr_t budgets[] = { 0, (intptr_t)defaultResult.size(), (intptr_t)defaultResult.size() / 2 };
+
+        for( int j=0; j < (sizeof budgets / sizeof *budgets); ++j )
+        {
+            printf( "-----\nTest memory budget %x %s.", settings.m_seed, names[j] );
+
+            // The max misses objective pads the encoding out.
+            KdasmAssembler::Options options;
+            options.m_objective = KdasmAssembler::OBJECTIVE_MAX_MISSES;
+            options.m_maxSize = budgets[j];
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            bool fits = AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            const KdasmAssembler::Report& report = kdasmAssembler.GetReport();
+            printf( "%d attempts, %s, %d max cache-misses\n", (int)report.m_budgetAttempts, fits ? "fits" : "over budget",
+                stats.m_maxCacheMissesForEachLeafNode );
+
+            KdasmAssert( "Report size incorrect", report.m_size == (intptr_t)randomResult.size() );
+            KdasmAssert( "Over budget incorrect", fits == !report.m_overBudget && fits == ( budgets[j] == 0 || report.m_size <= budgets[j] ) );
+            KdasmAssert( "Default size budget not met", j != 1 || fits );
+            KdasmAssert( "Half size budget met", j != 2 || !fits );
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestSharedSubtrees( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const intptr_t minNodes[] = { 0, 8 };
+    static const int settingsIndices[] = { 5, 1 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomCopies( settings );
+
+        size_t unsharedSize = 0;
+        for( int j=0; j < (sizeof minNodes / sizeof *minNodes); ++j )
+        {
+            printf( "-----\nTest shared subtrees %x %d min nodes.", settings.m_seed, (int)minNodes[j] );
+
+            KdasmAssembler::Options options;
+            options.m_shareSubtreesMinNodes = minNodes[j];
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            const KdasmAssembler::Report& report = kdasmAssembler.GetReport();
+            printf( "%d shared subtrees, %d shared references\n", (int)report.m_sharedSubtrees, (int)stats.m_sharedReferenceCount );
+
+            KdasmAssert( "Shared encodings counted more than once", stats.m_paddingData >= 0 );
+            KdasmAssert( "Shared references not found", stats.m_sharedReferenceCount >= report.m_sharedSubtrees );
+            if( j == 0 )
+            {
+                unsharedSize = randomResult.size();
+                KdasmAssert( "Subtrees shared while disabled", report.m_sharedSubtrees == 0 );
+            }
+            else
+            {
+                KdasmAssert( "Copies not shared", report.m_sharedSubtrees >= 3 );
+                KdasmAssert( "Shared encoding not smaller", randomResult.size() * 2 < unsharedSize );
+            }
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestSharedLeaves( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const intptr_t minLength[] = { 0, 2, 2 }; // The last with leaf ranges.
+    static const int settingsIndices[] = { 5, 4 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomCopies( settings );
+
+        intptr_t unsharedLeafData = 0;
+        for( int j=0; j < (sizeof minLength / sizeof *minLength); ++j )
+        {
+            printf( "-----\nTest shared leaves %x %d min length%s.", settings.m_seed, (int)minLength[j], ( j == 2 ) ? " ranges" : "" );
+
+            KdasmAssembler::Options options;
+            options.m_shareLeavesMinLength = minLength[j];
+            options.m_leafRanges = j == 2;
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            const KdasmAssembler::Report& report = kdasmAssembler.GetReport();
+            printf( "%d leafblockData, %d shared leaf words\n", (int)stats.m_leafblockData, (int)report.m_sharedLeafWords );
+
+            KdasmAssert( "Shared leaf blocks counted more than once", stats.m_paddingData >= 0 );
+            if( j == 0 )
+            {
+                unsharedLeafData = stats.m_leafblockData;
+                KdasmAssert( "Leaves shared while disabled", report.m_sharedLeafWords == 0 );
+            }
+            else if( j == 1 )
+            {
+                KdasmAssert( "Leaf data not shared", stats.m_leafblockData * 2 < unsharedLeafData );
+                KdasmAssert( "Shared leaf words incorrect", stats.m_leafblockData + report.m_sharedLeafWords == unsharedLeafData );
+            }
+            else
+            {
+                // Shared ranges reference the same leaves.
+                intptr_t leafArraySize = (intptr_t)kdasmAssembler.GetLeafArray().size();
+                KdasmAssert( "Leaf ranges not shared", report.m_sharedLeafWords > 0 && leafArraySize * 2 < unsharedLeafData );
+            }
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestPackedLeaves( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const int settingsIndices[] = { 5, 4, 6 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+        GenerateSortedIds( random, 8 );
+
+        intptr_t rawLeafData = 0;
+        for( int j=0; j < 2; ++j )
+        {
+            printf( "-----\nTest packed leaves %x %s.", settings.m_seed, j ? "packed" : "raw" );
+
+            KdasmAssembler::Options options;
+            options.m_packLeaves = j != 0;
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            KdasmEncodingHeader* header = (KdasmEncodingHeader*)&randomResult[0];
+            KdasmAssert( "Packed leaves flag incorrect", header->IsPackedLeaves() == options.m_packLeaves );
+            printf( "%d leafblockData\n", (int)stats.m_leafblockData );
+
+            if( j == 0 )
+            {
+                rawLeafData = stats.m_leafblockData;
+            }
+            else
+            {
+                KdasmAssert( "Leaf data not packed", stats.m_leafblockData < rawLeafData );
+            }
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+
+    // Checks the decoders against each other, including the count escape and full width deltas.
+    m_randSeed = 0x4d2a;
+    static const int sizes[] = { 0, 1, 2, 9, 17, 2046, 2047, 3000 };
+    static const KdasmU16 maxGaps[] = { 1, 2, 100, 0xffff };
+    for( int i=0; i < (sizeof sizes / sizeof *sizes); ++i )
+    {
+        for( int j=0; j < (sizeof maxGaps / sizeof *maxGaps); ++j )
+        {
+            printf( "Test packed leaves at root %d %d.", sizes[i], (int)maxGaps[j] );
+
+            KdasmAssemblerNode* leavesAtRoot = new KdasmAssemblerNode;
+            leavesAtRoot->AddLeaves( sizes[i], new KdasmU16[sizes[i]] );
+            GenerateSortedIds( leavesAtRoot, maxGaps[j] );
+
+            KdasmAssembler::Options options;
+            options.m_packLeaves = true;
+            std::vector<KdasmEncoding> leavesAtRootResult;
+            kdasmAssembler.SetOptions( options );
+            kdasmAssembler.Assemble( leavesAtRoot, KdasmEncodingHeader::PAGE_BITS_64B, leavesAtRootResult );
+
+            KdasmAssemblerNode* leavesAtRootDisassembly = kdasmDisassembler.Disassemble( &leavesAtRootResult[0], leavesAtRoot );
+            KdasmAssert( "Disassembly failed", leavesAtRootDisassembly );
+            delete leavesAtRootDisassembly;
+
+            // Skips the encoding header and the leaf block prefix word.
+            const KdasmEncoding* block = &leavesAtRootResult[KdasmEncodingHeader::HEADER_LENGTH + 1];
+            KdasmAssert( "Packed leaf count incorrect", KdasmPackedLeaves::GetLeafCount( block ) == sizes[i] );
+            std::vector<KdasmU16> leaves( sizes[i] + 1 ), leavesReference( sizes[i] + 1 );
+            KdasmPackedLeaves::Unpack( block, &leaves[0] );
+            KdasmPackedLeaves::UnpackReference( block, &leavesReference[0] );
+            KdasmAssert( "Packed leaf decoders disagree", leaves == leavesReference );
+
+            kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+            delete leavesAtRoot;
+
+            printf( ".\n" );
+        }
+    }
+}
+
+void KdasmTest::TestLeafBits( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const int settingsIndices[] = { 5, 4 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        for( int j=0; j < 2; ++j )
+        {
+            KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+            KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+            if( j == 0 )
+            {
+                GenerateWideLeaves<KdasmU32>( random );
+            }
+            else
+            {
+                GenerateWideLeaves<KdasmU64>( random );
+            }
+
+            printf( "-----\nTest leaf bits %x %d.", settings.m_seed, j ? 64 : 32 );
+
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, KdasmAssembler::Options(), randomResult, stats );
+
+            KdasmEncodingHeader* header = (KdasmEncodingHeader*)&randomResult[0];
+            KdasmAssert( "Leaf bits incorrect", header->GetLeafBits() == ( j ? KdasmEncodingHeader::LEAF_BITS_64 : KdasmEncodingHeader::LEAF_BITS_32 ) );
+            KdasmAssert( "Encoding size incorrect", stats.m_paddingData >= 0 );
+            printf( "%d leafblockData\n", (int)stats.m_leafblockData );
+
+            delete random;
+        }
+    }
+
+    // Blocks of KdasmEncoding::LEAF_COUNT_OVERFLOW words or more have a 32 bit length.
+    m_randSeed = 0x1d7f;
+    static const int sizes[] = { 0xfffe, 0xffff, 70000 };
+    for( int i=0; i < (sizeof sizes / sizeof *sizes); ++i )
+    {
+        printf( "Test leaf bits large block %d.", sizes[i] );
+
+        std::vector<KdasmU16> leaves( sizes[i] );
+        for( int j=0; j < sizes[i]; ++j )
+        {
+            leaves[j] = Rand16();
+        }
+        KdasmAssemblerNode* leavesAtRoot = new KdasmAssemblerNode;
+        leavesAtRoot->AddLeaves( sizes[i], new KdasmU16[sizes[i]] );
+        std::copy( leaves.begin(), leaves.end(), leavesAtRoot->GetLeaves() );
+
+        std::vector<KdasmEncoding> leavesAtRootResult;
+        kdasmAssembler.Assemble( leavesAtRoot, KdasmEncodingHeader::PAGE_BITS_64B, leavesAtRootResult );
+
+        KdasmAssemblerNode* leavesAtRootDisassembly = kdasmDisassembler.Disassemble( &leavesAtRootResult[0], leavesAtRoot );
+        KdasmAssert( "Disassembly failed", leavesAtRootDisassembly );
+        delete leavesAtRootDisassembly;
+
+        bool isOverflow = leavesAtRootResult[KdasmEncodingHeader::HEADER_LENGTH].GetRaw() == KdasmEncoding::LEAF_COUNT_OVERFLOW;
+        KdasmAssert( "Leaf count overflow incorrect", isOverflow == ( sizes[i] >= KdasmEncoding::LEAF_COUNT_OVERFLOW ) );
+        KdasmLeafSpan<KdasmU16> span = KdasmLeafSpan<KdasmU16>::FromLeavesFar( &leavesAtRootResult[KdasmEncodingHeader::HEADER_LENGTH] );
+        KdasmAssert( "Leaf span size incorrect", span.Size() == sizes[i] );
+        for( int j=0; j < sizes[i]; ++j )
+        {
+            KdasmAssert( "Leaf span value incorrect", span[j] == leaves[j] );
+        }
+
+        delete leavesAtRoot;
+
+        printf( ".\n" );
+    }
+}
+
+void KdasmTest::TestLeafRanges( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const int settingsIndices[] = { 5, 4, 6 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+
+        size_t inlineSize = 0;
+        for( int j=0; j < 2; ++j )
+        {
+            printf( "-----\nTest leaf ranges %x %s.", settings.m_seed, j ? "ranges" : "inline" );
+
+            KdasmAssembler::Options options;
+            options.m_leafRanges = j != 0;
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            const std::vector<KdasmU16>& leafArray = kdasmAssembler.GetLeafArray();
+            printf( "%d leaf array\n", (int)leafArray.size() );
+
+            if( j == 0 )
+            {
+                inlineSize = randomResult.size();
+                KdasmAssert( "Leaf array without leaf ranges", leafArray.empty() );
+            }
+            else
+            {
+                intptr_t leafNodeCount = stats.m_leafNodeCount + stats.m_leafNodeFarCount;
+                KdasmAssert( "Leaf ranges are not 2 words", stats.m_leafblockData == leafNodeCount * 2 );
+                KdasmAssert( "Leaf ranges are larger", randomResult.size() < inlineSize );
+            }
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestRemapLeaves( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const int settingsIndices[] = { 5, 4 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+
+        for( int j=0; j < 2; ++j )
+        {
+            printf( "-----\nTest remap leaves %x %s.", settings.m_seed, j ? "ranges" : "inline" );
+
+            KdasmAssembler::Options options;
+            options.m_remapLeaves = true;
+            options.m_leafRanges = j != 0;
+            std::vector<KdasmEncoding> randomResult;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, randomResult, stats );
+
+            // AssembleAndCheck cannot compare remapped leaves.
+            const std::vector<KdasmU16>& leafArray = kdasmAssembler.GetLeafArray();
+            const std::vector<KdasmU64>& remap = kdasmAssembler.GetLeafRemap();
+            KdasmAssemblerNode* randomDisassembly = kdasmDisassembler.Disassemble( &randomResult[0], NULL, leafArray.empty() ? NULL : &leafArray[0] );
+            KdasmAssert( "Remapped leaves incorrect", CheckRemappedLeaves( random, randomDisassembly, remap ) );
+            delete randomDisassembly;
+
+            printf( "%d leaf values\n", (int)remap.size() );
+
+            // New values are first used in order.  Inline leaves are read from their blocks
+            // in encoding order.
+            std::vector<KdasmU16> leaves = leafArray;
+            if( !options.m_leafRanges )
+            {
+                std::map<intptr_t, intptr_t> blocks;
+                KdasmEncodingHeader* header = (KdasmEncodingHeader*)&randomResult[0];
+                KdasmEncoding* encoding = &randomResult[KdasmEncodingHeader::HEADER_LENGTH];
+                if( header->IsLeavesAtRoot() )
+                {
+                    KdasmLeafSpan<KdasmU16> span = KdasmLeafSpan<KdasmU16>::FromLeavesFar( encoding );
+                    blocks[span.GetWords() - &randomResult[0]] = span.Size();
+                }
+                else
+                {
+                    FindLeafBlocks( &randomResult[0], encoding, 0, blocks );
+                }
+                for( std::map<intptr_t, intptr_t>::iterator k = blocks.begin(); k != blocks.end(); ++k )
+                {
+                    for( intptr_t m=0; m < k->second; ++m )
+                    {
+                        leaves.push_back( randomResult[k->first + m].GetRaw() );
+                    }
+                }
+            }
+            KdasmU64 nextValue = 0;
+            for( size_t k=0; k < leaves.size(); ++k )
+            {
+                KdasmAssert( "Leaf values out of order", leaves[k] <= nextValue );
+                if( leaves[k] == nextValue )
+                {
+                    ++nextValue;
+                }
+            }
+            KdasmAssert( "Leaves not remapped", nextValue == remap.size() );
+        }
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+}
+
+void KdasmTest::TestRelativeDistance( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    printf( "-----\nTest relative distance." );
+
+    // Halves the cell towards the origin.  The planes below 1/4096 are lost when
+    // quantized over [0..1].
+    static const int depth = 20;
+    KdasmCell cell = { { 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f } };
+    KdasmAssemblerNode* root = new KdasmAssemblerNode();
+    KdasmAssemblerNode* node = root;
+    for( int i=0; i < depth; ++i )
+    {
+        KdasmU16 normal = 0;
+        float d = 0.5f * ( cell.m_min[normal] + cell.m_max[normal] );
+        KdasmU16 distance = KdasmEncoding::PackDistanceRelative( d, cell.m_min[normal], cell.m_max[normal] );
+
+        KdasmAssemblerNode* less = new KdasmAssemblerNode();
+        KdasmAssemblerNode* greater = new KdasmAssemblerNode();
+        KdasmU16* leaf = new KdasmU16[1];
+        leaf[0] = (KdasmU16)i;
+        greater->AddLeaves( 1, leaf );
+        node->AddSubnodes( distance, normal, less, greater );
+
+        KdasmCell greaterCell;
+        cell.Split( normal, distance, &cell, &greaterCell );
+        node = less;
+    }
+    KdasmU16* leaf = new KdasmU16[1];
+    leaf[0] = (KdasmU16)depth;
+    node->AddLeaves( 1, leaf );
+
+    KdasmAssembler::Options options;
+    options.m_relativeDistance = true;
+    std::vector<KdasmEncoding> result;
+    kdasmAssembler.SetOptions( options );
+    kdasmAssembler.Assemble( root, KdasmEncodingHeader::PAGE_BITS_64B, result );
+    kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+
+    KdasmEncodingHeader* header = (KdasmEncodingHeader*)&result[0];
+    KdasmAssert( "Relative distance flag missing", header->IsRelativeDistance() );
+
+    KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &result[0], root );
+    KdasmAssert( "Disassembly failed", disassembly );
+    KdasmAssert( "Disassembly is not equal", root->Equals( *disassembly ) );
+
+    // Traverse the encoded planes tracking the cell.
+    KdasmCell traversed = { { 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f } };
+    for( KdasmAssemblerNode* n = disassembly; n->HasSubnodes(); n = n->GetSubnode( 0 ) )
+    {
+        KdasmCell greaterCell;
+        traversed.Split( n->GetNormal(), n->GetDistance()[0], &traversed, &greaterCell );
+    }
+
+    float exact = 1.0f / (float)( 1 << depth );
+    float d01less, d01greater;
+    KdasmEncoding absolute;
+    absolute.SetRaw( KdasmEncoding::PackDistanceImmediate( exact ) );
+    absolute.UnpackDistanceImmediate( &d01less, &d01greater );
+    printf( "\n%g exact, %g relative, %g absolute cell extent\n", exact, traversed.m_max[0], d01greater );
+
+    KdasmAssert( "Relative cell is not conservative", traversed.m_min[0] == 0.0f && traversed.m_max[0] >= exact );
+    KdasmAssert( "Relative cell is too large", traversed.m_max[0] < exact * 1.02f );
+
+    // Relative distances cannot be wider than a KdasmU16.
+    KdasmAssemblerNode* wide = new KdasmAssemblerNode();
+    wide->AddSubnodes( (intptr_t)0x12345, 2, 0, new KdasmAssemblerNode(), new KdasmAssemblerNode() );
+    kdasmAssembler.SetOptions( options );
+    bool isWideAssembled = kdasmAssembler.Assemble( wide, KdasmEncodingHeader::PAGE_BITS_64B, result );
+    kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+    KdasmAssert( "Relative distance length 2 accepted", !isWideAssembled && result.empty() );
+
+    delete wide;
+    delete disassembly;
+    delete root;
+}
+
+// Every leaf whose cell contains the point has to reference every box containing it.
+bool KdasmTest::CheckBuiltCells( KdasmAssemblerNode* node, const KdasmCell& cell, bool isRelative, const float* point, const std::vector<KdasmBuilder::Box>& boxes )
+{
+    if( !node || !node->HasSubnodes() )
+    {
+        // Leaves are KdasmU32 with more than 0x10000 boxes.
+        KdasmU16* leaves = node ? node->GetLeaves() : NULL;
+        intptr_t leafCount = node ? node->GetLeafCount() : 0;
+        bool isU32 = node && node->GetLeafBits() == KdasmEncodingHeader::LEAF_BITS_32;
+        for( size_t i=0; i < boxes.size(); ++i )
+        {
+            const KdasmBuilder::Box& box = boxes[i];
+            if( point[0] < box.m_min[0] || point[0] > box.m_max[0] || point[1] < box.m_min[1] || point[1] > box.m_max[1]
+                || point[2] < box.m_min[2] || point[2] > box.m_max[2] )
+            {
+                continue;
+            }
+            bool isFound = false;
+            for( intptr_t j=0; j < leafCount && !isFound; ++j )
+            {
+                KdasmU32 leaf = leaves[j];
+                if( isU32 )
+                {
+                    ::memcpy( &leaf, leaves + j * 2, sizeof leaf );
+                }
+                isFound = leaf == (KdasmU32)i;
+            }
+            if( !isFound )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    KdasmU16 normal = node->GetNormal();
+    KdasmCell less, greater;
+    if( isRelative )
+    {
+        cell.Split( normal, node->GetDistance()[0], &less, &greater );
+    }
+    else
+    {
+        cell.SplitAbsolute( normal, node->GetDistance()[0], &less, &greater );
+    }
+    if( point[normal] <= less.m_max[normal] && !CheckBuiltCells( node->GetSubnode( 0 ), less, isRelative, point, boxes ) )
+    {
+        return false;
+    }
+    if( point[normal] >= greater.m_min[normal] && !CheckBuiltCells( node->GetSubnode( 1 ), greater, isRelative, point, boxes ) )
+    {
+        return false;
+    }
+    return true;
+}
+
+void KdasmTest::TestBuilder( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const char* heuristicNames[] = { "sah", "median" };
+
+    SRand( 0x4b1d );
+    std::vector<KdasmBuilder::Box> boxes( 2000 );
+    for( size_t i=0; i < boxes.size(); ++i )
+    {
+        // A quarter of them are points.
+        float size = ( i % 4 ) ? 0.05f : 0.0f;
+        for( int j=0; j < 3; ++j )
+        {
+            boxes[i].m_min[j] = (float)Rand16() * ( ( 1.0f - size ) / 32749.0f );
+            boxes[i].m_max[j] = boxes[i].m_min[j] + size * (float)Rand16() * ( 1.0f / 32749.0f );
+        }
+    }
+
+    KdasmBuilder kdasmBuilder;
+    for( int i=0; i < 4; ++i )
+    {
+        KdasmBuilder::Options builderOptions;
+        builderOptions.m_heuristic = ( i & 1 ) ? KdasmBuilder::HEURISTIC_MEDIAN : KdasmBuilder::HEURISTIC_SAH;
+        builderOptions.m_relativeDistance = ( i & 2 ) != 0;
+        kdasmBuilder.SetOptions( builderOptions );
+
+        printf( "-----\nTest builder %s %s.", heuristicNames[i & 1], builderOptions.m_relativeDistance ? "relative" : "absolute" );
+
+        KdasmAssemblerNode* root = kdasmBuilder.Build( &boxes[0], (intptr_t)boxes.size() );
+        const KdasmBuilder::Report& report = kdasmBuilder.GetReport();
+
+        KdasmAssembler::Options options;
+        options.m_relativeDistance = builderOptions.m_relativeDistance;
+        std::vector<KdasmEncoding> result;
+        kdasmAssembler.SetOptions( options );
+        kdasmAssembler.Assemble( root, KdasmEncodingHeader::PAGE_BITS_64B, result );
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+
+        KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &result[0], root );
+        KdasmAssert( "Disassembly failed", disassembly );
+        KdasmAssert( "Disassembly is not equal", root->Equals( *disassembly ) );
+
+        printf( "\n%d nodes, %d leaf nodes, %.2f references per-box, %d total size\n", (int)report.m_nodeCount, (int)report.m_leafNodeCount,
+            (float)report.m_leafReferences / (float)boxes.size(), (int)result.size() );
+
+        // Query the corners of the boxes as well as random points.
+        for( size_t j=0; j < boxes.size(); j += 7 )
+        {
+            float point[3] = { boxes[j].m_max[0], boxes[j].m_max[1], boxes[j].m_min[2] };
+            KdasmCell cell = { { 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f } };
+            KdasmAssert( "Builder lost a box", CheckBuiltCells( disassembly, cell, builderOptions.m_relativeDistance, point, boxes ) );
+
+            float randomPoint[3] = { (float)Rand16() / 32749.0f, (float)Rand16() / 32749.0f, (float)Rand16() / 32749.0f };
+            KdasmAssert( "Builder lost a box", CheckBuiltCells( disassembly, cell, builderOptions.m_relativeDistance, randomPoint, boxes ) );
+        }
+
+        delete disassembly;
+        delete root;
+    }
+
+    // Large enough to be binned and built in parallel.  The tree should not depend on
+    // the number of threads.
+    boxes.resize( 20000 );
+    for( size_t i=0; i < boxes.size(); ++i )
+    {
+        float size = ( i % 4 ) ? 0.01f : 0.0f;
+        for( int j=0; j < 3; ++j )
+        {
+            boxes[i].m_min[j] = (float)Rand( 0x100000 ) * ( ( 1.0f - size ) / (float)0x100000 );
+            boxes[i].m_max[j] = boxes[i].m_min[j] + size * (float)Rand16() * ( 1.0f / 32749.0f );
+        }
+    }
+
+    printf( "-----\nTest builder parallel." );
+
+    KdasmBuilder::Options builderOptions;
+    builderOptions.m_threadCount = 1;
+    kdasmBuilder.SetOptions( builderOptions );
+    KdasmAssemblerNode* serial = kdasmBuilder.Build( &boxes[0], (intptr_t)boxes.size() );
+
+    builderOptions.m_threadCount = 0;
+    kdasmBuilder.SetOptions( builderOptions );
+    KdasmAssemblerNode* parallel = kdasmBuilder.Build( &boxes[0], (intptr_t)boxes.size() );
+    const KdasmBuilder::Report& report = kdasmBuilder.GetReport();
+
+    printf( "\n%d nodes, %.2f references per-box, %d tasks\n", (int)report.m_nodeCount,
+        (float)report.m_leafReferences / (float)boxes.size(), (int)report.m_taskCount );
+    KdasmAssert( "Parallel build is not equal", serial->Equals( *parallel ) );
+
+    for( size_t j=0; j < boxes.size(); j += 401 )
+    {
+        float point[3] = { boxes[j].m_min[0], boxes[j].m_max[1], boxes[j].m_max[2] };
+        KdasmCell cell = { { 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f } };
+        KdasmAssert( "Builder lost a box", CheckBuiltCells( parallel, cell, false, point, boxes ) );
+    }
+
+    delete serial;
+    delete parallel;
+
+    // Too many boxes for KdasmU16 leaves.
+    boxes.resize( 0x10000 + 4000 );
+    for( size_t i=0; i < boxes.size(); ++i )
+    {
+        for( int j=0; j < 3; ++j )
+        {
+            boxes[i].m_min[j] = (float)Rand( 0x100000 ) * ( 0.995f / (float)0x100000 );
+            boxes[i].m_max[j] = boxes[i].m_min[j] + (float)Rand16() * ( 0.005f / 32749.0f );
+        }
+    }
+
+    printf( "-----\nTest builder 32-bit leaves." );
+
+    KdasmAssemblerNode* root = kdasmBuilder.Build( &boxes[0], (intptr_t)boxes.size() );
+    std::vector<KdasmEncoding> result;
+    kdasmAssembler.Assemble( root, KdasmEncodingHeader::PAGE_BITS_64B, result );
+    KdasmAssert( "Leaves are not 32-bit", ( (KdasmEncodingHeader*)&result[0] )->GetLeafBits() == KdasmEncodingHeader::LEAF_BITS_32 );
+    KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &result[0], root );
+    KdasmAssert( "Disassembly failed", disassembly );
+    KdasmAssert( "Disassembly is not equal", root->Equals( *disassembly ) );
+    printf( "\n%d nodes, %d total size\n", (int)kdasmBuilder.GetReport().m_nodeCount, (int)result.size() );
+
+    for( size_t j=0; j < boxes.size(); j += 997 )
+    {
+        float point[3] = { boxes[j].m_max[0], boxes[j].m_min[1], boxes[j].m_max[2] };
+        KdasmCell cell = { { 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f } };
+        KdasmAssert( "Builder lost a box", CheckBuiltCells( disassembly, cell, false, point, boxes ) );
+    }
+
+    delete disassembly;
+    delete root;
+}
+
+void KdasmTest::TestBuilderPages( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    SRand( 0x3e11 );
+    std::vector<KdasmBuilder::Box> boxes( 4000 );
+    for( size_t i=0; i < boxes.size(); ++i )
+    {
+        for( int j=0; j < 3; ++j )
+        {
+            boxes[i].m_min[j] = (float)Rand16() * ( 0.98f / 32749.0f );
+            boxes[i].m_max[j] = boxes[i].m_min[j] + (float)Rand16() * ( 0.02f / 32749.0f );
+        }
+    }
+
+    static const KdasmEncodingHeader::PageBits pageBits[] = { KdasmEncodingHeader::PAGE_BITS_32B, KdasmEncodingHeader::PAGE_BITS_64B, KdasmEncodingHeader::PAGE_BITS_128B };
+    for( int i=0; i < (sizeof pageBits / sizeof *pageBits); ++i )
+    {
+        float missesPerLeaf[2];
+        for( int j=0; j < 2; ++j )
+        {
+            printf( "-----\nTest builder pages %d %s.", 1 << pageBits[i], j ? "aware" : "default" );
+
+            KdasmBuilder kdasmBuilder;
+            KdasmBuilder::Options builderOptions;
+            builderOptions.m_pageBits = pageBits[i];
+            builderOptions.m_pageAware = j != 0;
+            builderOptions.m_pageMissCost = j ? 8.0f : builderOptions.m_pageMissCost;
+            kdasmBuilder.SetOptions( builderOptions );
+            KdasmAssemblerNode* root = kdasmBuilder.Build( &boxes[0], (intptr_t)boxes.size() );
+
+            std::vector<KdasmEncoding> result;
+            KdasmDisassembler::EncodingStats stats;
+            AssembleAndCheck( kdasmAssembler, kdasmDisassembler, root, pageBits[i], KdasmAssembler::Options(), result, stats );
+
+            intptr_t leafNodeCount = stats.m_leafNodeCount + stats.m_leafNodeFarCount;
+            missesPerLeaf[j] = (float)stats.m_totalCacheMissesForEachLeafNode / (float)leafNodeCount;
+            printf( "%d leaf nodes, %.2f references per-box\n", (int)leafNodeCount,
+                (float)kdasmBuilder.GetReport().m_leafReferences / (float)boxes.size() );
+
+            delete root;
+        }
+        KdasmAssert( "Page aware build has more cache-misses", missesPerLeaf[1] <= missesPerLeaf[0] );
+    }
+}
+
+void KdasmTest::TestReassemble( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    static const int settingsIndices[] = { 0, 1, 5 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        printf( "-----\nTest reassemble %x.", settings.m_seed );
+
+        KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+        std::vector<KdasmEncoding> encoding;
+        kdasmAssembler.Assemble( random, settings.m_pageBits, encoding );
+        delete random;
+
+        intptr_t changedWords = 0;
+        intptr_t fullReassembleCount = 0;
+        for( int j=0; j < 100; ++j )
+        {
+            // Pick a node by walking down at random.
+            KdasmAssemblerNode* expected = kdasmDisassembler.Disassemble( &encoding[0] );
+            KdasmAssemblerNode* parent = NULL;
+            KdasmAssemblerNode* node = expected;
+            std::vector<int> path;
+            while( node->HasSubnodes() && ( path.size() < 2 || RandBool( 90 ) ) )
+            {
+                int side = node->GetSubnode( 0 ) ? ( node->GetSubnode( 1 ) ? (int)( Rand16() & 1 ) : 0 ) : 1;
+                parent = node;
+                node = node->GetSubnode( side );
+                path.push_back( side );
+            }
+
+            // Either a small random subtree or a single leaf.
+            KdasmTestRandomSettings subtreeSettings = settings;
+            subtreeSettings.m_maxNodes = 40;
+            subtreeSettings.m_seed = Rand16();
+            KdasmU16 seed = m_randSeed;
+            bool isLeaf = RandBool( 30 );
+            KdasmAssemblerNode* subtree = NULL;
+            KdasmAssemblerNode* subtreeCopy = NULL;
+            if( isLeaf )
+            {
+                subtree = new KdasmAssemblerNode;
+                subtree->AddLeaves( 1, new KdasmU16[1] );
+                subtree->GetLeaves()[0] = (KdasmU16)j;
+                subtreeCopy = new KdasmAssemblerNode;
+                subtreeCopy->AddLeaves( 1, new KdasmU16[1] );
+                subtreeCopy->GetLeaves()[0] = (KdasmU16)j;
+            }
+            else
+            {
+                subtree = GenerateRandomNodes( subtreeSettings );
+                subtreeCopy = GenerateRandomNodes( subtreeSettings );
+                if( !subtree->HasSubnodes() && subtree->GetLeafCount() == 0 )
+                {
+                    subtree->AddLeaves( 1, new KdasmU16[1] );
+                    subtreeCopy->AddLeaves( 1, new KdasmU16[1] );
+                    subtree->GetLeaves()[0] = subtreeCopy->GetLeaves()[0] = 0;
+                }
+            }
+            m_randSeed = seed;
+
+            if( parent )
+            {
+                int side = path.back();
+                delete parent->DetachSubnode( side );
+                KdasmAssemblerNode* less    = side == 0 ? subtreeCopy : parent->DetachSubnode( 0 );
+                KdasmAssemblerNode* greater = side == 1 ? subtreeCopy : parent->DetachSubnode( 1 );
+                KdasmU16 distance[KdasmEncodingHeader::DISTANCE_LENGTH_MAX];
+                ::memcpy( distance, parent->GetDistance(), sizeof distance );
+                parent->AddSubnodes( distance, parent->GetDistanceLength(), parent->GetNormal(), less, greater );
+            }
+            else
+            {
+                delete expected;
+                expected = subtreeCopy;
+            }
+
+            std::vector<KdasmEncoding> previous = encoding;
+            bool isReassembled = kdasmAssembler.Reassemble( encoding, path, subtree );
+            KdasmAssert( "Reassemble failed", isReassembled );
+
+            KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &encoding[0], expected );
+            KdasmAssert( "Disassembly failed", disassembly );
+            KdasmAssert( "Disassembly is not equal", expected->Equals( *disassembly ) ); // Double check.
+
+            // Only the words that reference the new subtree should change unless the whole tree was.
+            intptr_t changed = 0;
+            for( size_t k=0; k < previous.size() && k < encoding.size(); ++k )
+            {
+                changed += previous[k].GetRaw() != encoding[k].GetRaw() ? 1 : 0;
+            }
+            if( encoding.size() < previous.size() || changed > KdasmEncoding::FAR_WORDS_COUNT_MAX + 1 )
+            {
+                ++fullReassembleCount;
+            }
+            else
+            {
+                changedWords += changed;
+            }
+
+            delete subtree;
+            delete expected;
+            delete disassembly;
+        }
+
+        printf( "\n%d full reassemblies, %.2f words changed per-reassembly, %d total size\n", (int)fullReassembleCount,
+            (float)changedWords / (float)( 100 - fullReassembleCount ), (int)encoding.size() );
+        KdasmAssert( "Reassemble changed the whole encoding too often", fullReassembleCount < 10 );
+
+        // Compacting drops the replaced subtrees.
+        intptr_t reassembledSize = (intptr_t)encoding.size();
+        KdasmAssemblerNode* expected = kdasmDisassembler.Disassemble( &encoding[0] );
+        KdasmAssert( "Compact failed", kdasmAssembler.Compact( encoding ) );
+        KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &encoding[0], expected );
+        KdasmAssert( "Disassembly failed", disassembly );
+        KdasmAssert( "Disassembly is not equal", expected->Equals( *disassembly ) ); // Double check.
+        printf( "%d compacted size\n", (int)encoding.size() );
+        KdasmAssert( "Compact did not shrink the encoding", (intptr_t)encoding.size() < reassembledSize );
+        delete expected;
+        delete disassembly;
+    }
+}
+
+void KdasmTest::TestLeafSlack( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    KdasmAssembler::Options savedOptions = kdasmAssembler.GetOptions();
+    KdasmAssembler::Options options = savedOptions;
+    options.m_leafSlack = 0.5;
+    kdasmAssembler.SetOptions( options );
+
+    static const int settingsIndices[] = { 0, 1 };
+    for( int i=0; i < (sizeof settingsIndices / sizeof *settingsIndices); ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[settingsIndices[i]];
+        printf( "-----\nTest leaf slack %x.", settings.m_seed );
+
+        KdasmAssemblerNode* expected = GenerateRandomNodes( settings );
+        std::vector<KdasmEncoding> encoding;
+        kdasmAssembler.Assemble( expected, settings.m_pageBits, encoding );
+        intptr_t initialSize = (intptr_t)encoding.size();
+
+        KdasmLeafUpdater kdasmLeafUpdater( kdasmAssembler, encoding );
+        for( int j=0; j < 4000; ++j )
+        {
+            // Walk down to a leaf node at random.
+            KdasmAssemblerNode* node = expected;
+            std::vector<int> path;
+            while( node->HasSubnodes() )
+            {
+                int side = node->GetSubnode( 0 ) ? ( node->GetSubnode( 1 ) ? (int)( Rand16() & 1 ) : 0 ) : 1;
+                node = node->GetSubnode( side );
+                path.push_back( side );
+            }
+
+            // Removals leave at least one leaf, as reassembly trims empty leaf nodes.
+            intptr_t leafCount = node->GetLeafCount();
+            std::vector<KdasmU16> leaves( node->GetLeaves(), node->GetLeaves() + leafCount );
+            bool isUpdated = false;
+            if( leafCount > 1 && RandBool( 40 ) )
+            {
+                intptr_t index = Rand( leafCount );
+                isUpdated = kdasmLeafUpdater.RemoveLeaves( path, index, 1 );
+                leaves.erase( leaves.begin() + index );
+            }
+            else
+            {
+                KdasmU16 insert[3] = { Rand16(), Rand16(), Rand16() };
+                intptr_t insertCount = Rand( 3 ) + 1;
+                isUpdated = kdasmLeafUpdater.InsertLeaves( path, insert, insertCount );
+                leaves.insert( leaves.end(), insert, insert + insertCount );
+            }
+            KdasmAssert( "Leaf update failed", isUpdated );
+
+            KdasmU16* nodeLeaves = new KdasmU16[leaves.size()];
+            std::copy( leaves.begin(), leaves.end(), nodeLeaves );
+            node->AddLeaves( (intptr_t)leaves.size(), nodeLeaves );
+
+            if( ( j % 500 ) == 499 )
+            {
+                KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &encoding[0], expected );
+                KdasmAssert( "Disassembly failed", disassembly );
+                KdasmAssert( "Disassembly is not equal", expected->Equals( *disassembly ) ); // Double check.
+                delete disassembly;
+            }
+        }
+
+        const KdasmLeafUpdater::Report& report = kdasmLeafUpdater.GetReport();
+        printf( "\n%d in place, %d reassembled, %d compacted, %d initial size, %d final size\n", (int)report.m_inPlaceUpdates,
+            (int)report.m_reassemblies, (int)report.m_compactions, (int)initialSize, (int)encoding.size() );
+        KdasmAssert( "Leaf slack is not being used", report.m_inPlaceUpdates > report.m_reassemblies );
+        KdasmAssert( "Encoding was not compacted", report.m_compactions > 0 );
+
+        delete expected;
+    }
+
+    // Leaves at the root use the rest of the encoding.
+    KdasmAssemblerNode* leaves = new KdasmAssemblerNode;
+    leaves->AddLeaves( 8, new KdasmU16[8] );
+    ::memset( leaves->GetLeaves(), 0, 8 * sizeof( KdasmU16 ) );
+    std::vector<KdasmEncoding> encoding;
+    kdasmAssembler.Assemble( leaves, KdasmEncodingHeader::PAGE_BITS_64B, encoding );
+    KdasmLeafUpdater kdasmLeafUpdater( kdasmAssembler, encoding );
+    KdasmU16 leaf = 1;
+    KdasmAssert( "Leaf update failed", kdasmLeafUpdater.InsertLeaves( std::vector<int>(), &leaf, 1 ) );
+    KdasmAssert( "Leaves at the root were reassembled", kdasmLeafUpdater.GetReport().m_inPlaceUpdates == 1 );
+    KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &encoding[0] );
+    KdasmAssert( "Disassembly failed", disassembly && disassembly->GetLeafCount() == 9 && disassembly->GetLeaves()[8] == 1 );
+    delete disassembly;
+    delete leaves;
+
+    kdasmAssembler.SetOptions( savedOptions );
+}
+
+void KdasmTest::TestPatch( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    KdasmAssembler::Options savedOptions = kdasmAssembler.GetOptions();
+    KdasmAssembler::Options options = savedOptions;
+    options.m_leafSlack = 0.5;
+    kdasmAssembler.SetOptions( options );
+
+    KdasmTestRandomSettings& settings = m_settings[2];
+    printf( "-----\nTest patch %x.", settings.m_seed );
+
+    KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+    std::vector<KdasmEncoding> oldEncoding;
+    kdasmAssembler.Assemble( random, settings.m_pageBits, oldEncoding );
+
+    // Some leaf updates, a few of them reassembled.
+    std::vector<KdasmEncoding> newEncoding = oldEncoding;
+    KdasmLeafUpdater kdasmLeafUpdater( kdasmAssembler, newEncoding );
+    for( int i=0; i < 200; ++i )
+    {
+        KdasmAssemblerNode* node = random;
+        std::vector<int> path;
+        while( node->HasSubnodes() )
+        {
+            int side = node->GetSubnode( 0 ) ? ( node->GetSubnode( 1 ) ? (int)( Rand16() & 1 ) : 0 ) : 1;
+            node = node->GetSubnode( side );
+            path.push_back( side );
+        }
+        KdasmU16 leaf = Rand16();
+        KdasmAssert( "Insert failed", kdasmLeafUpdater.InsertLeaves( path, &leaf, 1 ) );
+    }
+
+    KdasmPatch kdasmPatch;
+    std::vector<KdasmU16> patch;
+    kdasmPatch.Diff( &oldEncoding[0], (intptr_t)oldEncoding.size(), &newEncoding[0], (intptr_t)newEncoding.size(), patch );
+    const KdasmPatch::Report& report = kdasmPatch.GetReport();
+    printf( "\n%d of %d pages changed, %d runs, %d patch size, %d encoding size\n", (int)report.m_changedPageCount,
+        (int)report.m_pageCount, (int)report.m_runCount, (int)report.m_patchSize, (int)newEncoding.size() );
+    KdasmAssert( "Patch is too large", report.m_changedPageCount * 4 < report.m_pageCount );
+
+    std::vector<KdasmEncoding> patched = oldEncoding;
+    KdasmAssert( "Patch failed", kdasmPatch.Apply( patched, &patch[0], (intptr_t)patch.size() ) );
+    KdasmAssert( "Patch is incorrect", patched.size() == newEncoding.size()
+        && ::memcmp( &patched[0], &newEncoding[0], patched.size() * sizeof( KdasmEncoding ) ) == 0 );
+
+    // Applying it again or applying a damaged patch changes nothing.
+    KdasmAssert( "Patch applied to the wrong encoding", !kdasmPatch.Apply( patched, &patch[0], (intptr_t)patch.size() ) );
+    KdasmAssert( "Damaged patch applied", !kdasmPatch.Apply( oldEncoding, &patch[0], (intptr_t)patch.size() - 1 ) );
+    KdasmAssert( "Patch changed the encoding", patched.size() == newEncoding.size() );
+
+    // Nor does applying it to another encoding of the same size.
+    std::vector<KdasmEncoding> wrongBase = oldEncoding;
+    wrongBase[wrongBase.size() / 2].SetRaw( wrongBase[wrongBase.size() / 2].GetRaw() ^ 1 );
+    std::vector<KdasmEncoding> wrongBaseCopy = wrongBase;
+    KdasmAssert( "Patch applied to the wrong base", !kdasmPatch.Apply( wrongBase, &patch[0], (intptr_t)patch.size() ) );
+    KdasmAssert( "Patch changed the wrong base", wrongBase.size() == wrongBaseCopy.size()
+        && ::memcmp( &wrongBase[0], &wrongBaseCopy[0], wrongBase.size() * sizeof( KdasmEncoding ) ) == 0 );
+
+    // Back again, shrinking the encoding.
+    kdasmPatch.Diff( &newEncoding[0], (intptr_t)newEncoding.size(), &oldEncoding[0], (intptr_t)oldEncoding.size(), patch );
+    KdasmAssert( "Patch failed", kdasmPatch.Apply( patched, &patch[0], (intptr_t)patch.size() ) );
+    KdasmAssert( "Patch is incorrect", patched.size() == oldEncoding.size()
+        && ::memcmp( &patched[0], &oldEncoding[0], patched.size() * sizeof( KdasmEncoding ) ) == 0 );
+
+    // Nothing changed.
+    kdasmPatch.Diff( &oldEncoding[0], (intptr_t)oldEncoding.size(), &oldEncoding[0], (intptr_t)oldEncoding.size(), patch );
+    KdasmAssert( "Empty patch has runs", patch.size() == KdasmPatch::HEADER_LENGTH );
+
+    KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &patched[0] );
+    KdasmAssert( "Disassembly failed", disassembly );
+    delete disassembly;
+    delete random;
+
+    kdasmAssembler.SetOptions( savedOptions );
+}
+
+void KdasmTest::TestFile( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    KdasmTestRandomSettings& settings = m_settings[3];
+    printf( "-----\nTest file %x.", settings.m_seed );
+
+    KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+    std::vector<KdasmEncoding> encoding;
+    kdasmAssembler.Assemble( random, settings.m_pageBits, encoding );
+
+    static const char metadata[] = "kdasm test metadata";
+    static const intptr_t alignments[] = { 128, 4096 };
+    for( int i=0; i < (sizeof alignments / sizeof *alignments); ++i )
+    {
+        bool isWritten = KdasmFile::Write( "kdasmtest.kdf", &encoding[0], (intptr_t)encoding.size(), metadata, sizeof metadata, alignments[i] );
+        KdasmAssert( "File write failed", isWritten );
+
+        KdasmFile kdasmFile;
+        KdasmAssert( "File map failed", kdasmFile.Map( "kdasmtest.kdf" ) );
+        KdasmAssert( "File encoding is not aligned", ( (size_t)kdasmFile.GetEncoding() & ( alignments[i] - 1 ) ) == 0 );
+        KdasmAssert( "File encoding is incorrect", kdasmFile.GetEncodingSize() == (intptr_t)encoding.size()
+            && ::memcmp( kdasmFile.GetEncoding(), &encoding[0], encoding.size() * sizeof( KdasmEncoding ) ) == 0 );
+        KdasmAssert( "File metadata is incorrect", kdasmFile.GetMetadataSize() == sizeof metadata
+            && ::memcmp( kdasmFile.GetMetadata(), metadata, sizeof metadata ) == 0 );
+
+        // Read in place.
+        KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( (KdasmEncoding*)kdasmFile.GetEncoding(), random );
+        KdasmAssert( "Disassembly failed", disassembly );
+        KdasmAssert( "Disassembly is not equal", random->Equals( *disassembly ) ); // Double check.
+        delete disassembly;
+
+        printf( "\n%d pages, %d byte alignment\n", (int)kdasmFile.GetPageCount(), (int)kdasmFile.GetAlignment() );
+    }
+
+    // A truncated file is rejected.
+    std::vector<char> file( 1 << 20 );
+    FILE* f = ::fopen( "kdasmtest.kdf", "rb" );
+    size_t fileSize = ::fread( &file[0], 1, file.size(), f );
+    ::fclose( f );
+    f = ::fopen( "kdasmtest.kdf", "wb" );
+    ::fwrite( &file[0], 1, fileSize - 2, f );
+    ::fclose( f );
+    KdasmFile truncated;
+    KdasmAssert( "Invalid file mapped", !truncated.Map( "kdasmtest.kdf" ) );
+    KdasmAssert( "Missing file mapped", !truncated.Map( "kdasmtest.missing" ) );
+
+    // So is an encoding header without a valid page size.
+    size_t encodingOffset = alignments[1];
+    while( encodingOffset < fileSize && ::memcmp( &file[encodingOffset], &encoding[0], KdasmEncodingHeader::HEADER_LENGTH * sizeof( KdasmEncoding ) ) != 0 )
+    {
+        encodingOffset += alignments[1];
+    }
+    KdasmAssert( "File encoding not found", encodingOffset < fileSize );
+    ::memset( &file[encodingOffset + sizeof( KdasmEncoding )], 0, sizeof( KdasmEncoding ) );
+    f = ::fopen( "kdasmtest.kdf", "wb" );
+    ::fwrite( &file[0], 1, fileSize, f );
+    ::fclose( f );
+    KdasmFile corrupted;
+    KdasmAssert( "Invalid page size mapped", !corrupted.Map( "kdasmtest.kdf" ) );
+
+    ::remove( "kdasmtest.kdf" );
+    delete random;
+}
+
+void KdasmTest::TestEncodingBuffer( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    KdasmTestRandomSettings& settings = m_settings[4];
+    printf( "-----\nTest encoding buffer %x.", settings.m_seed );
+
+    KdasmEncodingBuffer buffer;
+    static const intptr_t sizes[] = { 0, 1, 63, 64, 1000 };
+    for( int i=0; i < (sizeof sizes / sizeof *sizes); ++i )
+    {
+        KdasmAssert( "Buffer allocation failed", buffer.Allocate( sizes[i] ) );
+        KdasmAssert( "Buffer is not aligned", ( (size_t)buffer.GetEncoding() & ( KdasmEncodingBuffer::ALIGNMENT - 1 ) ) == 0 );
+        KdasmAssert( "Buffer size is incorrect", buffer.Size() == sizes[i] );
+        KdasmAssert( "Buffer is not padded", sizes[i] == 0 || buffer.GetEncoding()[sizes[i] - 1].GetRaw() == KdasmEncoding::PAD_VALUE );
+    }
+
+    KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+    std::vector<KdasmEncoding> encoding;
+    kdasmAssembler.Assemble( random, settings.m_pageBits, encoding );
+    KdasmAssert( "Buffer assembly failed", kdasmAssembler.Assemble( random, settings.m_pageBits, buffer ) );
+    KdasmAssert( "Buffer is not aligned", ( (size_t)buffer.GetEncoding() & ( KdasmEncodingBuffer::ALIGNMENT - 1 ) ) == 0 );
+    KdasmAssert( "Buffer encoding is incorrect", buffer.Size() == (intptr_t)encoding.size()
+        && ::memcmp( buffer.GetEncoding(), &encoding[0], encoding.size() * sizeof( KdasmEncoding ) ) == 0 );
+
+    KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( buffer.GetEncoding(), random );
+    KdasmAssert( "Disassembly failed", disassembly );
+    KdasmAssert( "Disassembly is not equal", random->Equals( *disassembly ) ); // Double check.
+    delete disassembly;
+
+    // Huge pages may not be available.  Either way the buffer is usable.
+    static const KdasmEncodingBuffer::HugePages hugePages[] = { KdasmEncodingBuffer::HUGE_PAGES_TRANSPARENT, KdasmEncodingBuffer::HUGE_PAGES_EXPLICIT };
+    for( int i=0; i < (sizeof hugePages / sizeof *hugePages); ++i )
+    {
+        intptr_t size = 2 * KdasmEncodingBuffer::HUGE_PAGE_SIZE / sizeof( KdasmEncoding );
+        KdasmAssert( "Buffer allocation failed", buffer.Allocate( size, hugePages[i] ) );
+        KdasmAssert( "Buffer is not aligned", ( (size_t)buffer.GetEncoding() & ( KdasmEncodingBuffer::ALIGNMENT - 1 ) ) == 0 );
+        KdasmAssert( "Buffer is not padded", buffer.GetEncoding()[size - 1].GetRaw() == KdasmEncoding::PAD_VALUE );
+        KdasmAssert( "Reserved huge pages were not requested", !buffer.IsHugePages() || hugePages[i] == KdasmEncodingBuffer::HUGE_PAGES_EXPLICIT );
+
+        KdasmAssert( "Buffer assembly failed", kdasmAssembler.Assemble( random, settings.m_pageBits, buffer, hugePages[i] ) );
+        KdasmAssert( "Buffer encoding is incorrect", buffer.Size() == (intptr_t)encoding.size()
+            && ::memcmp( buffer.GetEncoding(), &encoding[0], encoding.size() * sizeof( KdasmEncoding ) ) == 0 );
+        printf( "\nhuge pages %d: reserved %d", (int)hugePages[i], (int)buffer.IsHugePages() );
+    }
+    printf( "\n" );
+
+    buffer.Free();
+    KdasmAssert( "Buffer not freed", buffer.GetEncoding() == NULL && buffer.Size() == 0 );
+    delete random;
+}
+
+void KdasmTest::TestAssembleInPlace( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    KdasmTestRandomSettings& settings = m_settings[6];
+    printf( "-----\nTest assemble in place %x.", settings.m_seed );
+
+    KdasmAssembler::Options savedOptions = kdasmAssembler.GetOptions();
+    KdasmAssembler::Options options = savedOptions;
+    options.m_reportCacheMisses = true;
+    kdasmAssembler.SetOptions( options );
+
+    KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+    std::vector<KdasmEncoding> encoding;
+    kdasmAssembler.Assemble( random, settings.m_pageBits, encoding );
+    KdasmAssembler::Report report = kdasmAssembler.GetReport();
+    KdasmAssert( "Report cache misses missing", report.m_maxCacheMisses > 0 );
+
+    // Straight into a mapped file.
+    static const char metadata[] = "kdasm test metadata";
+    bool isAssembled = KdasmFile::Assemble( "kdasmtest.kdf", kdasmAssembler, random, settings.m_pageBits, metadata, sizeof metadata );
+    KdasmAssert( "File assembly failed", isAssembled );
+    KdasmAssert( "Report is incorrect", kdasmAssembler.GetReport().m_size == report.m_size
+        && kdasmAssembler.GetReport().m_maxCacheMisses == report.m_maxCacheMisses );
+    {
+        KdasmFile kdasmFile;
+        KdasmAssert( "File map failed", kdasmFile.Map( "kdasmtest.kdf" ) );
+        KdasmAssert( "File encoding is incorrect", kdasmFile.GetEncodingSize() == (intptr_t)encoding.size()
+            && ::memcmp( kdasmFile.GetEncoding(), &encoding[0], encoding.size() * sizeof( KdasmEncoding ) ) == 0 );
+        KdasmAssert( "File metadata is incorrect", kdasmFile.GetMetadataSize() == sizeof metadata
+            && ::memcmp( kdasmFile.GetMetadata(), metadata, sizeof metadata ) == 0 );
+
+        KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( (KdasmEncoding*)kdasmFile.GetEncoding(), random );
+        KdasmAssert( "Disassembly failed", disassembly );
+        delete disassembly;
+    }
+    ::remove( "kdasmtest.kdf" );
+
+    // Nowhere to put it.
+    KdasmAssert( "Assembled without output", !kdasmAssembler.Assemble( random, settings.m_pageBits, NullOutput, NULL ) );
+
+    // Budget attempts are copied to the output.
+    options.m_maxSize = (intptr_t)encoding.size() / 2;
+    kdasmAssembler.SetOptions( options );
+    kdasmAssembler.Assemble( random, settings.m_pageBits, encoding );
+    KdasmEncodingBuffer buffer;
+    KdasmAssert( "Over budget", !kdasmAssembler.Assemble( random, settings.m_pageBits, buffer ) );
+    KdasmAssert( "Buffer encoding is incorrect", buffer.Size() == (intptr_t)encoding.size()
+        && ::memcmp( buffer.GetEncoding(), &encoding[0], encoding.size() * sizeof( KdasmEncoding ) ) == 0 );
+    kdasmAssembler.SetOptions( savedOptions );
+
+    printf( "\n%d words\n", (int)encoding.size() );
+    delete random;
+}
+
+void KdasmTest::TestVerifier( KdasmAssembler& kdasmAssembler, KdasmDisassembler& kdasmDisassembler )
+{
+    KdasmVerifier kdasmVerifier;
+
+    // Shared subtrees, packed leaves, leaf ranges, leaf slack with updates, relative
+    // distances and leaves at the root.
+    for( int i=0; i < 7; ++i )
+    {
+        KdasmTestRandomSettings& settings = m_settings[( i == 1 ) ? 5 : 4];
+        printf( "-----\nTest verifier %x option %d.", settings.m_seed, i );
+
+        KdasmAssemblerNode* random = NULL;
+        if( i == 1 )
+        {
+            random = GenerateRandomCopies( settings );
+        }
+        else if( i == 6 )
+        {
+            static const int leafCount = 70000;    // LEAF_COUNT_OVERFLOW
+            random = new KdasmAssemblerNode;
+            random->AddLeaves( leafCount, new KdasmU16[leafCount] );
+            ::memset( random->GetLeaves(), 0, leafCount * sizeof( KdasmU16 ) );
+        }
+        else
+        {
+            random = GenerateRandomNodes( settings );
+        }
+
+        KdasmAssembler::Options options;
+        options.m_shareSubtreesMinNodes = ( i == 1 ) ? 8 : 0;
+        options.m_packLeaves = i == 2;
+        options.m_leafRanges = i == 3;
+        options.m_leafSlack = ( i == 4 ) ? 0.5 : 0.0;
+        options.m_relativeDistance = i == 5;
+        std::vector<KdasmEncoding> encoding;
+        KdasmDisassembler::EncodingStats stats;
+        AssembleAndCheck( kdasmAssembler, kdasmDisassembler, random, settings.m_pageBits, options, encoding, stats );
+
+        if( i == 4 )
+        {
+            KdasmLeafUpdater kdasmLeafUpdater( kdasmAssembler, encoding );
+            for( int j=0; j < 200; ++j )
+            {
+                KdasmAssemblerNode* node = random;
+                std::vector<int> path;
+                while( node->HasSubnodes() )
+                {
+                    int side = node->GetSubnode( 0 ) ? ( node->GetSubnode( 1 ) ? (int)( Rand16() & 1 ) : 0 ) : 1;
+                    node = node->GetSubnode( side );
+                    path.push_back( side );
+                }
+                KdasmU16 leaf = Rand16();
+                KdasmAssert( "Insert failed", kdasmLeafUpdater.InsertLeaves( path, &leaf, 1 ) );
+            }
+        }
+
+        const std::vector<KdasmU16>& leafArray = kdasmAssembler.GetLeafArray();
+        KdasmAssert( "Verification failed", kdasmVerifier.Verify( &encoding[0], (intptr_t)encoding.size(), (intptr_t)leafArray.size() ) );
+        KdasmAssert( "Verification passed without the leaf array", i != 3 || !kdasmVerifier.Verify( &encoding[0], (intptr_t)encoding.size() ) );
+        KdasmAssert( "Truncated encoding verified", !kdasmVerifier.Verify( &encoding[0], KdasmEncodingHeader::HEADER_LENGTH ) );
+
+        kdasmAssembler.SetOptions( KdasmAssembler::Options() );
+        delete random;
+    }
+
+    // Hand made references.
+    KdasmEncoding words[8];
+    ::memset( words, 0, sizeof words );
+    KdasmEncodingHeader header;
+    header.Reset();
+    header.SetPageBits( KdasmEncodingHeader::PAGE_BITS_64B );
+    header.SetDistanceLength( 1 );
+    for( int i=0; i < KdasmEncodingHeader::HEADER_LENGTH; ++i )
+    {
+        words[i].SetRaw( header.GetRaw( i ) );
+    }
+    words[2].SetNomal( KdasmEncoding::NORMAL_OPCODE );
+    words[2].SetOpcode( KdasmEncoding::OPCODE_JUMP );
+    KdasmAssert( "Cycle verified", !kdasmVerifier.Verify( words, 4 ) && kdasmVerifier.GetError() == KdasmVerifier::ERROR_CYCLE );
+
+    words[2].SetOpcode( KdasmEncoding::OPCODE_JUMP_FAR );
+    words[2].SetIsImmediateOffset( true );
+    words[2].SetImmediateOffset( 1 );
+    words[3] = words[2];
+    words[3].SetImmediateOffset( (KdasmU16)-1 );
+    KdasmAssert( "Far cycle verified", !kdasmVerifier.Verify( words, 4 ) && kdasmVerifier.GetError() == KdasmVerifier::ERROR_CYCLE );
+
+    words[2].SetImmediateOffset( 2 );
+    KdasmAssert( "Far reference verified", !kdasmVerifier.Verify( words, 4 ) && kdasmVerifier.GetError() == KdasmVerifier::ERROR_OUT_OF_BOUNDS );
+
+    // As many far words as an intptr_t holds overflow once sign extended.
+    words[2].SetIsImmediateOffset( false );
+    words[2].SetFarWordsCount( (KdasmU16)( sizeof( intptr_t ) / sizeof( KdasmU16 ) ) );
+    words[2].SetFarWordsOffset( 1 );
+    KdasmAssert( "Far offset verified", !kdasmVerifier.Verify( words, 8 ) && kdasmVerifier.GetError() == KdasmVerifier::ERROR_INVALID_WORD );
+
+    words[2].SetRaw( KdasmEncoding::PAD_VALUE );
+    KdasmAssert( "Padding verified", !kdasmVerifier.Verify( words, 4 ) && kdasmVerifier.GetError() == KdasmVerifier::ERROR_INVALID_WORD );
+
+    words[1].SetRaw( 0 );
+    KdasmAssert( "Header verified", !kdasmVerifier.Verify( words, 4 ) && kdasmVerifier.GetError() == KdasmVerifier::ERROR_HEADER );
+
+    // Corrupted encodings are either rejected or can be disassembled.  Each copy is
+    // sized exactly so that reads past the end are caught by memory checkers.
+    KdasmTestRandomSettings& settings = m_settings[4];
+    printf( "-----\nTest verifier %x corruption.", settings.m_seed );
+    KdasmAssemblerNode* random = GenerateRandomNodes( settings );
+    std::vector<KdasmEncoding> encoding;
+    kdasmAssembler.Assemble( random, settings.m_pageBits, encoding );
+
+    static const KdasmU16 leafArray[4] = { 0 };
+    intptr_t rejectedCount = 0;
+    for( int i=0; i < 2000; ++i )
+    {
+        std::vector<KdasmEncoding> corrupted( encoding );
+        for( int j=0; j < 1 + ( i & 3 ); ++j )
+        {
+            corrupted[Rand16() % corrupted.size()].SetRaw( Rand16() );
+        }
+        intptr_t size = ( i % 7 == 0 ) ? (intptr_t)( Rand16() % corrupted.size() ) : (intptr_t)corrupted.size();
+        corrupted.resize( size );
+
+        if( !kdasmVerifier.Verify( corrupted.empty() ? NULL : &corrupted[0], size, 4 ) )
+        {
+            ++rejectedCount;
+            continue;
+        }
+        KdasmAssemblerNode* disassembly = kdasmDisassembler.Disassemble( &corrupted[0], NULL, leafArray );
+        KdasmAssert( "Disassembly failed", disassembly );
+        delete disassembly;
+    }
+    printf( "\n%d of 2000 rejected\n", (int)rejectedCount );
+    delete random;
+}
+
 int main( void )
 {
     printf( "KdasmTest Starting.\n" );
@@ -324,6 +2172,30 @@ int main( void )
     kdasmTest.TestRandom( kdasmAssembler, kdasmDisassembler );
     kdasmTest.TestLeavesAtRoot( kdasmAssembler, kdasmDisassembler );
     kdasmTest.TestVisualizer( kdasmAssembler );
+    kdasmTest.TestPageOrder( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestWeighted( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestMaxMisses( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestLocalSearch( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestOptions( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestExactSearch( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestCostModel( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestMemoryBudget( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestSharedSubtrees( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestSharedLeaves( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestPackedLeaves( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestLeafBits( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestLeafRanges( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestRemapLeaves( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestRelativeDistance( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestBuilder( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestBuilderPages( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestReassemble( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestLeafSlack( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestPatch( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestFile( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestEncodingBuffer( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestAssembleInPlace( kdasmAssembler, kdasmDisassembler );
+    kdasmTest.TestVerifier( kdasmAssembler, kdasmDisassembler );
     printf( "Done.\n" );
 
     return 0;
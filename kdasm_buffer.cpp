@@ -0,0 +1,138 @@
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include <stdlib.h>
+#include "kdasm_buffer.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// KdasmEncodingBuffer
+
+KdasmEncodingBuffer::KdasmEncodingBuffer( void )
+{
+    m_encoding = NULL;
+    m_size = 0;
+    m_allocation = NULL;
+    m_pagesSize = 0;
+    m_isHugePages = false;
+}
+
+bool KdasmEncodingBuffer::Allocate( intptr_t size, HugePages hugePages, bool isPadded )
+{
+    Free();
+    if( size < 0 )
+    {
+        return false;
+    }
+
+    size_t bytes = (size_t)size * sizeof( KdasmEncoding );
+    if( hugePages == HUGE_PAGES_NONE || bytes < (size_t)HUGE_PAGE_SIZE )
+    {
+        // Over allocate to align.
+        m_allocation = ::malloc( bytes + ALIGNMENT );
+        if( !m_allocation )
+        {
+            return false;
+        }
+        m_encoding = (KdasmEncoding*)( ( (size_t)m_allocation + ALIGNMENT ) & ~(size_t)( ALIGNMENT - 1 ) );
+    }
+    else if( !AllocatePages( bytes, hugePages ) )
+    {
+        return false;
+    }
+
+    m_size = size;
+    for( intptr_t i=0; isPadded && i < size; ++i )
+    {
+        m_encoding[i].SetRaw( KdasmEncoding::PAD_VALUE );
+    }
+    return true;
+}
+
+bool KdasmEncodingBuffer::Assign( const KdasmEncoding* encoding, intptr_t size, HugePages hugePages )
+{
+    if( !Allocate( size, hugePages, false ) )
+    {
+        return false;
+    }
+    ::memcpy( m_encoding, encoding, (size_t)size * sizeof( KdasmEncoding ) );
+    return true;
+}
+
+void KdasmEncodingBuffer::Free( void )
+{
+    if( m_allocation )
+    {
+        ::free( m_allocation );
+    }
+    else if( m_pagesSize != 0 )
+    {
+#if defined(_WIN32)
+        ::VirtualFree( m_encoding, 0, MEM_RELEASE );
+#else
+        ::munmap( m_encoding, m_pagesSize );
+#endif
+    }
+    m_encoding = NULL;
+    m_size = 0;
+    m_allocation = NULL;
+    m_pagesSize = 0;
+    m_isHugePages = false;
+}
+
+// Virtual memory pages are aligned well beyond ALIGNMENT.
+bool KdasmEncodingBuffer::AllocatePages( size_t bytes, HugePages hugePages )
+{
+    size_t hugeBytes = ( bytes + HUGE_PAGE_SIZE - 1 ) & ~(size_t)( HUGE_PAGE_SIZE - 1 );
+    void* pages = NULL;
+
+#if defined(_WIN32)
+    // Large pages require the SeLockMemoryPrivilege.  Windows has no transparent huge pages.
+    size_t largePageSize = ::GetLargePageMinimum();
+    if( hugePages == HUGE_PAGES_EXPLICIT && largePageSize != 0 )
+    {
+        size_t largeBytes = ( bytes + largePageSize - 1 ) & ~( largePageSize - 1 );
+        pages = ::VirtualAlloc( NULL, largeBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+        m_isHugePages = pages != NULL;
+    }
+    if( !pages )
+    {
+        pages = ::VirtualAlloc( NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    }
+#else
+#if defined(MAP_HUGETLB)
+    if( hugePages == HUGE_PAGES_EXPLICIT )
+    {
+        pages = ::mmap( NULL, hugeBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+        pages = ( pages == MAP_FAILED ) ? NULL : pages;
+        m_isHugePages = pages != NULL;
+    }
+#endif
+    if( !pages )
+    {
+        pages = ::mmap( NULL, hugeBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        pages = ( pages == MAP_FAILED ) ? NULL : pages;
+#if defined(MADV_HUGEPAGE)
+        if( pages )
+        {
+            ::madvise( pages, hugeBytes, MADV_HUGEPAGE );
+        }
+#endif
+    }
+#endif
+
+    if( !pages )
+    {
+        return false;
+    }
+    m_encoding = (KdasmEncoding*)pages;
+    m_pagesSize = hugeBytes;
+    return true;
+}
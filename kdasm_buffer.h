@@ -0,0 +1,58 @@
+#ifndef KDASM_BUFFER_H
+#define KDASM_BUFFER_H
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include "kdasm.h"
+
+// ----------------------------------------------------------------------------
+// KdasmEncodingBuffer holds an encoding aligned to ALIGNMENT, the largest page size,
+// so that each page of the encoding is within a single cache line or pair of lines.
+// A std::vector<KdasmEncoding> has no such guarantee.  Large encodings may also be
+// put in huge pages to reduce TLB misses.  KdasmAssembler::Assemble() can write to
+// one.  Pass GetEncoding() to the disassembler and to queries.
+
+class KdasmEncodingBuffer
+{
+public:
+    enum {
+        ALIGNMENT           = 128,
+        HUGE_PAGE_SIZE      = 2 * 1024 * 1024   // Smaller buffers do not use huge pages.
+    };
+
+    enum HugePages {
+        HUGE_PAGES_NONE,
+        HUGE_PAGES_TRANSPARENT,     // Asks the operating system to use huge pages where it can.
+        HUGE_PAGES_EXPLICIT         // Reserved huge pages.  Falls back to transparent huge pages.
+    };
+
+    KdasmEncodingBuffer( void );
+    ~KdasmEncodingBuffer( void ) { Free(); }
+
+    // Any previous contents are lost.  The new words are PAD_VALUE unless isPadded is
+    // false, which is for callers that write every word.  Returns false if out of
+    // memory or size is negative.
+    bool Allocate( intptr_t size, HugePages hugePages=HUGE_PAGES_NONE, bool isPadded=true );
+    bool Assign( const KdasmEncoding* encoding, intptr_t size, HugePages hugePages=HUGE_PAGES_NONE );
+    void Free( void );
+
+    KdasmEncoding* GetEncoding( void )              { return m_encoding; }
+    const KdasmEncoding* GetEncoding( void ) const  { return m_encoding; }
+    intptr_t Size( void ) const                     { return m_size; }      // In KdasmU16.
+    bool IsHugePages( void ) const                  { return m_isHugePages; } // Reserved huge pages were used.
+
+private:
+    KdasmEncodingBuffer( const KdasmEncodingBuffer& ); // undefined
+    KdasmEncodingBuffer& operator=( const KdasmEncodingBuffer& ); // undefined
+
+    bool AllocatePages( size_t bytes, HugePages hugePages );
+
+    KdasmEncoding* m_encoding;
+    intptr_t       m_size;
+    void*          m_allocation;    // From malloc, or NULL when m_pagesSize is used.
+    size_t         m_pagesSize;     // Bytes of virtual memory pages allocated directly.
+    bool           m_isHugePages;
+};
+
+#endif // KDASM_BUFFER_H
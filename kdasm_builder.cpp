@@ -0,0 +1,597 @@
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include <algorithm>
+#include "kdasm_builder.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// KdasmBuilder
+
+KdasmBuilder::Options::Options( void )
+{
+    m_heuristic = HEURISTIC_SAH;
+    m_maxLeafSize = 4;
+    m_maxDepth = 48;
+    m_traversalCost = 1.0f;
+    m_intersectionCost = 1.5f;
+    m_pageMissCost = 0.5f;
+    m_pageBits = KdasmEncodingHeader::PAGE_BITS_64B;
+    m_pageAware = false;
+    m_relativeDistance = false;
+    m_binningMinSize = 4096;
+    m_binCount = 64;
+    m_threadCount = 0;
+}
+
+KdasmBuilder::KdasmBuilder( void )
+{
+    ::memset( &m_report, 0, sizeof m_report );
+    m_boxes = NULL;
+    m_boxCount = 0;
+}
+
+KdasmAssemblerNode* KdasmBuilder::Build( const Box* boxes, intptr_t boxCount )
+{
+    KdasmAssert( "Box count out of range", boxCount >= 0 && (KdasmU64)boxCount <= 0xffffffffull );
+
+    ::memset( &m_report, 0, sizeof m_report );
+    m_boxes = boxes;
+    m_boxCount = boxCount;
+
+    std::vector<Task> tasks( 1 );
+    Task& root = tasks.front();
+    for( int i=0; i < 3; ++i )
+    {
+        root.m_cell.m_min[i] = 0.0f;
+        root.m_cell.m_max[i] = 1.0f;
+    }
+    root.m_depth = 0;
+    root.m_pageWordsFree = GetPageWords() - KdasmEncodingHeader::HEADER_LENGTH;
+    root.m_slot = 0;
+    root.m_isFinal = false;
+    root.m_indices.reserve( boxCount );
+    for( intptr_t i=0; i < boxCount; ++i )
+    {
+        for( int j=0; j < 3; ++j )
+        {
+            KdasmAssert( "Box min is greater than max", boxes[i].m_min[j] <= boxes[i].m_max[j] );
+        }
+        root.m_indices.push_back( (KdasmU32)i );
+    }
+
+    // Split the largest task until there are enough to keep the threads busy.  The
+    // splits are the same ones BuildNode() would make.
+    int threadCount = GetThreadCount();
+    intptr_t taskCountMin = ( threadCount > 1 ) ? (intptr_t)threadCount * 8 : 1;
+    std::vector<KdasmAssemblerNode*> slots( 1, (KdasmAssemblerNode*)NULL );
+    std::vector<Branch> branches;
+    Context context;
+    while( (intptr_t)tasks.size() < taskCountMin )
+    {
+        intptr_t largest = -1;
+        for( intptr_t i=0; i < (intptr_t)tasks.size(); ++i )
+        {
+            const Task& task = tasks[i];
+            if( !task.m_isFinal && (intptr_t)task.m_indices.size() > m_options.m_maxLeafSize && task.m_depth < m_options.m_maxDepth
+                && ( largest < 0 || task.m_indices.size() > tasks[largest].m_indices.size() ) )
+            {
+                largest = i;
+            }
+        }
+        if( largest < 0 )
+        {
+            break;
+        }
+
+        Task& task = tasks[largest];
+        Branch branch;
+        if( !FindSplit( task.m_cell, task.m_indices, task.m_depth, task.m_pageWordsFree, branch.m_split, context ) )
+        {
+            task.m_isFinal = true;
+            continue;
+        }
+
+        KdasmCell lessCell, greaterCell;
+        SplitCell( task.m_cell, branch.m_split.m_normal, branch.m_split.m_distance, &lessCell, &greaterCell );
+        std::vector<KdasmU32> lessIndices;
+        std::vector<KdasmU32> greaterIndices;
+        PartitionSplit( branch.m_split, lessCell, greaterCell, task.m_indices, lessIndices, greaterIndices );
+        intptr_t lessWordsFree, greaterWordsFree;
+        SplitPageWords( task.m_pageWordsFree, (intptr_t)lessIndices.size(), (intptr_t)greaterIndices.size(), lessWordsFree, greaterWordsFree );
+
+        branch.m_slot = task.m_slot;
+        branch.m_lessSlot = (intptr_t)slots.size();
+        branch.m_greaterSlot = (intptr_t)slots.size() + 1;
+        branches.push_back( branch );
+        slots.resize( slots.size() + 2, NULL );
+
+        task.m_cell = lessCell;
+        task.m_indices.swap( lessIndices );
+        ++task.m_depth;
+        task.m_pageWordsFree = lessWordsFree;
+        task.m_slot = branch.m_lessSlot;
+
+        Task greater;
+        greater.m_cell = greaterCell;
+        greater.m_depth = task.m_depth;
+        greater.m_pageWordsFree = greaterWordsFree;
+        greater.m_slot = branch.m_greaterSlot;
+        greater.m_isFinal = false;
+        tasks.push_back( greater );
+        tasks.back().m_indices.swap( greaterIndices );
+    }
+
+    int taskCount = (int)tasks.size();
+#ifdef _OPENMP
+#pragma omp parallel for schedule( dynamic, 1 ) num_threads( threadCount )
+#endif
+    for( int i=0; i < taskCount; ++i )
+    {
+        Context taskContext;
+        ::memset( &taskContext.m_report, 0, sizeof taskContext.m_report );
+        slots[tasks[i].m_slot] = BuildNode( tasks[i].m_cell, tasks[i].m_indices, tasks[i].m_depth, tasks[i].m_pageWordsFree, taskContext );
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        AddReport( m_report, taskContext.m_report );
+    }
+
+    // Subtrees are created after the branches above them.
+    for( intptr_t i=(intptr_t)branches.size(); i--; /**/ )
+    {
+        const Branch& branch = branches[i];
+        KdasmAssemblerNode* node = new KdasmAssemblerNode();
+        node->AddSubnodes( branch.m_split.m_distance, branch.m_split.m_normal, slots[branch.m_lessSlot], slots[branch.m_greaterSlot] );
+        slots[branch.m_slot] = node;
+        ++m_report.m_nodeCount;
+    }
+    m_report.m_taskCount = taskCount;
+
+    m_boxes = NULL;
+    m_boxCount = 0;
+    return slots[0];
+}
+
+KdasmAssemblerNode* KdasmBuilder::BuildPoints( const float* points, intptr_t pointCount )
+{
+    std::vector<Box> boxes( pointCount );
+    for( intptr_t i=0; i < pointCount; ++i )
+    {
+        for( int j=0; j < 3; ++j )
+        {
+            boxes[i].m_min[j] = points[i * 3 + j];
+            boxes[i].m_max[j] = points[i * 3 + j];
+        }
+    }
+    return Build( boxes.empty() ? NULL : &boxes[0], pointCount );
+}
+
+KdasmAssemblerNode* KdasmBuilder::BuildNode( const KdasmCell& cell, std::vector<KdasmU32>& indices, intptr_t depth, intptr_t pageWordsFree, Context& context )
+{
+    if( (intptr_t)indices.size() <= m_options.m_maxLeafSize || depth >= m_options.m_maxDepth )
+    {
+        return BuildLeaf( indices, context );
+    }
+
+    Split split;
+    if( !FindSplit( cell, indices, depth, pageWordsFree, split, context ) )
+    {
+        return BuildLeaf( indices, context );
+    }
+
+    KdasmCell lessCell, greaterCell;
+    SplitCell( cell, split.m_normal, split.m_distance, &lessCell, &greaterCell );
+    std::vector<KdasmU32> lessIndices;
+    std::vector<KdasmU32> greaterIndices;
+    PartitionSplit( split, lessCell, greaterCell, indices, lessIndices, greaterIndices );
+    std::vector<KdasmU32>().swap( indices );
+    intptr_t lessWordsFree, greaterWordsFree;
+    SplitPageWords( pageWordsFree, (intptr_t)lessIndices.size(), (intptr_t)greaterIndices.size(), lessWordsFree, greaterWordsFree );
+
+    KdasmAssemblerNode* less = BuildNode( lessCell, lessIndices, depth + 1, lessWordsFree, context );
+    KdasmAssemblerNode* greater = BuildNode( greaterCell, greaterIndices, depth + 1, greaterWordsFree, context );
+
+    KdasmAssemblerNode* node = new KdasmAssemblerNode();
+    node->AddSubnodes( split.m_distance, split.m_normal, less, greater );
+    ++context.m_report.m_nodeCount;
+    return node;
+}
+
+KdasmAssemblerNode* KdasmBuilder::BuildLeaf( const std::vector<KdasmU32>& indices, Context& context )
+{
+    KdasmAssemblerNode* node = new KdasmAssemblerNode();
+    ++context.m_report.m_nodeCount;
+    if( indices.empty() )
+    {
+        return node;
+    }
+
+    intptr_t leafCount = (intptr_t)indices.size();
+    if( m_boxCount <= 0x10000 )
+    {
+        KdasmU16* leaves = new KdasmU16[leafCount];
+        for( intptr_t i=0; i < leafCount; ++i )
+        {
+            leaves[i] = (KdasmU16)indices[i];
+        }
+        node->AddLeaves( leafCount, leaves );
+    }
+    else
+    {
+        node->AddLeaves( leafCount, &indices[0] );
+    }
+
+    ++context.m_report.m_leafNodeCount;
+    context.m_report.m_leafReferences += leafCount;
+    return node;
+}
+
+bool KdasmBuilder::FindSplit( const KdasmCell& cell, const std::vector<KdasmU32>& indices, intptr_t depth, intptr_t pageWordsFree, Split& split, Context& context )
+{
+    if( m_options.m_heuristic == HEURISTIC_MEDIAN )
+    {
+        return FindSplitMedian( cell, indices, split, context );
+    }
+    if( (intptr_t)indices.size() >= m_options.m_binningMinSize )
+    {
+        return FindSplitBinned( cell, indices, depth, pageWordsFree, split );
+    }
+    return FindSplitSah( cell, indices, depth, pageWordsFree, split, context );
+}
+
+// Boxes touching the quantized plane go on both sides.
+void KdasmBuilder::PartitionSplit( const Split& split, const KdasmCell& lessCell, const KdasmCell& greaterCell, const std::vector<KdasmU32>& indices,
+                                   std::vector<KdasmU32>& lessIndices, std::vector<KdasmU32>& greaterIndices )
+{
+    for( size_t i=0; i < indices.size(); ++i )
+    {
+        const Box& box = m_boxes[indices[i]];
+        if( box.m_min[split.m_normal] <= lessCell.m_max[split.m_normal] )
+        {
+            lessIndices.push_back( indices[i] );
+        }
+        if( box.m_max[split.m_normal] >= greaterCell.m_min[split.m_normal] )
+        {
+            greaterIndices.push_back( indices[i] );
+        }
+    }
+    KdasmAssertInternal( lessIndices.size() < indices.size() && greaterIndices.size() < indices.size() );
+}
+
+// Tries the planes just outside of each box edge on each axis.
+bool KdasmBuilder::FindSplitSah( const KdasmCell& cell, const std::vector<KdasmU32>& indices, intptr_t depth, intptr_t pageWordsFree, Split& split, Context& context )
+{
+    intptr_t count = (intptr_t)indices.size();
+    split.m_cost = m_options.m_intersectionCost * (float)count; // The cost of a leaf.
+    bool isSplit = false;
+
+    std::vector<KdasmU16>& distances = context.m_distances;
+    for( KdasmU16 normal=0; normal < 3; ++normal )
+    {
+        context.m_sortedMin.clear();
+        context.m_sortedMax.clear();
+        distances.clear();
+        for( intptr_t i=0; i < count; ++i )
+        {
+            const Box& box = m_boxes[indices[i]];
+            context.m_sortedMin.push_back( box.m_min[normal] );
+            context.m_sortedMax.push_back( box.m_max[normal] );
+
+            KdasmU16 distance;
+            if( SnapAbove( cell, normal, box.m_max[normal], distance ) )
+            {
+                distances.push_back( distance );
+            }
+            if( SnapBelow( cell, normal, box.m_min[normal], distance ) )
+            {
+                distances.push_back( distance );
+            }
+        }
+        std::sort( context.m_sortedMin.begin(), context.m_sortedMin.end() );
+        std::sort( context.m_sortedMax.begin(), context.m_sortedMax.end() );
+        std::sort( distances.begin(), distances.end() );
+        distances.erase( std::unique( distances.begin(), distances.end() ), distances.end() );
+
+        for( size_t i=0; i < distances.size(); ++i )
+        {
+            intptr_t lessCount, greaterCount;
+            CountSplit( cell, normal, distances[i], lessCount, greaterCount, context );
+            TrySplit( cell, normal, distances[i], lessCount, greaterCount, count, depth, pageWordsFree, split, isSplit );
+        }
+    }
+    return isSplit;
+}
+
+// Tries m_binCount evenly spaced planes on each axis.  The boxes are counted into
+// the bins between the planes in parallel.
+bool KdasmBuilder::FindSplitBinned( const KdasmCell& cell, const std::vector<KdasmU32>& indices, intptr_t depth, intptr_t pageWordsFree, Split& split )
+{
+    intptr_t count = (intptr_t)indices.size();
+    split.m_cost = m_options.m_intersectionCost * (float)count;
+    bool isSplit = false;
+
+    std::vector<KdasmU16> distances;
+    std::vector<float> lessMax;
+    std::vector<float> greaterMin;
+    std::vector<intptr_t> lessBins;
+    std::vector<intptr_t> greaterBins;
+    for( KdasmU16 normal=0; normal < 3; ++normal )
+    {
+        distances.clear();
+        for( intptr_t i=1; i < m_options.m_binCount; ++i )
+        {
+            float d = cell.m_min[normal] + ( cell.m_max[normal] - cell.m_min[normal] ) * ( (float)i / (float)m_options.m_binCount );
+            distances.push_back( PackDistance( cell, normal, d ) );
+        }
+        std::sort( distances.begin(), distances.end() );
+        distances.erase( std::unique( distances.begin(), distances.end() ), distances.end() );
+
+        // Both sides of the planes are in increasing order.
+        intptr_t distanceCount = (intptr_t)distances.size();
+        lessMax.resize( distanceCount );
+        greaterMin.resize( distanceCount );
+        for( intptr_t i=0; i < distanceCount; ++i )
+        {
+            KdasmCell lessCell, greaterCell;
+            SplitCell( cell, normal, distances[i], &lessCell, &greaterCell );
+            lessMax[i] = lessCell.m_max[normal];
+            greaterMin[i] = greaterCell.m_min[normal];
+        }
+
+        // A box is on the less side of the planes from the one in its less bin on, and
+        // on the greater side of the planes before the one in its greater bin.
+        lessBins.assign( distanceCount + 1, 0 );
+        greaterBins.assign( distanceCount + 1, 0 );
+        int boxCount = (int)count;
+#ifdef _OPENMP
+        int threadCount = GetThreadCount();
+#pragma omp parallel num_threads( threadCount )
+#endif
+        {
+            std::vector<intptr_t> threadLessBins( distanceCount + 1, 0 );
+            std::vector<intptr_t> threadGreaterBins( distanceCount + 1, 0 );
+#ifdef _OPENMP
+#pragma omp for
+#endif
+            for( int i=0; i < boxCount; ++i )
+            {
+                const Box& box = m_boxes[indices[i]];
+                ++threadLessBins[std::lower_bound( lessMax.begin(), lessMax.end(), box.m_min[normal] ) - lessMax.begin()];
+                ++threadGreaterBins[std::upper_bound( greaterMin.begin(), greaterMin.end(), box.m_max[normal] ) - greaterMin.begin()];
+            }
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            for( intptr_t i=0; i <= distanceCount; ++i )
+            {
+                lessBins[i] += threadLessBins[i];
+                greaterBins[i] += threadGreaterBins[i];
+            }
+        }
+
+        intptr_t lessCount = 0;
+        intptr_t greaterCount = count;
+        for( intptr_t i=0; i < distanceCount; ++i )
+        {
+            lessCount += lessBins[i];
+            greaterCount -= greaterBins[i];
+            TrySplit( cell, normal, distances[i], lessCount, greaterCount, count, depth, pageWordsFree, split, isSplit );
+        }
+    }
+    return isSplit;
+}
+
+// Splits the longest axis that separates the boxes at the median of their centers.
+bool KdasmBuilder::FindSplitMedian( const KdasmCell& cell, const std::vector<KdasmU32>& indices, Split& split, Context& context )
+{
+    intptr_t count = (intptr_t)indices.size();
+    KdasmU16 normals[3] = { 0, 1, 2 };
+    for( int i=0; i < 3; ++i )
+    {
+        for( int j=i + 1; j < 3; ++j )
+        {
+            if( ( cell.m_max[normals[j]] - cell.m_min[normals[j]] ) > ( cell.m_max[normals[i]] - cell.m_min[normals[i]] ) )
+            {
+                std::swap( normals[i], normals[j] );
+            }
+        }
+    }
+
+    std::vector<float> centers;
+    for( int i=0; i < 3; ++i )
+    {
+        KdasmU16 normal = normals[i];
+        context.m_sortedMin.clear();
+        context.m_sortedMax.clear();
+        centers.clear();
+        for( intptr_t j=0; j < count; ++j )
+        {
+            const Box& box = m_boxes[indices[j]];
+            context.m_sortedMin.push_back( box.m_min[normal] );
+            context.m_sortedMax.push_back( box.m_max[normal] );
+            centers.push_back( 0.5f * ( box.m_min[normal] + box.m_max[normal] ) );
+        }
+        std::sort( context.m_sortedMin.begin(), context.m_sortedMin.end() );
+        std::sort( context.m_sortedMax.begin(), context.m_sortedMax.end() );
+        std::nth_element( centers.begin(), centers.begin() + count / 2, centers.end() );
+
+        KdasmU16 distance = PackDistance( cell, normal, centers[count / 2] );
+        intptr_t lessCount, greaterCount;
+        CountSplit( cell, normal, distance, lessCount, greaterCount, context );
+        if( lessCount < count && greaterCount < count )
+        {
+            split.m_normal = normal;
+            split.m_distance = distance;
+            split.m_cost = 0.0f;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Requires m_sortedMin and m_sortedMax to hold the box extents along normal.
+void KdasmBuilder::CountSplit( const KdasmCell& cell, KdasmU16 normal, KdasmU16 distance, intptr_t& lessCount, intptr_t& greaterCount, Context& context )
+{
+    KdasmCell lessCell, greaterCell;
+    SplitCell( cell, normal, distance, &lessCell, &greaterCell );
+    lessCount = std::upper_bound( context.m_sortedMin.begin(), context.m_sortedMin.end(), lessCell.m_max[normal] ) - context.m_sortedMin.begin();
+    greaterCount = context.m_sortedMax.end() - std::lower_bound( context.m_sortedMax.begin(), context.m_sortedMax.end(), greaterCell.m_min[normal] );
+}
+
+// Keeps the split if it separates the boxes for less than the cost so far.  A page
+// holds about m_pageBits - 2 levels of the tree, so a plane that starts a new page
+// also costs a cache-miss.  That favors filling the pages already started.  With
+// m_pageAware the cache-miss is charged to a split that no longer fits the words
+// left in the page when the node would fit in a page as a leaf instead.
+void KdasmBuilder::TrySplit( const KdasmCell& cell, KdasmU16 normal, KdasmU16 distance, intptr_t lessCount, intptr_t greaterCount,
+                             intptr_t count, intptr_t depth, intptr_t pageWordsFree, Split& split, bool& isSplit )
+{
+    if( lessCount >= count || greaterCount >= count )
+    {
+        return;
+    }
+
+    KdasmCell lessCell, greaterCell;
+    SplitCell( cell, normal, distance, &lessCell, &greaterCell );
+    float area = CalculateArea( cell );
+    float weighted = ( area > 0.0f )
+        ? ( CalculateArea( lessCell ) * (float)lessCount + CalculateArea( greaterCell ) * (float)greaterCount ) / area
+        : 0.5f * (float)( lessCount + greaterCount );
+
+    float cost = m_options.m_traversalCost + m_options.m_intersectionCost * weighted;
+    if( m_options.m_pageAware )
+    {
+        // A leaf takes a word plus its leaves.  The split takes one more word.
+        intptr_t leafWords = ( m_boxCount <= 0x10000 ) ? 1 : 2;
+        if( count * leafWords + 1 <= GetPageWords() && ( lessCount + greaterCount ) * leafWords + 3 > pageWordsFree )
+        {
+            cost += m_options.m_pageMissCost;
+        }
+    }
+    else
+    {
+        intptr_t pageLevels = std::max( (intptr_t)m_options.m_pageBits - 2, (intptr_t)1 );
+        if( depth > 0 && ( depth % pageLevels ) == 0 )
+        {
+            cost += m_options.m_pageMissCost;
+        }
+    }
+
+    if( cost < split.m_cost )
+    {
+        split.m_normal = normal;
+        split.m_distance = distance;
+        split.m_cost = cost;
+        isSplit = true;
+    }
+}
+
+// The words left after the cutting plane are shared by the number of boxes on each
+// side.  A side without room for a leaf starts a new page.
+void KdasmBuilder::SplitPageWords( intptr_t pageWordsFree, intptr_t lessCount, intptr_t greaterCount, intptr_t& lessWordsFree, intptr_t& greaterWordsFree ) const
+{
+    intptr_t wordsFree = std::max( pageWordsFree - 1, (intptr_t)0 );
+    lessWordsFree = wordsFree * lessCount / std::max( lessCount + greaterCount, (intptr_t)1 );
+    greaterWordsFree = wordsFree - lessWordsFree;
+    if( lessWordsFree < 2 )
+    {
+        lessWordsFree = GetPageWords();
+    }
+    if( greaterWordsFree < 2 )
+    {
+        greaterWordsFree = GetPageWords();
+    }
+}
+
+// Uses the same arithmetic as the runtime so that the cells match exactly.
+void KdasmBuilder::SplitCell( const KdasmCell& cell, KdasmU16 normal, KdasmU16 distance, KdasmCell* less, KdasmCell* greater ) const
+{
+    if( m_options.m_relativeDistance )
+    {
+        cell.Split( normal, distance, less, greater );
+    }
+    else
+    {
+        cell.SplitAbsolute( normal, distance, less, greater );
+    }
+}
+
+KdasmU16 KdasmBuilder::PackDistance( const KdasmCell& cell, KdasmU16 normal, float d ) const
+{
+    if( m_options.m_relativeDistance )
+    {
+        return KdasmEncoding::PackDistanceRelative( d, cell.m_min[normal], cell.m_max[normal] );
+    }
+    return KdasmEncoding::PackDistanceImmediate( d );
+}
+
+// The first plane with all of its width above d.  PackDistance() truncates so only
+// a few steps are needed.
+bool KdasmBuilder::SnapAbove( const KdasmCell& cell, KdasmU16 normal, float d, KdasmU16& distance ) const
+{
+    intptr_t x = PackDistance( cell, normal, d );
+    for( int i=0; i < 3 && x < (intptr_t)KdasmEncoding::DISTANCE_IMMEDIATE_MAX; ++i )
+    {
+        KdasmCell less, greater;
+        SplitCell( cell, normal, (KdasmU16)x, &less, &greater );
+        if( greater.m_min[normal] > d )
+        {
+            distance = (KdasmU16)x;
+            return true;
+        }
+        x += KdasmEncoding::DISTANCE_IMMEDIATE_PLANE_WIDTH;
+    }
+    return false;
+}
+
+// The last plane with all of its width below d.
+bool KdasmBuilder::SnapBelow( const KdasmCell& cell, KdasmU16 normal, float d, KdasmU16& distance ) const
+{
+    intptr_t x = PackDistance( cell, normal, d );
+    for( int i=0; i < 3 && x >= 0; ++i )
+    {
+        KdasmCell less, greater;
+        SplitCell( cell, normal, (KdasmU16)x, &less, &greater );
+        if( less.m_max[normal] < d )
+        {
+            distance = (KdasmU16)x;
+            return true;
+        }
+        x -= KdasmEncoding::DISTANCE_IMMEDIATE_PLANE_WIDTH;
+    }
+    return false;
+}
+
+int KdasmBuilder::GetThreadCount( void ) const
+{
+#ifdef _OPENMP
+    return ( m_options.m_threadCount > 0 ) ? m_options.m_threadCount : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+intptr_t KdasmBuilder::GetPageWords( void ) const
+{
+    return ( (intptr_t)1 << m_options.m_pageBits ) / (intptr_t)sizeof( KdasmU16 );
+}
+
+float KdasmBuilder::CalculateArea( const KdasmCell& cell )
+{
+    float dx = cell.m_max[0] - cell.m_min[0];
+    float dy = cell.m_max[1] - cell.m_min[1];
+    float dz = cell.m_max[2] - cell.m_min[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+void KdasmBuilder::AddReport( Report& report, const Report& x )
+{
+    report.m_nodeCount += x.m_nodeCount;
+    report.m_leafNodeCount += x.m_leafNodeCount;
+    report.m_leafReferences += x.m_leafReferences;
+}
@@ -0,0 +1,151 @@
+#ifndef KDASM_BUILDER_H
+#define KDASM_BUILDER_H
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include <vector>
+
+#include "kdasm_assembler.h"
+
+// ----------------------------------------------------------------------------
+// KdasmBuilder
+//
+// Builds a KdasmAssemblerNode tree for the assembler from boxes with float
+// coordinates in [0..1].  The cutting planes are quantized while building with a
+// distance length of 1.  A box is referenced from every leaf whose cell it overlaps,
+// including the width of each quantized plane, so none are lost.  The candidate
+// planes are snapped to the grid just outside the box edges so that the box ends up
+// on one side only.  Leaves hold the index of each box.
+//
+// Runs in parallel when compiled with OpenMP.  The top levels are split one at a
+// time with the boxes binned in parallel, then the remaining subtrees are built as
+// independent tasks.  The tree does not depend on the number of threads.
+//
+// With Options::m_pageAware the words left in the current page are estimated while
+// splitting.  A node that fits in a page as a leaf only splits past the end of the
+// current page if that is worth m_pageMissCost.  Small subtrees that would cross a
+// page become leaves, reducing the cache-misses per-leaf reported by CalculateStats().
+
+class KdasmBuilder
+{
+public:
+    enum Heuristic
+    {
+        HEURISTIC_SAH,      // Surface area heuristic over the snapped box edges.
+        HEURISTIC_MEDIAN    // Median of the box centers along the longest axis.
+    };
+
+    struct Options
+    {
+        Options( void );
+
+        Heuristic m_heuristic;
+        intptr_t  m_maxLeafSize;            // Boxes in a leaf before it is split.
+        intptr_t  m_maxDepth;
+        float     m_traversalCost;          // Surface area heuristic cost of a cutting plane.
+        float     m_intersectionCost;       // Surface area heuristic cost of a box.
+        float     m_pageMissCost;           // Added to a cutting plane that starts a new page.
+        KdasmEncodingHeader::PageBits m_pageBits; // Page size the tree will be assembled with.
+        bool      m_pageAware;              // Estimates the words left in each page while splitting.
+        bool      m_relativeDistance;       // Matches KdasmAssembler::Options::m_relativeDistance.
+        intptr_t  m_binningMinSize;         // Nodes with this many boxes use binned SAH.
+        intptr_t  m_binCount;               // Candidate planes per axis when binning.
+        int       m_threadCount;            // 0 uses all of them.  Ignored without OpenMP.
+    };
+
+    struct Report
+    {
+        intptr_t m_nodeCount;
+        intptr_t m_leafNodeCount;
+        intptr_t m_leafReferences;          // Box indices stored in all the leaves.
+        intptr_t m_taskCount;               // Subtrees built in parallel.
+    };
+
+    struct Box
+    {
+        float m_min[3];
+        float m_max[3];
+    };
+
+    KdasmBuilder( void );
+
+    void SetOptions( const Options& options ) { m_options = options; }
+    const Options& GetOptions( void ) const   { return m_options; }
+    const Report& GetReport( void ) const     { return m_report; }
+
+    // Returns a tree to be deleted by the caller.  Leaves are KdasmU32 when there are
+    // more than 0x10000 boxes.
+    KdasmAssemblerNode* Build( const Box* boxes, intptr_t boxCount );
+
+    // Points are x, y, z triples.
+    KdasmAssemblerNode* BuildPoints( const float* points, intptr_t pointCount );
+
+private:
+    struct Split
+    {
+        KdasmU16 m_normal;
+        KdasmU16 m_distance;
+        float    m_cost;
+    };
+
+    // Scratch space and counts for one thread.
+    struct Context
+    {
+        std::vector<float>    m_sortedMin;
+        std::vector<float>    m_sortedMax;
+        std::vector<KdasmU16> m_distances;
+        Report                m_report;
+    };
+
+    // A subtree waiting to be built.
+    struct Task
+    {
+        KdasmCell             m_cell;
+        std::vector<KdasmU32> m_indices;
+        intptr_t              m_depth;
+        intptr_t              m_pageWordsFree;
+        intptr_t              m_slot;       // Where the subtree goes once built.
+        bool                  m_isFinal;    // Failed to split.
+    };
+
+    // A cutting plane above the tasks.  Created once its subtrees are built.
+    struct Branch
+    {
+        Split                 m_split;
+        intptr_t              m_slot;
+        intptr_t              m_lessSlot;
+        intptr_t              m_greaterSlot;
+    };
+
+    KdasmAssemblerNode* BuildNode( const KdasmCell& cell, std::vector<KdasmU32>& indices, intptr_t depth, intptr_t pageWordsFree, Context& context );
+    KdasmAssemblerNode* BuildLeaf( const std::vector<KdasmU32>& indices, Context& context );
+    bool FindSplit( const KdasmCell& cell, const std::vector<KdasmU32>& indices, intptr_t depth, intptr_t pageWordsFree, Split& split, Context& context );
+    void PartitionSplit( const Split& split, const KdasmCell& lessCell, const KdasmCell& greaterCell, const std::vector<KdasmU32>& indices,
+                         std::vector<KdasmU32>& lessIndices, std::vector<KdasmU32>& greaterIndices );
+
+    bool FindSplitSah( const KdasmCell& cell, const std::vector<KdasmU32>& indices, intptr_t depth, intptr_t pageWordsFree, Split& split, Context& context );
+    bool FindSplitBinned( const KdasmCell& cell, const std::vector<KdasmU32>& indices, intptr_t depth, intptr_t pageWordsFree, Split& split );
+    bool FindSplitMedian( const KdasmCell& cell, const std::vector<KdasmU32>& indices, Split& split, Context& context );
+    void CountSplit( const KdasmCell& cell, KdasmU16 normal, KdasmU16 distance, intptr_t& lessCount, intptr_t& greaterCount, Context& context );
+    void TrySplit( const KdasmCell& cell, KdasmU16 normal, KdasmU16 distance, intptr_t lessCount, intptr_t greaterCount,
+                   intptr_t count, intptr_t depth, intptr_t pageWordsFree, Split& split, bool& isSplit );
+    void SplitPageWords( intptr_t pageWordsFree, intptr_t lessCount, intptr_t greaterCount, intptr_t& lessWordsFree, intptr_t& greaterWordsFree ) const;
+
+    void SplitCell( const KdasmCell& cell, KdasmU16 normal, KdasmU16 distance, KdasmCell* less, KdasmCell* greater ) const;
+    KdasmU16 PackDistance( const KdasmCell& cell, KdasmU16 normal, float d ) const;
+    bool SnapAbove( const KdasmCell& cell, KdasmU16 normal, float d, KdasmU16& distance ) const;
+    bool SnapBelow( const KdasmCell& cell, KdasmU16 normal, float d, KdasmU16& distance ) const;
+    int GetThreadCount( void ) const;
+    intptr_t GetPageWords( void ) const;
+
+    static float CalculateArea( const KdasmCell& cell );
+    static void AddReport( Report& report, const Report& x );
+
+    Options             m_options;
+    Report              m_report;
+    const Box*          m_boxes;
+    intptr_t            m_boxCount;
+};
+
+#endif // KDASM_BUILDER_H
@@ -0,0 +1,330 @@
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include <stdio.h>
+#include "kdasm_file.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// KdasmFile
+
+KdasmFile::KdasmFile( void )
+{
+    m_encoding = NULL;
+    m_encodingSize = 0;
+    m_pageCount = 0;
+    m_alignment = 0;
+    m_metadata = NULL;
+    m_metadataSize = 0;
+    m_mapping = NULL;
+    m_mappingSize = 0;
+#if defined(_WIN32)
+    m_fileHandle = INVALID_HANDLE_VALUE;
+    m_mappingHandle = NULL;
+#endif
+}
+
+bool KdasmFile::Write( const char* path, const KdasmEncoding* encoding, intptr_t encodingSize,
+                       const void* metadata, intptr_t metadataSize, intptr_t alignment )
+{
+    const KdasmEncodingHeader* encodingHeader = (const KdasmEncodingHeader*)encoding;
+    KdasmAssert( "Version Incorrect", encodingSize >= KdasmEncodingHeader::HEADER_LENGTH && encodingHeader->VersionCheck() );
+
+    KdasmU16 header[HEADER_LENGTH];
+    KdasmU64 metadataOffset = sizeof header;
+    KdasmU64 encodingOffset = BuildHeader( header, encodingSize, (intptr_t)1 << encodingHeader->GetPageBits(), metadataSize, alignment );
+
+    FILE* f = ::fopen( path, "wb" );
+    if( !f )
+    {
+        return false;
+    }
+
+    bool isOk = ::fwrite( header, sizeof header, 1, f ) == 1;
+    if( isOk && metadataSize > 0 )
+    {
+        isOk = ::fwrite( metadata, (size_t)metadataSize, 1, f ) == 1;
+    }
+    for( KdasmU64 i = metadataOffset + (KdasmU64)metadataSize; isOk && i < encodingOffset; ++i )
+    {
+        isOk = ::fputc( 0, f ) != EOF;
+    }
+    if( isOk )
+    {
+        isOk = ::fwrite( encoding, sizeof( KdasmEncoding ), (size_t)encodingSize, f ) == (size_t)encodingSize;
+    }
+    isOk = ( ::fclose( f ) == 0 ) && isOk;
+    return isOk;
+}
+
+bool KdasmFile::Assemble( const char* path, KdasmAssembler& assembler, KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits,
+                          const void* metadata, intptr_t metadataSize, intptr_t alignment )
+{
+    FileOutput fileOutput;
+    fileOutput.m_path = path;
+    fileOutput.m_pageBits = pageBits;
+    fileOutput.m_metadata = metadata;
+    fileOutput.m_metadataSize = metadataSize;
+    fileOutput.m_alignment = alignment;
+    fileOutput.m_mapping = NULL;
+    fileOutput.m_mappingSize = 0;
+
+    bool isOk = assembler.Assemble( root, pageBits, OutputToFile, &fileOutput );
+
+    if( fileOutput.m_mapping )
+    {
+#if defined(_WIN32)
+        ::UnmapViewOfFile( fileOutput.m_mapping );
+#else
+        ::munmap( fileOutput.m_mapping, (size_t)fileOutput.m_mappingSize );
+#endif
+    }
+    return isOk;
+}
+
+bool KdasmFile::Map( const char* path )
+{
+    Unmap();
+
+#if defined(_WIN32)
+    m_fileHandle = ::CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    if( m_fileHandle == INVALID_HANDLE_VALUE )
+    {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if( !::GetFileSizeEx( (HANDLE)m_fileHandle, &fileSize ) || (KdasmU64)fileSize.QuadPart < sizeof( KdasmU16 ) * HEADER_LENGTH
+        || (KdasmU64)fileSize.QuadPart != (KdasmU64)(size_t)fileSize.QuadPart )
+    {
+        Unmap();
+        return false;
+    }
+    m_mappingSize = (KdasmU64)fileSize.QuadPart;
+    m_mappingHandle = ::CreateFileMappingA( (HANDLE)m_fileHandle, NULL, PAGE_READONLY, 0, 0, NULL );
+    m_mapping = m_mappingHandle ? ::MapViewOfFile( (HANDLE)m_mappingHandle, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+    if( !m_mapping )
+    {
+        Unmap();
+        return false;
+    }
+#else
+    int fd = ::open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        return false;
+    }
+    struct stat st;
+    if( ::fstat( fd, &st ) != 0 || (KdasmU64)st.st_size < sizeof( KdasmU16 ) * HEADER_LENGTH
+        || (KdasmU64)st.st_size != (KdasmU64)(size_t)st.st_size )
+    {
+        ::close( fd );
+        return false;
+    }
+    m_mappingSize = (KdasmU64)st.st_size;
+    m_mapping = ::mmap( NULL, (size_t)m_mappingSize, PROT_READ, MAP_SHARED, fd, 0 );
+    ::close( fd ); // The mapping keeps the file open.
+    if( m_mapping == MAP_FAILED )
+    {
+        m_mapping = NULL;
+        return false;
+    }
+#endif
+
+    if( !Validate( (const KdasmU16*)m_mapping, m_mappingSize ) )
+    {
+        Unmap();
+        return false;
+    }
+    return true;
+}
+
+void KdasmFile::Unmap( void )
+{
+#if defined(_WIN32)
+    if( m_mapping )
+    {
+        ::UnmapViewOfFile( m_mapping );
+    }
+    if( m_mappingHandle )
+    {
+        ::CloseHandle( (HANDLE)m_mappingHandle );
+    }
+    if( m_fileHandle != INVALID_HANDLE_VALUE )
+    {
+        ::CloseHandle( (HANDLE)m_fileHandle );
+    }
+    m_fileHandle = INVALID_HANDLE_VALUE;
+    m_mappingHandle = NULL;
+#else
+    if( m_mapping )
+    {
+        ::munmap( m_mapping, (size_t)m_mappingSize );
+    }
+#endif
+    m_mapping = NULL;
+    m_mappingSize = 0;
+    m_encoding = NULL;
+    m_encodingSize = 0;
+    m_pageCount = 0;
+    m_alignment = 0;
+    m_metadata = NULL;
+    m_metadataSize = 0;
+}
+
+// Everything is checked against the file size before any of it is used.
+bool KdasmFile::Validate( const KdasmU16* header, KdasmU64 fileSize )
+{
+    if( header[INDEX_VERSION] != VERSION_1 || header[INDEX_HEADER_LENGTH] < HEADER_LENGTH || header[INDEX_ALIGNMENT_BITS] >= 32 )
+    {
+        return false;
+    }
+
+    KdasmU64 headerSize = sizeof( KdasmU16 ) * (KdasmU64)header[INDEX_HEADER_LENGTH];
+    KdasmU64 encodingOffset = ReadNumber( header + INDEX_ENCODING_OFFSET );
+    KdasmU64 encodingSize = ReadNumber( header + INDEX_ENCODING_SIZE );
+    KdasmU64 pageCount = ReadNumber( header + INDEX_PAGE_COUNT );
+    KdasmU64 metadataOffset = ReadNumber( header + INDEX_METADATA_OFFSET );
+    KdasmU64 metadataSize = ReadNumber( header + INDEX_METADATA_SIZE );
+    KdasmU64 alignment = (KdasmU64)1 << header[INDEX_ALIGNMENT_BITS];
+
+    if( headerSize > fileSize || encodingOffset > fileSize || ( encodingOffset & ( alignment - 1 ) ) != 0
+        || encodingSize < KdasmEncodingHeader::HEADER_LENGTH || encodingSize > ( fileSize - encodingOffset ) / sizeof( KdasmEncoding )
+        || metadataOffset < headerSize || metadataOffset > fileSize || metadataSize > fileSize - metadataOffset )
+    {
+        return false;
+    }
+
+    const KdasmEncoding* encoding = (const KdasmEncoding*)( (const char*)header + encodingOffset );
+    const KdasmEncodingHeader* encodingHeader = (const KdasmEncodingHeader*)encoding;
+    if( !encodingHeader->VersionCheck() || encodingHeader->GetPageBits() < KdasmEncodingHeader::PAGE_BITS_32B
+        || encodingHeader->GetPageBits() > KdasmEncodingHeader::PAGE_BITS_128B )
+    {
+        return false;
+    }
+    KdasmU64 pageWords = ( (KdasmU64)1 << encodingHeader->GetPageBits() ) / sizeof( KdasmEncoding );
+    if( pageCount != ( encodingSize + pageWords - 1 ) / pageWords )
+    {
+        return false;
+    }
+
+    m_encoding = encoding;
+    m_encodingSize = (intptr_t)encodingSize;
+    m_pageCount = (intptr_t)pageCount;
+    m_alignment = (intptr_t)alignment;
+    m_metadata = (const char*)header + metadataOffset;
+    m_metadataSize = (intptr_t)metadataSize;
+    return true;
+}
+
+// Returns the offset of the encoding.
+KdasmU64 KdasmFile::BuildHeader( KdasmU16* header, intptr_t encodingSize, intptr_t pageBytes, intptr_t metadataSize, intptr_t alignment )
+{
+    KdasmAssert( "Alignment must be a power of 2 of at least the page size", ( alignment & ( alignment - 1 ) ) == 0 && alignment >= pageBytes );
+
+    ::memset( header, 0, sizeof( KdasmU16 ) * HEADER_LENGTH );
+    int alignmentBits = 0;
+    while( ( (intptr_t)1 << alignmentBits ) < alignment )
+    {
+        ++alignmentBits;
+    }
+    KdasmU64 metadataOffset = sizeof( KdasmU16 ) * HEADER_LENGTH;
+    KdasmU64 encodingOffset = ( metadataOffset + (KdasmU64)metadataSize + (KdasmU64)alignment - 1 ) & ~(KdasmU64)( alignment - 1 );
+    intptr_t pageWords = pageBytes / (intptr_t)sizeof( KdasmEncoding );
+
+    header[INDEX_VERSION] = VERSION_1;
+    header[INDEX_HEADER_LENGTH] = HEADER_LENGTH;
+    WriteNumber( encodingOffset, header + INDEX_ENCODING_OFFSET );
+    WriteNumber( (KdasmU64)encodingSize, header + INDEX_ENCODING_SIZE );
+    WriteNumber( (KdasmU64)( ( encodingSize + pageWords - 1 ) / pageWords ), header + INDEX_PAGE_COUNT );
+    WriteNumber( metadataOffset, header + INDEX_METADATA_OFFSET );
+    WriteNumber( (KdasmU64)metadataSize, header + INDEX_METADATA_SIZE );
+    header[INDEX_ALIGNMENT_BITS] = (KdasmU16)alignmentBits;
+    return encodingOffset;
+}
+
+// Creates the file at its final size and maps it.  A new file reads as zeros, so the
+// alignment padding is not written.
+KdasmEncoding* KdasmFile::OutputToFile( void* data, intptr_t size )
+{
+    FileOutput* fileOutput = (FileOutput*)data;
+
+    KdasmU16 header[HEADER_LENGTH];
+    KdasmU64 encodingOffset = BuildHeader( header, size, (intptr_t)1 << fileOutput->m_pageBits, fileOutput->m_metadataSize, fileOutput->m_alignment );
+    KdasmU64 fileSize = encodingOffset + sizeof( KdasmEncoding ) * (KdasmU64)size;
+    if( fileSize != (KdasmU64)(size_t)fileSize )
+    {
+        return NULL;
+    }
+
+#if defined(_WIN32)
+    HANDLE fileHandle = ::CreateFileA( fileOutput->m_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+    if( fileHandle == INVALID_HANDLE_VALUE )
+    {
+        return NULL;
+    }
+    HANDLE mappingHandle = ::CreateFileMappingA( fileHandle, NULL, PAGE_READWRITE, (DWORD)( fileSize >> 32 ), (DWORD)fileSize, NULL );
+    void* mapping = mappingHandle ? ::MapViewOfFile( mappingHandle, FILE_MAP_WRITE, 0, 0, 0 ) : NULL;
+    if( mappingHandle )
+    {
+        ::CloseHandle( mappingHandle );
+    }
+    ::CloseHandle( fileHandle ); // The view keeps the file open.
+#else
+    int fd = ::open( fileOutput->m_path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 )
+    {
+        return NULL;
+    }
+    void* mapping = MAP_FAILED;
+    if( ::ftruncate( fd, (off_t)fileSize ) == 0 )
+    {
+        mapping = ::mmap( NULL, (size_t)fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    }
+    ::close( fd ); // The mapping keeps the file open.
+    mapping = ( mapping == MAP_FAILED ) ? NULL : mapping;
+#endif
+
+    if( !mapping )
+    {
+        return NULL;
+    }
+    fileOutput->m_mapping = mapping;
+    fileOutput->m_mappingSize = fileSize;
+
+    KdasmU64 metadataOffset = sizeof header;
+    ::memcpy( mapping, header, sizeof header );
+    if( fileOutput->m_metadataSize > 0 )
+    {
+        ::memcpy( (char*)mapping + metadataOffset, fileOutput->m_metadata, (size_t)fileOutput->m_metadataSize );
+    }
+    return (KdasmEncoding*)( (char*)mapping + encodingOffset );
+}
+
+void KdasmFile::WriteNumber( KdasmU64 x, KdasmU16* words )
+{
+    for( int i = NUMBER_LENGTH; i-- != 0; /**/ )
+    {
+        words[i] = (KdasmU16)x;
+        x >>= 16;
+    }
+}
+
+KdasmU64 KdasmFile::ReadNumber( const KdasmU16* words )
+{
+    KdasmU64 x = 0;
+    for( int i=0; i < NUMBER_LENGTH; ++i )
+    {
+        x = ( x << 16 ) | (KdasmU64)words[i];
+    }
+    return x;
+}
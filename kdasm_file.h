@@ -0,0 +1,100 @@
+#ifndef KDASM_FILE_H
+#define KDASM_FILE_H
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include "kdasm_assembler.h"
+
+// ----------------------------------------------------------------------------
+// KdasmFile is a file holding an encoding, mapped read-only so that it is used in
+// place.  The operating system loads the pages of the encoding as they are touched
+// and shares them between processes.
+//
+// The file starts with HEADER_LENGTH KdasmU16, followed by optional metadata bytes
+// and then the encoding at a multiple of the alignment.  Like the encoding, the file
+// is in native byte order.  Numbers are stored in 4 KdasmU16, most significant first.
+
+class KdasmFile
+{
+public:
+    enum {
+        VERSION_1         = 0x666b,    // 'k','f'
+        HEADER_LENGTH     = 23,
+        DEFAULT_ALIGNMENT = 4096       // Bytes.  A typical virtual memory page.
+    };
+
+    KdasmFile( void );
+    ~KdasmFile( void ) { Unmap(); }
+
+    // Writes the encoding and a copy of metadata.  alignment is a power of 2 of at
+    // least the page size of the encoding.
+    static bool Write( const char* path, const KdasmEncoding* encoding, intptr_t encodingSize,
+                       const void* metadata=NULL, intptr_t metadataSize=0, intptr_t alignment=DEFAULT_ALIGNMENT );
+    // Like Write() but the assembler writes the encoding straight into a writable
+    // mapping of the file.  Returns the result of KdasmAssembler::Assemble(), so the
+    // file may be written even if it returns false.
+    static bool Assemble( const char* path, KdasmAssembler& assembler, KdasmAssemblerNode* root, KdasmEncodingHeader::PageBits pageBits,
+                          const void* metadata=NULL, intptr_t metadataSize=0, intptr_t alignment=DEFAULT_ALIGNMENT );
+
+    // Returns false if the file cannot be mapped or is not a valid KdasmFile.
+    bool Map( const char* path );
+    void Unmap( void );
+
+    // Aligned to GetAlignment() up to the virtual memory page size.  Valid until Unmap().
+    const KdasmEncoding* GetEncoding( void ) const  { return m_encoding; }
+    intptr_t GetEncodingSize( void ) const          { return m_encodingSize; }   // In KdasmU16.
+    intptr_t GetPageCount( void ) const             { return m_pageCount; }
+    intptr_t GetAlignment( void ) const             { return m_alignment; }
+    const void* GetMetadata( void ) const           { return m_metadata; }
+    intptr_t GetMetadataSize( void ) const          { return m_metadataSize; }
+
+private:
+    enum {
+        INDEX_VERSION         = 0,
+        INDEX_HEADER_LENGTH   = 1,
+        INDEX_ENCODING_OFFSET = 2,      // Bytes from the start of the file.
+        INDEX_ENCODING_SIZE   = 6,
+        INDEX_PAGE_COUNT      = 10,
+        INDEX_METADATA_OFFSET = 14,
+        INDEX_METADATA_SIZE   = 18,
+        INDEX_ALIGNMENT_BITS  = 22,
+        NUMBER_LENGTH         = 4
+    };
+
+    // Where Assemble() output goes.
+    struct FileOutput
+    {
+        const char*                     m_path;
+        KdasmEncodingHeader::PageBits   m_pageBits;
+        const void*                     m_metadata;
+        intptr_t                        m_metadataSize;
+        intptr_t                        m_alignment;
+        void*                           m_mapping;
+        KdasmU64                        m_mappingSize;
+    };
+
+    KdasmFile( const KdasmFile& ); // undefined
+    KdasmFile& operator=( const KdasmFile& ); // undefined
+
+    static KdasmU64 BuildHeader( KdasmU16* header, intptr_t encodingSize, intptr_t pageBytes, intptr_t metadataSize, intptr_t alignment );
+    static KdasmEncoding* OutputToFile( void* data, intptr_t size );
+    bool Validate( const KdasmU16* header, KdasmU64 fileSize );
+    static void WriteNumber( KdasmU64 x, KdasmU16* words );
+    static KdasmU64 ReadNumber( const KdasmU16* words );
+
+    const KdasmEncoding* m_encoding;
+    intptr_t             m_encodingSize;
+    intptr_t             m_pageCount;
+    intptr_t             m_alignment;
+    const void*          m_metadata;
+    intptr_t             m_metadataSize;
+    void*                m_mapping;
+    KdasmU64             m_mappingSize;
+#if defined(_WIN32)
+    void*                m_fileHandle;
+    void*                m_mappingHandle;
+#endif
+};
+
+#endif // KDASM_FILE_H
@@ -0,0 +1,207 @@
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include <algorithm>
+#include "kdasm_patch.h"
+
+// ----------------------------------------------------------------------------
+// KdasmPatch
+
+KdasmPatch::KdasmPatch( void )
+{
+    ::memset( &m_report, 0, sizeof m_report );
+}
+
+void KdasmPatch::Diff( const KdasmEncoding* oldEncoding, intptr_t oldSize, const KdasmEncoding* newEncoding, intptr_t newSize, std::vector<KdasmU16>& patch )
+{
+    const KdasmEncodingHeader* header = (const KdasmEncodingHeader*)newEncoding;
+    KdasmAssert( "Version Incorrect", header->VersionCheck() );
+    intptr_t pageWords = (intptr_t)1 << ( header->GetPageBits() - 1 );
+
+    ::memset( &m_report, 0, sizeof m_report );
+    m_report.m_pageCount = ( newSize + pageWords - 1 ) / pageWords;
+
+    patch.clear();
+    patch.push_back( VERSION_1 );
+    WriteNumber( oldSize, patch );
+    WriteNumber( newSize, patch );
+    WriteNumber( Hash( oldEncoding, oldSize ), patch );
+    WriteNumber( Hash( newEncoding, newSize ), patch );
+
+    // Consecutive changed pages share a run.
+    intptr_t runStart = -1;
+    for( intptr_t page=0; page <= m_report.m_pageCount; ++page )
+    {
+        intptr_t start = page * pageWords;
+        intptr_t end = std::min( start + pageWords, newSize );
+        bool isChanged = false;
+        if( page < m_report.m_pageCount )
+        {
+            isChanged = end > oldSize || ::memcmp( oldEncoding + start, newEncoding + start, ( end - start ) * sizeof( KdasmEncoding ) ) != 0;
+        }
+
+        if( isChanged )
+        {
+            ++m_report.m_changedPageCount;
+            if( runStart == -1 )
+            {
+                runStart = start;
+            }
+        }
+        else if( runStart != -1 )
+        {
+            intptr_t runEnd = std::min( start, newSize );
+            WriteNumber( runStart, patch );
+            WriteNumber( runEnd - runStart, patch );
+            for( intptr_t i=runStart; i < runEnd; ++i )
+            {
+                patch.push_back( newEncoding[i].GetRaw() );
+            }
+            ++m_report.m_runCount;
+            runStart = -1;
+        }
+    }
+    m_report.m_patchSize = (intptr_t)patch.size();
+}
+
+bool KdasmPatch::Apply( std::vector<KdasmEncoding>& encoding, const KdasmU16* patch, intptr_t patchSize )
+{
+    intptr_t size = (intptr_t)encoding.size();
+    intptr_t patchedSize = GetPatchedSize( patch, patchSize );
+    if( patchedSize < 0 || ReadNumber( patch + INDEX_OLD_SIZE ) != size )
+    {
+        return false;
+    }
+
+    KdasmEncoding pad; pad.SetRaw( KdasmEncoding::PAD_VALUE );
+    encoding.resize( std::max( size, patchedSize ), pad );
+    bool isApplied = Apply( &encoding[0], size, (intptr_t)encoding.size(), patch, patchSize );
+    encoding.resize( isApplied ? patchedSize : size );
+    return isApplied;
+}
+
+bool KdasmPatch::Apply( KdasmEncoding* encoding, intptr_t encodingSize, intptr_t encodingCapacity, const KdasmU16* patch, intptr_t patchSize )
+{
+    intptr_t patchedSize = GetPatchedSize( patch, patchSize );
+    if( patchedSize < 0 || patchedSize > encodingCapacity || ReadNumber( patch + INDEX_OLD_SIZE ) != encodingSize
+        || ReadWords( patch + INDEX_OLD_HASH ) != Hash( encoding, encodingSize )
+        || ReadWords( patch + INDEX_NEW_HASH ) != HashPatched( encoding, encodingSize, patch, patchSize ) )
+    {
+        return false;
+    }
+
+    const KdasmU16* run = patch + HEADER_LENGTH;
+    const KdasmU16* patchEnd = patch + patchSize;
+    while( run != patchEnd )
+    {
+        intptr_t start = ReadNumber( run );
+        intptr_t length = ReadNumber( run + NUMBER_LENGTH );
+        for( intptr_t i=0; i < length; ++i )
+        {
+            encoding[start + i].SetRaw( run[2 * NUMBER_LENGTH + i] );
+        }
+        run += 2 * NUMBER_LENGTH + length;
+    }
+    return true;
+}
+
+intptr_t KdasmPatch::GetPatchedSize( const KdasmU16* patch, intptr_t patchSize )
+{
+    return Validate( patch, patchSize ) ? ReadNumber( patch + INDEX_NEW_SIZE ) : -1;
+}
+
+// Checks every run before anything is written.
+bool KdasmPatch::Validate( const KdasmU16* patch, intptr_t patchSize )
+{
+    if( patchSize < HEADER_LENGTH || patch[0] != VERSION_1 )
+    {
+        return false;
+    }
+
+    intptr_t newSize = ReadNumber( patch + INDEX_NEW_SIZE );
+    intptr_t runEnd = 0;
+    intptr_t i = HEADER_LENGTH;
+    while( i != patchSize )
+    {
+        if( patchSize - i < 2 * NUMBER_LENGTH )
+        {
+            return false;
+        }
+        intptr_t start = ReadNumber( patch + i );
+        intptr_t length = ReadNumber( patch + i + NUMBER_LENGTH );
+        i += 2 * NUMBER_LENGTH;
+        if( start < runEnd || length < 0 || length > newSize - start || length > patchSize - i )
+        {
+            return false;
+        }
+        runEnd = start + length;
+        i += length;
+    }
+    return newSize >= 0;
+}
+
+KdasmU64 KdasmPatch::Hash( const KdasmEncoding* encoding, intptr_t size )
+{
+    KdasmU64 hash = ( (KdasmU64)0xcbf29ce4 << 32 ) | 0x84222325;
+    for( intptr_t i=0; i < size; ++i )
+    {
+        hash = HashWord( hash, encoding[i].GetRaw() );
+    }
+    return hash;
+}
+
+// The hash the encoding will have once the patch is applied.  Words past the end of
+// the encoding that no run covers are PAD_VALUE.
+KdasmU64 KdasmPatch::HashPatched( const KdasmEncoding* encoding, intptr_t encodingSize, const KdasmU16* patch, intptr_t patchSize )
+{
+    KdasmU64 hash = ( (KdasmU64)0xcbf29ce4 << 32 ) | 0x84222325;
+    intptr_t newSize = ReadNumber( patch + INDEX_NEW_SIZE );
+    const KdasmU16* run = patch + HEADER_LENGTH;
+    const KdasmU16* patchEnd = patch + patchSize;
+    intptr_t i = 0;
+    while( i < newSize )
+    {
+        intptr_t start = ( run != patchEnd ) ? ReadNumber( run ) : newSize;
+        for( ; i < start; ++i )
+        {
+            hash = HashWord( hash, ( i < encodingSize ) ? encoding[i].GetRaw() : (KdasmU16)KdasmEncoding::PAD_VALUE );
+        }
+        if( run != patchEnd )
+        {
+            intptr_t length = ReadNumber( run + NUMBER_LENGTH );
+            run += 2 * NUMBER_LENGTH;
+            for( intptr_t j=0; j < length; ++j )
+            {
+                hash = HashWord( hash, run[j] );
+            }
+            run += length;
+            i += length;
+        }
+    }
+    return hash;
+}
+
+// FNV-1a.
+KdasmU64 KdasmPatch::HashWord( KdasmU64 hash, KdasmU16 word )
+{
+    return ( hash ^ word ) * ( ( (KdasmU64)1 << 40 ) | 0x1b3 );
+}
+
+void KdasmPatch::WriteNumber( KdasmU64 x, std::vector<KdasmU16>& patch )
+{
+    for( int i = NUMBER_LENGTH; i-- != 0; /**/ )
+    {
+        patch.push_back( (KdasmU16)( x >> ( i * 16 ) ) );
+    }
+}
+
+KdasmU64 KdasmPatch::ReadWords( const KdasmU16* words )
+{
+    KdasmU64 u = 0;
+    for( int i=0; i < NUMBER_LENGTH; ++i )
+    {
+        u = ( u << 16 ) | (KdasmU64)words[i];
+    }
+    return u;
+}
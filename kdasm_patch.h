@@ -0,0 +1,76 @@
+#ifndef KDASM_PATCH_H
+#define KDASM_PATCH_H
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include <vector>
+
+#include "kdasm_assembler.h"
+
+// ----------------------------------------------------------------------------
+// KdasmPatch is the difference between two encodings, one page at a time.  Pages
+// that are unchanged, e.g. those left alone by KdasmAssembler::Reassemble() or
+// KdasmLeafUpdater, are not stored.  A patch only applies to the encoding it was made
+// from, which is checked with a hash of its words.  So is the result.
+//
+// A patch is a sequence of KdasmU16 in native byte order like the encoding.  It starts
+// with VERSION_1, the old and new sizes of the encoding, their hashes and then holds
+// runs of changed words.  Each run is its start and length followed by the words.
+// Runs are in order.  Sizes, hashes, starts and lengths are stored in 4 words, most
+// significant first.
+
+class KdasmPatch
+{
+public:
+    enum {
+        VERSION_1     = 0x706b,    // 'k','p'
+        NUMBER_LENGTH = 4,
+        HEADER_LENGTH = 1 + 4 * NUMBER_LENGTH
+    };
+
+    // Describes the patch made by the last Diff().
+    struct Report
+    {
+        intptr_t m_pageCount;               // Of the new encoding.
+        intptr_t m_changedPageCount;
+        intptr_t m_runCount;
+        intptr_t m_patchSize;               // KdasmU16 in the patch.
+    };
+
+    KdasmPatch( void );
+
+    // Pages are sized by the KdasmEncodingHeader of newEncoding.
+    void Diff( const KdasmEncoding* oldEncoding, intptr_t oldSize, const KdasmEncoding* newEncoding, intptr_t newSize, std::vector<KdasmU16>& patch );
+
+    // Returns false without changing the encoding if the patch is damaged or was made
+    // from another encoding.
+    bool Apply( std::vector<KdasmEncoding>& encoding, const KdasmU16* patch, intptr_t patchSize );
+    // Applies a patch in place.  The encoding must have room for GetPatchedSize() words.
+    bool Apply( KdasmEncoding* encoding, intptr_t encodingSize, intptr_t encodingCapacity, const KdasmU16* patch, intptr_t patchSize );
+
+    // Size of the encoding after the patch is applied, or -1 if the patch is damaged.
+    static intptr_t GetPatchedSize( const KdasmU16* patch, intptr_t patchSize );
+
+    const Report& GetReport( void ) const   { return m_report; }
+
+private:
+    enum {
+        INDEX_OLD_SIZE = 1,
+        INDEX_NEW_SIZE = INDEX_OLD_SIZE + NUMBER_LENGTH,
+        INDEX_OLD_HASH = INDEX_NEW_SIZE + NUMBER_LENGTH,
+        INDEX_NEW_HASH = INDEX_OLD_HASH + NUMBER_LENGTH
+    };
+
+    static bool Validate( const KdasmU16* patch, intptr_t patchSize );
+    static KdasmU64 Hash( const KdasmEncoding* encoding, intptr_t size );
+    static KdasmU64 HashPatched( const KdasmEncoding* encoding, intptr_t encodingSize, const KdasmU16* patch, intptr_t patchSize );
+    static KdasmU64 HashWord( KdasmU64 hash, KdasmU16 word );
+    static void WriteNumber( KdasmU64 x, std::vector<KdasmU16>& patch );
+    static KdasmU64 ReadWords( const KdasmU16* words );
+    static intptr_t ReadNumber( const KdasmU16* words )   { return (intptr_t)ReadWords( words ); }
+
+    Report m_report;
+};
+
+#endif // KDASM_PATCH_H
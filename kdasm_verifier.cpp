@@ -0,0 +1,285 @@
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include "kdasm_verifier.h"
+
+// ----------------------------------------------------------------------------
+// KdasmVerifier
+
+KdasmVerifier::KdasmVerifier( void )
+{
+    m_encoding = NULL;
+    m_size = 0;
+    m_leafArrayCount = 0;
+    m_distanceLength = 0;
+    m_leafBits = KdasmEncodingHeader::LEAF_BITS_16;
+    m_isPackedLeaves = false;
+    m_isLeafRanges = false;
+    m_isLeafSlack = false;
+    m_error = ERROR_NONE;
+    m_errorIndex = 0;
+}
+
+bool KdasmVerifier::Verify( const KdasmEncoding* encoding, intptr_t size, intptr_t leafArraySize )
+{
+    m_encoding = encoding;
+    m_size = size;
+    m_error = ERROR_NONE;
+    m_errorIndex = 0;
+
+    const KdasmEncodingHeader* header = (const KdasmEncodingHeader*)encoding;
+    if( size < KdasmEncodingHeader::HEADER_LENGTH || !header->VersionCheck()
+        || header->GetPageBits() < KdasmEncodingHeader::PAGE_BITS_32B || header->GetPageBits() > KdasmEncodingHeader::PAGE_BITS_128B
+        || header->GetLeafBits() > KdasmEncodingHeader::LEAF_BITS_64 )
+    {
+        return Fail( ERROR_HEADER, 0 );
+    }
+    if( size == KdasmEncodingHeader::HEADER_LENGTH )
+    {
+        return Fail( ERROR_OUT_OF_BOUNDS, 0 );
+    }
+
+    m_distanceLength = (int)header->GetDistanceLength();
+    m_leafBits = header->GetLeafBits();
+    m_leafArrayCount = ( leafArraySize > 0 ) ? leafArraySize >> m_leafBits : 0;
+    m_isPackedLeaves = header->IsPackedLeaves();
+    m_isLeafRanges = header->IsLeafRanges();
+    m_isLeafSlack = header->IsLeafSlack();
+
+    if( header->IsLeavesAtRoot() )
+    {
+        return VerifyLeavesFar( KdasmEncodingHeader::HEADER_LENGTH );
+    }
+
+    m_marks.assign( ( size + 15 ) >> 4, 0 );
+    m_stack.clear();
+
+    Visit root = { KdasmEncodingHeader::HEADER_LENGTH, 0 };
+    m_stack.push_back( root );
+    while( !m_stack.empty() )
+    {
+        Visit v = m_stack.back();
+        m_stack.pop_back();
+        if( v.m_treeIndex == FINISH )
+        {
+            SetMark( v.m_index, MARK_FINISHED );
+            continue;
+        }
+
+        // The first word referenced by each word is followed without the stack.
+        while( v.m_index >= 0 )
+        {
+            KdasmU32 marks = GetMarks( v.m_index );
+            if( marks != 0 )
+            {
+                // Shared subtrees are reached again at their page roots.
+                if( v.m_treeIndex == 0 && ( marks & MARK_FINISHED ) != 0 )
+                {
+                    break;
+                }
+                return Fail( ERROR_CYCLE, v.m_index );
+            }
+            SetMark( v.m_index, MARK_VISITED );
+
+            if( v.m_treeIndex == 0 )
+            {
+                Visit finish = { v.m_index, FINISH };
+                m_stack.push_back( finish );
+            }
+            if( !VerifyWord( v ) )
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Verifies the word at v and replaces v with the first word it references.  Any
+// other word referenced is pushed.
+bool KdasmVerifier::VerifyWord( Visit& v )
+{
+    intptr_t index = v.m_index;
+    intptr_t treeIndex = v.m_treeIndex;
+    v.m_index = -1;
+
+    const KdasmEncoding& x = m_encoding[index];
+    if( x.GetNomal() != KdasmEncoding::NORMAL_OPCODE )
+    {
+        if( ( x.GetStop0() && x.GetStop1() ) || m_distanceLength == 0 )
+        {
+            return Fail( ERROR_INVALID_WORD, index );
+        }
+        if( m_distanceLength > 1 && (intptr_t)x.GetOffset() + m_distanceLength - 1 > m_size - index )
+        {
+            return Fail( ERROR_OUT_OF_BOUNDS, index );
+        }
+
+        // Destination index is "2n+1" or "2n+2" however encoding is already offset by n.
+        intptr_t lastSubnode = x.GetStop1() ? 1 : 2;
+        if( treeIndex + lastSubnode >= m_size - index )
+        {
+            return Fail( ERROR_OUT_OF_BOUNDS, index );
+        }
+        if( !x.GetStop1() )
+        {
+            v.m_index = index + treeIndex + 2;
+            v.m_treeIndex = treeIndex * 2 + 2;
+        }
+        if( !x.GetStop0() )
+        {
+            if( v.m_index >= 0 )
+            {
+                m_stack.push_back( v );
+            }
+            v.m_index = index + treeIndex + 1;
+            v.m_treeIndex = treeIndex * 2 + 1;
+        }
+        return true;
+    }
+
+    intptr_t target = 0;
+    switch( x.GetOpcode() )
+    {
+        case KdasmEncoding::OPCODE_LEAVES:
+        {
+            intptr_t dataIndex = index + (intptr_t)x.GetOffset();
+            return VerifyLeaves( index, dataIndex, (intptr_t)x.GetLength(), m_isLeafSlack ? dataIndex - 1 : -1 );
+        }
+        case KdasmEncoding::OPCODE_LEAVES_FAR:
+        {
+            return VerifyFarOffset( index, target ) && VerifyLeavesFar( target );
+        }
+        case KdasmEncoding::OPCODE_JUMP:
+        {
+            if( !VerifyTarget( index, x.GetOffsetSigned() ) )
+            {
+                return Fail( ERROR_OUT_OF_BOUNDS, index );
+            }
+            v.m_index = index + x.GetOffsetSigned();
+            v.m_treeIndex = (intptr_t)x.GetTreeIndexStart();
+            return true;
+        }
+        default: // OPCODE_JUMP_FAR
+        {
+            if( !VerifyFarOffset( index, target ) )
+            {
+                return false;
+            }
+            v.m_index = target;
+            v.m_treeIndex = 0;
+            return true;
+        }
+    }
+}
+
+// Nodes are never in the header.
+bool KdasmVerifier::VerifyTarget( intptr_t index, intptr_t offset )
+{
+    return offset >= KdasmEncodingHeader::HEADER_LENGTH - index && offset < m_size - index;
+}
+
+bool KdasmVerifier::VerifyFarOffset( intptr_t index, intptr_t& target )
+{
+    const KdasmEncoding& x = m_encoding[index];
+    if( !x.GetIsImmediateOffset() )
+    {
+        // The far words are sign extended in an intptr_t, so the top word is never read.
+        intptr_t wordCount = (intptr_t)x.GetFarWordsCount();
+        if( wordCount == 0 || wordCount > (intptr_t)( sizeof( intptr_t ) / sizeof( KdasmU16 ) ) - 1 )
+        {
+            return Fail( ERROR_INVALID_WORD, index );
+        }
+        if( (intptr_t)x.GetFarWordsOffset() + wordCount > m_size - index )
+        {
+            return Fail( ERROR_OUT_OF_BOUNDS, index );
+        }
+    }
+
+    intptr_t offset = x.GetFarOffset();
+    if( !VerifyTarget( index, offset ) )
+    {
+        return Fail( ERROR_OUT_OF_BOUNDS, index );
+    }
+    target = index + offset;
+    return true;
+}
+
+// The header of the leaves at the root has no capacity.
+bool KdasmVerifier::VerifyLeavesFar( intptr_t headerIndex )
+{
+    intptr_t wordCount = (intptr_t)m_encoding[headerIndex].GetRaw();
+    if( wordCount == KdasmEncoding::LEAF_COUNT_OVERFLOW )
+    {
+        if( KdasmEncoding::LEAF_COUNT_OVERFLOW_LENGTH > m_size - headerIndex )
+        {
+            return Fail( ERROR_OUT_OF_BOUNDS, headerIndex );
+        }
+        wordCount = ( (intptr_t)m_encoding[headerIndex + 1].GetRaw() << 16 ) | (intptr_t)m_encoding[headerIndex + 2].GetRaw();
+        return VerifyLeaves( headerIndex, headerIndex + KdasmEncoding::LEAF_COUNT_OVERFLOW_LENGTH, wordCount, -1 );
+    }
+    bool isCapacity = m_isLeafSlack && headerIndex != KdasmEncodingHeader::HEADER_LENGTH;
+    return VerifyLeaves( headerIndex, headerIndex + 1, wordCount, isCapacity ? headerIndex - 1 : -1 );
+}
+
+// capacityIndex is -1 without a capacity.
+bool KdasmVerifier::VerifyLeaves( intptr_t lengthIndex, intptr_t dataIndex, intptr_t wordCount, intptr_t capacityIndex )
+{
+    if( wordCount > m_size - dataIndex )
+    {
+        return Fail( ERROR_OUT_OF_BOUNDS, lengthIndex );
+    }
+    if( capacityIndex >= 0 )
+    {
+        intptr_t capacity = (intptr_t)m_encoding[capacityIndex].GetRaw();
+        if( capacity < wordCount )
+        {
+            return Fail( ERROR_LEAF_BLOCK, lengthIndex );
+        }
+        if( capacity > m_size - dataIndex )
+        {
+            return Fail( ERROR_OUT_OF_BOUNDS, lengthIndex );
+        }
+    }
+
+    const KdasmEncoding* block = m_encoding + dataIndex;
+    if( m_isLeafRanges )
+    {
+        if( wordCount != 2 && wordCount != 4 )
+        {
+            return Fail( ERROR_LEAF_BLOCK, lengthIndex );
+        }
+        KdasmLeafRange range = KdasmLeafRange::FromWords( block, wordCount );
+        if( range.m_start > m_leafArrayCount || range.m_count > m_leafArrayCount - range.m_start )
+        {
+            return Fail( ERROR_OUT_OF_BOUNDS, lengthIndex );
+        }
+    }
+    else if( m_isPackedLeaves )
+    {
+        // The count may follow the first word.
+        if( wordCount < 1 )
+        {
+            return Fail( ERROR_LEAF_BLOCK, lengthIndex );
+        }
+        bool isCountEscape = ( block->GetRaw() >> KdasmPackedLeaves::COUNT_SHIFT ) == KdasmPackedLeaves::COUNT_ESCAPE;
+        if( wordCount < ( isCountEscape ? 2 : 1 ) || ( block->GetRaw() & KdasmPackedLeaves::BIT_WIDTH_MASK ) > 16
+            || KdasmPackedLeaves::GetLength( block ) != wordCount )
+        {
+            return Fail( ERROR_LEAF_BLOCK, lengthIndex );
+        }
+    }
+    else if( ( wordCount & ( ( (intptr_t)1 << m_leafBits ) - 1 ) ) != 0 )
+    {
+        return Fail( ERROR_LEAF_BLOCK, lengthIndex );
+    }
+    return true;
+}
+
+bool KdasmVerifier::Fail( Error error, intptr_t index )
+{
+    m_error = error;
+    m_errorIndex = index;
+    return false;
+}
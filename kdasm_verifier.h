@@ -0,0 +1,90 @@
+#ifndef KDASM_VERIFIER_H
+#define KDASM_VERIFIER_H
+// Copyright (c) 2012 Adrian Johnston.  All rights reserved.
+// See Copyright Notice in kdasm.h
+// Project Homepage: http://code.google.com/p/kdasm/
+
+#include <vector>
+
+#include "kdasm.h"
+
+// ----------------------------------------------------------------------------
+// KdasmVerifier checks an encoding from an untrusted source before it is queried.
+// Every word a query could read is checked against the encoding size: cutting
+// planes, their extra distance words, jumps, far offsets and leaf blocks.  Cycles
+// are rejected, so every query ends.
+//
+// Each word is visited once.  A word may only be reached again as a page root with
+// a tree index of 0, as shared subtrees are.  Memory used is 2 bits per word of the
+// encoding and a stack as deep as the tree.  It is kept between calls, so verifying
+// encodings of a similar size does not allocate.
+//
+// The marks are an accepted limit: they are 1/8th the size of the encoding, not
+// constant.  They are what rejects cycles and limits the work to one visit per
+// word, and marking fewer words would let a hostile encoding reach a shared word
+// through an unbounded number of paths.  Verification is also slower than a
+// single pass over the encoding at memory bandwidth.
+
+class KdasmVerifier
+{
+public:
+    enum Error {
+        ERROR_NONE,
+        ERROR_HEADER,               // Unknown version, page size or leaf size.
+        ERROR_OUT_OF_BOUNDS,        // A reference leaves the encoding or leaf array.
+        ERROR_INVALID_WORD,         // PAD_VALUE or a far offset that cannot be read.
+        ERROR_LEAF_BLOCK,           // Length does not match the leaf format.
+        ERROR_CYCLE                 // Or a word reached again other than as a page root.
+    };
+
+    KdasmVerifier( void );
+
+    // size is in KdasmU16.  leafArraySize is the KdasmU16 in the leaf array required
+    // by KdasmEncodingHeader::IsLeafRanges().
+    bool Verify( const KdasmEncoding* encoding, intptr_t size, intptr_t leafArraySize=0 );
+
+    Error GetError( void ) const            { return m_error; }
+    intptr_t GetErrorIndex( void ) const    { return m_errorIndex; }   // Word where the error was found.
+
+private:
+    enum {
+        FINISH          = -1,   // Stack entry that marks a page root as verified.
+        MARK_VISITED    = 1,
+        MARK_FINISHED   = 2,    // Page roots with all of their subtree verified.
+        MARK_BITS       = 2
+    };
+
+    struct Visit
+    {
+        intptr_t m_index;       // -1 when there is nothing to follow.
+        intptr_t m_treeIndex;   // Or FINISH.
+    };
+
+    KdasmVerifier( const KdasmVerifier& ); // undefined
+    KdasmVerifier& operator=( const KdasmVerifier& ); // undefined
+
+    bool VerifyWord( Visit& v );
+    bool VerifyTarget( intptr_t index, intptr_t offset );
+    bool VerifyFarOffset( intptr_t index, intptr_t& target );
+    bool VerifyLeavesFar( intptr_t headerIndex );
+    bool VerifyLeaves( intptr_t lengthIndex, intptr_t dataIndex, intptr_t wordCount, intptr_t capacityIndex );
+    bool Fail( Error error, intptr_t index );
+
+    KdasmU32 GetMarks( intptr_t index ) const   { return ( m_marks[index >> 4] >> ( ( index & 15 ) * MARK_BITS ) ) & 3u; }
+    void SetMark( intptr_t index, KdasmU32 mark ) { m_marks[index >> 4] |= mark << ( ( index & 15 ) * MARK_BITS ); }
+
+    const KdasmEncoding*          m_encoding;
+    intptr_t                      m_size;
+    intptr_t                      m_leafArrayCount;    // Leaves.
+    int                           m_distanceLength;
+    KdasmEncodingHeader::LeafBits m_leafBits;
+    bool                          m_isPackedLeaves;
+    bool                          m_isLeafRanges;
+    bool                          m_isLeafSlack;
+    Error                         m_error;
+    intptr_t                      m_errorIndex;
+    std::vector<KdasmU32>         m_marks;             // MARK_BITS for each word.
+    std::vector<Visit>            m_stack;
+};
+
+#endif // KDASM_VERIFIER_H